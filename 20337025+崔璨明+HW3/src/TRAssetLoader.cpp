@@ -0,0 +1,179 @@
+#include "TRAssetLoader.h"
+
+#include <chrono>
+#include <algorithm>
+
+#include "TRShadingPipeline.h"
+
+namespace TinyRenderer
+{
+	std::mutex TRAssetLoader::m_texture_mutex;
+	std::map<std::string, TRAssetLoader::TextureFuture> TRAssetLoader::m_texture_cache;
+	std::map<std::string, int> TRAssetLoader::m_texture_units;
+
+	TRAssetLoader::TRAssetLoader(int num_threads)
+	{
+		for (int i = 0; i < std::max(num_threads, 1); ++i)
+		{
+			m_workers.push_back(std::thread(&TRAssetLoader::workerLoop, this));
+		}
+	}
+
+	TRAssetLoader::~TRAssetLoader()
+	{
+		//Note: the queued tasks are still run, so that no texture in the cache is left unresolved
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_task_cond.notify_all();
+		for (auto &worker : m_workers)
+		{
+			worker.join();
+		}
+	}
+
+	void TRAssetLoader::submit(std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_tasks.push_back(std::move(task));
+		}
+		m_task_cond.notify_one();
+	}
+
+	void TRAssetLoader::workerLoop()
+	{
+		while (true)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_task_cond.wait(lock, [this]() { return m_stop || !m_tasks.empty(); });
+				if (m_tasks.empty())
+					return;
+				task = std::move(m_tasks.front());
+				m_tasks.pop_front();
+			}
+			task();
+		}
+	}
+
+	TRDrawableMesh::ptr TRAssetLoader::loadMesh(const std::string &filename, bool reorderFaces)
+	{
+		auto pending = std::make_shared<PendingMesh>();
+		pending->handle = std::make_shared<TRDrawableMesh>();
+		pending->staging = std::make_shared<TRDrawableMesh>();
+
+		//Parse the mesh, then decode its textures in parallel
+		//Note: the workers never wait for each other
+		auto task = std::make_shared<std::packaged_task<void()>>([this, pending, filename, reorderFaces]()
+		{
+			pending->staging->loadMeshData(filename, reorderFaces, pending->texPaths);
+			for (const auto &path : pending->texPaths)
+			{
+				pending->textures.push_back(requestTexture(path, this));
+			}
+		});
+		pending->parsed = task->get_future();
+		m_pending_meshes.push_back(pending);
+		submit([task]() { (*task)(); });
+
+		return pending->handle;
+	}
+
+	int TRAssetLoader::update()
+	{
+		auto isReady = [](const std::future<void> &f)
+		{
+			return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+		};
+		auto isTextureReady = [](const TextureFuture &f)
+		{
+			return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+		};
+
+		auto publish = [&](const std::shared_ptr<PendingMesh> &pending) -> bool
+		{
+			if (!isReady(pending->parsed) || !std::all_of(pending->textures.begin(), pending->textures.end(), isTextureReady))
+				return false;
+
+			std::vector<int> texUnits;
+			for (const auto &path : pending->texPaths)
+			{
+				texUnits.push_back(getTextureUnit(path));
+			}
+
+			pending->handle->swapMeshData(*pending->staging);
+			pending->handle->bindTextures(texUnits);
+			return true;
+		};
+
+		m_pending_meshes.erase(std::remove_if(m_pending_meshes.begin(), m_pending_meshes.end(), publish), m_pending_meshes.end());
+		return static_cast<int>(m_pending_meshes.size());
+	}
+
+	void TRAssetLoader::finish()
+	{
+		for (const auto &pending : m_pending_meshes)
+		{
+			//Note: the texture requests are issued by the parsing task
+			pending->parsed.wait();
+			for (const auto &texture : pending->textures)
+			{
+				texture.wait();
+			}
+		}
+		update();
+	}
+
+	TRAssetLoader::TextureFuture TRAssetLoader::requestTexture(const std::string &filepath, TRAssetLoader *loader)
+	{
+		std::shared_ptr<std::packaged_task<TRTexture2D::ptr()>> task;
+		TextureFuture texture;
+		{
+			std::lock_guard<std::mutex> lock(m_texture_mutex);
+			auto iter = m_texture_cache.find(filepath);
+			if (iter != m_texture_cache.end())
+				return iter->second;
+
+			task = std::make_shared<std::packaged_task<TRTexture2D::ptr()>>([filepath]()
+			{
+				TRTexture2D::ptr tex = std::make_shared<TRTexture2D>();
+				tex->loadTextureFromFile(filepath);
+				return tex;
+			});
+			texture = task->get_future().share();
+			m_texture_cache.insert({ filepath, texture });
+		}
+
+		if (loader != nullptr)
+			loader->submit([task]() { (*task)(); });
+		else
+			(*task)();
+		return texture;
+	}
+
+	TRTexture2D::ptr TRAssetLoader::loadTexture(const std::string &filepath)
+	{
+		return requestTexture(filepath, nullptr).get();
+	}
+
+	int TRAssetLoader::getTextureUnit(const std::string &filepath)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_texture_mutex);
+			auto iter = m_texture_units.find(filepath);
+			if (iter != m_texture_units.end())
+				return iter->second;
+		}
+
+		//Note: we use the index returned from upload function for fetching the texture in shaders
+		int unit = TRShadingPipeline::upload_texture_2D(loadTexture(filepath));
+		{
+			std::lock_guard<std::mutex> lock(m_texture_mutex);
+			m_texture_units.insert({ filepath, unit });
+		}
+		return unit;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,83 @@
+#ifndef TRASSETLOADER_H
+#define TRASSETLOADER_H
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <condition_variable>
+
+#include "TRTexture2D.h"
+#include "TRDrawableMesh.h"
+
+namespace TinyRenderer
+{
+	//Asynchronous loading of the meshes and their textures on a pool of worker threads
+	//Note: a mesh handle is returned at once and stays empty (i.e. draws nothing) until update()
+	//      publishes its geometry together with its textures on the rendering thread
+	class TRAssetLoader final
+	{
+	public:
+		typedef std::shared_ptr<TRAssetLoader> ptr;
+
+		TRAssetLoader(int num_threads);
+		~TRAssetLoader();
+
+		TRAssetLoader(const TRAssetLoader&) = delete;
+		TRAssetLoader& operator=(const TRAssetLoader&) = delete;
+
+		//Note: the drawing config of the returned mesh could be set before it is loaded
+		TRDrawableMesh::ptr loadMesh(const std::string &filename, bool reorderFaces = false);
+
+		//Publish the meshes that finished loading, must be called by the rendering thread between frames
+		//Note: return the number of meshes still loading
+		int update();
+
+		//Block until all the requested meshes are published
+		void finish();
+
+		//Process-wide texture cache keyed by file path, every file is decoded once
+		//Note: loadTexture is thread-safe, getTextureUnit uploads the texture to the shading pipeline
+		//      the first time and must be called by the rendering thread
+		static TRTexture2D::ptr loadTexture(const std::string &filepath);
+		static int getTextureUnit(const std::string &filepath);
+
+	private:
+		typedef std::shared_future<TRTexture2D::ptr> TextureFuture;
+
+		//Decoding of a texture on the workers, or on the calling thread if loader is null
+		static TextureFuture requestTexture(const std::string &filepath, TRAssetLoader *loader);
+
+		void submit(std::function<void()> task);
+		void workerLoop();
+
+	private:
+		struct PendingMesh
+		{
+			TRDrawableMesh::ptr handle;
+			TRDrawableMesh::ptr staging;        // Written by the worker until parsed gets ready
+			std::vector<std::string> texPaths;
+			std::vector<TextureFuture> textures;
+			std::future<void> parsed;
+		};
+		std::vector<std::shared_ptr<PendingMesh>> m_pending_meshes;
+
+		std::vector<std::thread> m_workers;
+		std::deque<std::function<void()>> m_tasks;
+		std::mutex m_mutex;
+		std::condition_variable m_task_cond;
+		bool m_stop = false;
+
+		//Texture cache
+		static std::mutex m_texture_mutex;
+		static std::map<std::string, TextureFuture> m_texture_cache;
+		static std::map<std::string, int> m_texture_units;
+	};
+}
+
+#endif
\ No newline at end of file
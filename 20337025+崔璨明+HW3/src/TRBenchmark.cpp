@@ -0,0 +1,300 @@
+#include "TRBenchmark.h"
+
+#include "glm/gtc/matrix_transform.hpp"
+
+#include "TRRenderer.h"
+#include "TRAssetLoader.h"
+#include "TRProfiler.h"
+#include "TRUtils.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+
+namespace TinyRenderer
+{
+	bool TRBenchmark::parseArguments(int argc, char *args[], Options &options)
+	{
+		for (int i = 0; i < argc; ++i)
+		{
+			const std::string arg = args[i];
+			const bool has_value = (i + 1 < argc);
+			if (arg == "--update-golden")
+				options.updateGolden = true;
+			else if (arg == "--frames" && has_value)
+				options.numFrames = std::max(1, std::atoi(args[++i]));
+			else if (arg == "--warmup" && has_value)
+				options.numWarmupFrames = std::max(0, std::atoi(args[++i]));
+			else if (arg == "--threads" && has_value)
+				options.numThreads = std::max(0, std::atoi(args[++i]));
+			else if (arg == "--msaa" && has_value)
+				options.numSamples = std::max(1, std::atoi(args[++i]));
+			else if (arg == "--size" && i + 2 < argc)
+			{
+				options.width = std::max(1, std::atoi(args[++i]));
+				options.height = std::max(1, std::atoi(args[++i]));
+			}
+			else if (arg == "--output" && has_value)
+				options.frameDir = args[++i];
+			else if (arg == "--report" && has_value)
+				options.reportPath = args[++i];
+			else if (arg == "--golden" && has_value)
+				options.goldenDir = args[++i];
+			else if (arg == "--tolerance" && has_value)
+				options.goldenTolerance = std::max(0, std::atoi(args[++i]));
+			else
+			{
+				std::cerr << "Unknown or incomplete option " << arg << std::endl;
+				std::cerr << "Usage: --headless [--frames n] [--warmup n] [--threads n] [--msaa n] [--size w h] [--output dir]"
+					<< " [--report file] [--golden dir] [--update-golden] [--tolerance t]" << std::endl;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	int TRBenchmark::run(const Options &options)
+	{
+		const int width = options.width, height = options.height;
+		TRRenderer::ptr renderer = std::make_shared<TRRenderer>(width, height);
+		const int num_threads = options.numThreads > 0 ?
+			options.numThreads : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+		renderer->setRasterMode(TRRasterMode::TR_RASTER_TILE_BINNED);
+		renderer->setThreadNum(num_threads);
+		renderer->setShadingMode(TRShadingMode::TR_SHADING_DEFERRED);
+		if (options.numSamples > 1)
+		{
+			//Note: the G-buffer holds one sample per pixel
+			renderer->setShadingMode(TRShadingMode::TR_SHADING_FORWARD);
+			renderer->setSampleCount(options.numSamples);
+		}
+		renderer->setProjectMatrix(TRUtils::calcPerspProjectMatrix(45.0f, static_cast<float>(width) / height, 0.001f, 10.0f), 0.001f, 10.0f);
+
+		//The scene of the windowed application, loaded completely before the first frame
+		TRDrawableMesh::ptr lightMeshes[3];
+		{
+			TRAssetLoader loader(num_threads);
+			TRDrawableMesh::ptr diabloMesh = loader.loadMesh("model/diablo3_pose/diablo3_pose.obj");
+			TRDrawableMesh::ptr houseMesh = loader.loadMesh("model/floor.obj");
+			lightMeshes[0] = loader.loadMesh("model/light_red.obj");
+			lightMeshes[1] = loader.loadMesh("model/light_green.obj");
+			lightMeshes[2] = loader.loadMesh("model/light_blue.obj");
+			loader.finish();
+			renderer->addDrawableMesh({ houseMesh, diabloMesh, lightMeshes[0], lightMeshes[1], lightMeshes[2] });
+		}
+		renderer->setShaderPipeline(std::make_shared<TRPhongShadingPipeline>());
+
+		const glm::vec3 lookAtTarget(0.0f);
+		const glm::vec3 startCameraPos(0.8f, 0.0f, 3.7f);
+		const glm::vec3 lightPos[3] = {
+			glm::vec3(0.0f, -0.05f, 1.2f), glm::vec3(0.87f, -0.05f, -0.87f), glm::vec3(-0.83f, -0.05f, -0.83f) };
+		const glm::vec3 lightAxis[3] = { glm::vec3(0, 1, 0), glm::vec3(1, 1, 1), glm::vec3(-1, 1, 1) };
+		const glm::vec3 lightColor[3] = { glm::vec3(1.9f, 0.0f, 0.0f), glm::vec3(0.0f, 1.9f, 0.0f), glm::vec3(0.0f, 0.0f, 1.9f) };
+		int lightIndex[3];
+		for (int l = 0; l < 3; ++l)
+		{
+			lightIndex[l] = renderer->addPointLight(lightPos[l], glm::vec3(1.0, 0.7, 1.8), lightColor[l]);
+			lightMeshes[l]->setLightingMode(TRLightingMode::TR_LIGHTING_DISABLE);
+		}
+		renderer->addSpotLight(startCameraPos, glm::vec3(-0.03f, -0.05f, -0.97f), glm::cos(glm::radians(12.5f)), glm::cos(glm::radians(17.5f)));
+
+		//Scripted path: one orbit of the camera around the model rising and sinking once, the lights moving
+		//as in the windowed application at 60 frames per second
+		auto setupFrame = [&](int frame)
+		{
+			const float phase = 2.0f * 3.14159265f * frame / options.numFrames;
+			glm::vec3 cameraPos = glm::vec3(glm::rotate(glm::mat4(1.0f), phase, glm::vec3(0, 1, 0)) * glm::vec4(startCameraPos, 1.0f));
+			cameraPos.y = 0.8f * std::sin(phase);
+			renderer->setViewMatrix(TRUtils::calcViewMatrix(cameraPos, lookAtTarget, glm::vec3(0.0f, 1.0f, 0.0f)));
+			renderer->setViewerPos(cameraPos);
+
+			for (int l = 0; l < 3; ++l)
+			{
+				const float angle = frame * (1000.0f / 60.0f) * 0.0008f;
+				glm::vec3 pos = glm::vec3(glm::rotate(glm::mat4(1.0f), angle, lightAxis[l]) * glm::vec4(lightPos[l], 1.0f));
+				renderer->getPointLight(lightIndex[l]).lightPos = pos;
+				lightMeshes[l]->setModelMatrix(glm::translate(glm::mat4(1.0f), pos));
+			}
+		};
+
+		TRProfiler::ptr profiler = renderer->getProfiler();
+		profiler->setEnabled(true);
+		for (int frame = 0; frame < options.numWarmupFrames; ++frame)
+		{
+			setupFrame(frame % options.numFrames);
+			renderer->clearColor(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+			renderer->renderAllDrawableMeshes();
+		}
+
+		int status = 0;
+		int num_compared = 0, num_mismatched = 0;
+		std::vector<unsigned char> golden;
+		for (int frame = 0; frame < options.numFrames; ++frame)
+		{
+			setupFrame(frame);
+			profiler->beginFrame();
+			renderer->clearColor(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+			renderer->renderAllDrawableMeshes();
+			profiler->endFrame();
+
+			//Outputs of the frame, not measured
+			const unsigned char *pixels = renderer->commitRenderedColorBuffer();
+			if (!options.frameDir.empty() && !writePPM(frameFilename_aux(options.frameDir, frame), pixels, width, height))
+			{
+				status = 1;
+			}
+			if (options.goldenDir.empty())
+				continue;
+			const std::string goldenFile = frameFilename_aux(options.goldenDir, frame);
+			if (options.updateGolden)
+			{
+				if (!writePPM(goldenFile, pixels, width, height))
+					status = 1;
+				continue;
+			}
+
+			int golden_width = 0, golden_height = 0;
+			++num_compared;
+			if (!readPPM(goldenFile, golden, golden_width, golden_height))
+			{
+				++num_mismatched;
+				continue;
+			}
+			int num_diffs = (golden_width == width && golden_height == height) ?
+				compareImages_aux(pixels, golden, width, height, options.goldenTolerance) : -1;
+			if (num_diffs != 0)
+			{
+				++num_mismatched;
+				std::cerr << "Frame " << frame << " mismatches " << goldenFile << ": "
+					<< (num_diffs < 0 ? std::string("different size") : std::to_string(num_diffs) + " pixels") << std::endl;
+			}
+		}
+		if (num_mismatched > 0)
+			status = 1;
+
+		//Report of the measured frames
+		const auto &frames = profiler->getFrames();
+		std::vector<double> frame_times;
+		double total_seconds = 0.0, num_triangles = 0.0, num_fragments = 0.0;
+		for (const auto &frame : frames)
+		{
+			frame_times.push_back((frame.end - frame.begin) * 1e-6);
+			total_seconds += (frame.end - frame.begin) * 1e-9;
+			num_triangles += static_cast<double>(frame.counters[TRProfiler::TR_COUNTER_TRIANGLES]);
+			num_fragments += static_cast<double>(frame.counters[TRProfiler::TR_COUNTER_FRAGMENTS_GENERATED]);
+		}
+		std::sort(frame_times.begin(), frame_times.end());
+		const double mean_ms = frame_times.empty() ? 0.0 : total_seconds * 1e3 / frame_times.size();
+		const double seconds = std::max(total_seconds, 1e-9);
+
+		std::ofstream report(options.reportPath, std::ios::trunc);
+		if (!report)
+		{
+			std::cerr << "Failed to write the report " << options.reportPath << std::endl;
+			status = 1;
+		}
+		report << std::fixed << std::setprecision(4);
+		report << "{\n"
+			<< "  \"width\": " << width << ",\n"
+			<< "  \"height\": " << height << ",\n"
+			<< "  \"threads\": " << num_threads << ",\n"
+			<< "  \"samples\": " << renderer->getSampleCount() << ",\n"
+			<< "  \"frames\": " << frame_times.size() << ",\n"
+			<< "  \"frame_time_ms\": { \"mean\": " << mean_ms << ", \"p50\": " << TRProfiler::percentile(frame_times, 0.50)
+			<< ", \"p99\": " << TRProfiler::percentile(frame_times, 0.99) << " },\n"
+			<< "  \"triangles_per_second\": " << num_triangles / seconds << ",\n"
+			<< "  \"fragments_per_second\": " << num_fragments / seconds << ",\n"
+			<< "  \"golden\": { \"compared\": " << num_compared << ", \"mismatched\": " << num_mismatched << " }\n"
+			<< "}\n";
+
+		std::cout << frame_times.size() << " frames, " << mean_ms << " ms mean, "
+			<< TRProfiler::percentile(frame_times, 0.99) << " ms p99";
+		if (num_compared > 0)
+			std::cout << ", " << num_mismatched << " of " << num_compared << " frames mismatch the golden images";
+		std::cout << std::endl;
+
+		renderer->unloadDrawableMesh();
+		return status;
+	}
+
+	bool TRBenchmark::writePPM(const std::string &filename, const unsigned char *pixels, int width, int height)
+	{
+		std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+		if (!out)
+		{
+			std::cerr << "Failed to write the image " << filename << std::endl;
+			return false;
+		}
+		out << "P6\n" << width << " " << height << "\n255\n";
+		std::vector<unsigned char> row(width * 3);
+		for (int y = 0; y < height; ++y)
+		{
+			const unsigned char *src = pixels + y * width * 4;
+			for (int x = 0; x < width; ++x)
+			{
+				row[x * 3 + 0] = src[x * 4 + 0];
+				row[x * 3 + 1] = src[x * 4 + 1];
+				row[x * 3 + 2] = src[x * 4 + 2];
+			}
+			out.write(reinterpret_cast<const char*>(row.data()), row.size());
+		}
+		return static_cast<bool>(out);
+	}
+
+	bool TRBenchmark::readPPM(const std::string &filename, std::vector<unsigned char> &pixels, int &width, int &height)
+	{
+		std::ifstream in(filename, std::ios::binary);
+		std::string magic;
+		int maxval = 0;
+		if (!(in >> magic >> width >> height >> maxval) || magic != "P6" || maxval != 255 || width <= 0 || height <= 0)
+		{
+			std::cerr << "Failed to read the image " << filename << std::endl;
+			return false;
+		}
+		in.get();
+		pixels.resize(static_cast<size_t>(width) * height * 3);
+		in.read(reinterpret_cast<char*>(pixels.data()), pixels.size());
+		if (in.gcount() != static_cast<std::streamsize>(pixels.size()))
+		{
+			std::cerr << "Failed to read the image " << filename << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	int TRBenchmark::compareImages_aux(
+		const unsigned char *rgba,
+		const std::vector<unsigned char> &rgb,
+		int width,
+		int height,
+		int tolerance)
+	{
+		if (rgb.size() != static_cast<size_t>(width) * height * 3)
+			return -1;
+		int num_diffs = 0;
+		for (int i = 0; i < width * height; ++i)
+		{
+			for (int c = 0; c < 3; ++c)
+			{
+				if (std::abs(rgba[i * 4 + c] - rgb[i * 3 + c]) > tolerance)
+				{
+					++num_diffs;
+					break;
+				}
+			}
+		}
+		return num_diffs;
+	}
+
+	std::string TRBenchmark::frameFilename_aux(const std::string &dir, int frame)
+	{
+		char name[32];
+		std::snprintf(name, sizeof(name), "frame_%04d.ppm", frame);
+		return dir + "/" + name;
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef TRBENCHMARK_H
+#define TRBENCHMARK_H
+
+#include <string>
+#include <vector>
+
+namespace TinyRenderer
+{
+	//Headless rendering of the assignment scene along a scripted camera path, without any window
+	//Note: every frame depends only on its index, hence the frames are reproducible and could be compared
+	//      against golden images rendered before
+	class TRBenchmark final
+	{
+	public:
+		struct Options
+		{
+			int width = 666;
+			int height = 500;
+			int numFrames = 120;
+			int numWarmupFrames = 2;    // Rendered before the measured frames, not recorded
+			int numThreads = 0;         // 0 for all the cores
+			int numSamples = 1;         // Multisampling with forward shading if more than 1
+			std::string frameDir;       // Frames written as frame_NNNN.ppm if not empty
+			std::string reportPath = "benchmark.json";
+			std::string goldenDir;      // Golden images frame_NNNN.ppm compared against if not empty
+			bool updateGolden = false;  // Write the golden images instead of comparing
+			int goldenTolerance = 2;    // Largest difference of a color channel still matching
+		};
+
+		//Parse the arguments following --headless, return false on an unknown or incomplete option
+		static bool parseArguments(int argc, char *args[], Options &options);
+
+		//Return 0 on success, 1 if any frame mismatches its golden image or an output could not be written
+		static int run(const Options &options);
+
+		//Binary PPM (P6) of the RGB channels of a RGBA image
+		static bool writePPM(const std::string &filename, const unsigned char *pixels, int width, int height);
+		static bool readPPM(const std::string &filename, std::vector<unsigned char> &pixels, int &width, int &height);
+
+	private:
+		//Number of the pixels whose channels differ by more than tolerance, -1 if the sizes differ
+		static int compareImages_aux(
+			const unsigned char *rgba,
+			const std::vector<unsigned char> &rgb,
+			int width,
+			int height,
+			int tolerance);
+
+		static std::string frameFilename_aux(const std::string &dir, int frame);
+	};
+}
+
+#endif
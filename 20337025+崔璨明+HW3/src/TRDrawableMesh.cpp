@@ -1,26 +1,42 @@
 #include "TRDrawableMesh.h"
 
 #include <map>
+#include <tuple>
+#include <cmath>
+#include <fstream>
+#include <sstream>
 #include <iostream>
+#include <algorithm>
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
 
 #include "TRTexture2D.h"
+#include "TRMeshCache.h"
+#include "TRAssetLoader.h"
 #include "TRShadingPipeline.h"
 
 namespace TinyRenderer
 {
 
-	TRDrawableMesh::TRDrawableMesh(const std::string &filename)
+	constexpr unsigned int TRDrawableMesh::chunk_size;
+
+	TRDrawableMesh::TRDrawableMesh(const std::string &filename, bool reorderFaces)
 	{
-		loadMeshFromFile(filename);
+		loadMeshFromFile(filename, reorderFaces);
 	}
 
 	void TRDrawableMesh::clear()
 	{
 		m_vertices_attrib.clear();
+		std::vector<TRMeshVertex>().swap(m_mesh_vertices);
 		std::vector<TRMeshFace>().swap(m_mesh_faces);
+		std::vector<TRFaceTangent>().swap(m_face_tangents);
+		std::vector<TRMaterial>().swap(m_materials);
+		m_vertex_streams.clear();
+		m_bounds = TRBoundingVolume();
+		std::vector<TRMeshChunk>().swap(m_chunks);
+		++m_revision;
 	}
 
 	TRDrawableMesh& TRDrawableMesh::operator=(const TRDrawableMesh& mesh)
@@ -28,14 +44,172 @@ namespace TinyRenderer
 		if (&mesh == this)
 			return *this;
 		m_vertices_attrib = mesh.m_vertices_attrib;
+		m_mesh_vertices = mesh.m_mesh_vertices;
 		m_mesh_faces = mesh.m_mesh_faces;
+		m_face_tangents = mesh.m_face_tangents;
+		m_materials = mesh.m_materials;
+		m_vertex_streams = mesh.m_vertex_streams;
+		m_bounds = mesh.m_bounds;
+		m_chunks = mesh.m_chunks;
+		++m_revision;
 		return *this;
 	}
 
-	void TRDrawableMesh::loadMeshFromFile(const std::string &filename)
+	void TRDrawableMesh::swapMeshData(TRDrawableMesh &mesh)
+	{
+		std::swap(m_vertices_attrib, mesh.m_vertices_attrib);
+		m_mesh_vertices.swap(mesh.m_mesh_vertices);
+		m_mesh_faces.swap(mesh.m_mesh_faces);
+		m_face_tangents.swap(mesh.m_face_tangents);
+		m_materials.swap(mesh.m_materials);
+		std::swap(m_vertex_streams, mesh.m_vertex_streams);
+		std::swap(m_bounds, mesh.m_bounds);
+		m_chunks.swap(mesh.m_chunks);
+		++m_revision;
+		++mesh.m_revision;
+	}
+
+	void TRDrawableMesh::calcBoundingVolumes()
+	{
+		const auto &positions = m_vertices_attrib.vpositions;
+		const auto &vertices = m_mesh_vertices;
+
+		//Box first, then the sphere around its center
+		//Note: not the minimal sphere, but cheap and good enough for culling
+		auto calcBounds = [&](unsigned int faceBegin, unsigned int faceEnd, TRBoundingVolume &bounds)
+		{
+			bounds = TRBoundingVolume();
+			if (faceBegin == faceEnd)
+				return;
+			auto position = [&](unsigned int f, int v) { return glm::vec3(positions[vertices[m_mesh_faces[f].vertIndex[v]].vposIndex]); };
+			bounds.boxMin = bounds.boxMax = position(faceBegin, 0);
+			for (unsigned int f = faceBegin; f < faceEnd; ++f)
+			{
+				for (int v = 0; v < 3; ++v)
+				{
+					glm::vec3 pos = position(f, v);
+					bounds.boxMin = glm::min(bounds.boxMin, pos);
+					bounds.boxMax = glm::max(bounds.boxMax, pos);
+				}
+			}
+			bounds.sphereCenter = (bounds.boxMin + bounds.boxMax) * 0.5f;
+			float radius2 = 0.0f;
+			for (unsigned int f = faceBegin; f < faceEnd; ++f)
+			{
+				for (int v = 0; v < 3; ++v)
+				{
+					glm::vec3 dist = position(f, v) - bounds.sphereCenter;
+					radius2 = std::max(radius2, glm::dot(dist, dist));
+				}
+			}
+			bounds.sphereRadius = std::sqrt(radius2);
+		};
+
+		const unsigned int num_faces = static_cast<unsigned int>(m_mesh_faces.size());
+		calcBounds(0, num_faces, m_bounds);
+
+		//Note: a chunk never straddles two materials, so that the material is set up once per chunk
+		std::vector<TRMeshChunk>().swap(m_chunks);
+		for (unsigned int beg = 0; beg < num_faces;)
+		{
+			TRMeshChunk chunk;
+			chunk.faceBegin = beg;
+			chunk.faceEnd = beg + 1;
+			chunk.materialId = m_mesh_faces[beg].materialId;
+			while (chunk.faceEnd < std::min(beg + chunk_size, num_faces) && m_mesh_faces[chunk.faceEnd].materialId == chunk.materialId)
+				++chunk.faceEnd;
+			beg = chunk.faceEnd;
+			chunk.vertBegin = m_mesh_faces[chunk.faceBegin].vertIndex[0];
+			chunk.vertEnd = chunk.vertBegin + 1;
+			for (unsigned int f = chunk.faceBegin; f < chunk.faceEnd; ++f)
+			{
+				for (int v = 0; v < 3; ++v)
+				{
+					chunk.vertBegin = std::min(chunk.vertBegin, m_mesh_faces[f].vertIndex[v]);
+					chunk.vertEnd = std::max(chunk.vertEnd, m_mesh_faces[f].vertIndex[v] + 1);
+				}
+			}
+			calcBounds(chunk.faceBegin, chunk.faceEnd, chunk.bounds);
+			m_chunks.push_back(chunk);
+		}
+		++m_revision;
+	}
+
+	void TRDrawableMesh::buildVertexStreams()
+	{
+		const auto &attrib = m_vertices_attrib;
+		m_vertex_streams.resize(m_mesh_vertices.size());
+		for (size_t i = 0; i < m_mesh_vertices.size(); ++i)
+		{
+			const TRMeshVertex &vert = m_mesh_vertices[i];
+			const glm::vec4 &pos = attrib.vpositions[vert.vposIndex];
+			const glm::vec4 &col = attrib.vcolors[vert.vposIndex];
+			const glm::vec3 &nor = attrib.vnormals[vert.vnorIndex];
+			const glm::vec2 &tex = attrib.vtexcoords[vert.vtexIndex];
+			m_vertex_streams.px[i] = pos.x;
+			m_vertex_streams.py[i] = pos.y;
+			m_vertex_streams.pz[i] = pos.z;
+			m_vertex_streams.r[i] = col.r;
+			m_vertex_streams.g[i] = col.g;
+			m_vertex_streams.b[i] = col.b;
+			m_vertex_streams.nx[i] = nor.x;
+			m_vertex_streams.ny[i] = nor.y;
+			m_vertex_streams.nz[i] = nor.z;
+			m_vertex_streams.u[i] = tex.x;
+			m_vertex_streams.v[i] = tex.y;
+		}
+	}
+
+	void TRDrawableMesh::loadMeshFromFile(const std::string &filename, bool reorderFaces)
+	{
+		std::vector<std::string> texPaths;
+		loadMeshData(filename, reorderFaces, texPaths);
+
+		//Textures are shared by all the meshes through the texture cache of the asset loader
+		std::vector<int> texUnits;
+		for (const auto &path : texPaths)
+		{
+			texUnits.push_back(TRAssetLoader::getTextureUnit(path));
+		}
+		bindTextures(texUnits);
+	}
+
+	void TRDrawableMesh::loadMeshData(const std::string &filename, bool reorderFaces, std::vector<std::string> &texPaths)
 	{
 		clear();
 
+		std::vector<std::string> texNames;
+		if (!TRMeshCache::load(filename, reorderFaces, *this, texNames))
+		{
+			std::vector<std::string> mtlNames;
+			loadMeshFromObj(filename, texNames, mtlNames);
+			groupFacesByMaterial();
+
+			//Indexed vertices for the post-transform vertex cache
+			renumberMeshVertices();
+			if (reorderFaces)
+			{
+				optimizeFaceOrder();
+				renumberMeshVertices();
+			}
+
+			TRMeshCache::save(filename, reorderFaces, *this, texNames, mtlNames);
+		}
+
+		calcBoundingVolumes();
+		buildVertexStreams();
+
+		size_t pos = filename.find_last_of("/\\");
+		std::string baseDir = (pos != std::string::npos) ? filename.substr(0, pos + 1) : "./";
+		texPaths.clear();
+		for (const auto &name : texNames)
+		{
+			texPaths.push_back(baseDir + name);
+		}
+	}
+
+	void TRDrawableMesh::loadMeshFromObj(const std::string &filename, std::vector<std::string> &texNames, std::vector<std::string> &mtlNames)
+	{
 		//Refs: https://github.com/tinyobjloader/tinyobjloader
 
 		tinyobj::ObjReaderConfig reader_config;
@@ -60,90 +234,61 @@ namespace TinyRenderer
 		auto& shapes = reader.GetShapes();
 		auto& materials = reader.GetMaterials();
 
-		//Load the textures
-		std::vector<glm::ivec4> matTextureIds;
+		//The material libraries, for the invalidation of the mesh cache
+		{
+			std::ifstream in(filename);
+			std::string line;
+			while (std::getline(in, line))
+			{
+				std::istringstream tokens(line);
+				std::string keyword, name;
+				tokens >> keyword;
+				if (keyword != "mtllib")
+					continue;
+				while (tokens >> name)
+					mtlNames.push_back(name);
+			}
+		}
+
+		//Collect the textures and the materials
+		//Note: the materials that only differ in name are merged, material 0 is for the faces without any
+		std::vector<unsigned int> matIds;
+		m_materials.push_back(TRMaterial());
 		{
 			//texDict is for avoiding redundant loading
 			std::map<std::string, int> texDict;
-
-			size_t pos = filename.find_last_of("/\\");
-			std::string baseDir = "./";
-			baseDir = ((pos != std::string::npos) ? filename.substr(0, pos) : reader_config.mtl_search_path) + "/";
-
-			for (size_t m = 0; m < materials.size(); ++m)
+			auto addTexture = [&](const std::string &texname) -> int
 			{
-				//Note: we use the index returned from upload function for fetching the texture in shaders
-				glm::ivec4 texIds(-1, -1, -1, -1);
-				const tinyobj::material_t* mp = &materials[m];
-
-				//Load the diffuse texture and upload to shading pipeline
-				if (mp->diffuse_texname.length() > 0)
+				if (texname.empty())
+					return -1;
+				auto iter = texDict.find(texname);
+				if (iter == texDict.end())
 				{
-					if (texDict.find(mp->diffuse_texname) != texDict.end())
-					{
-						//Already loaded
-						texIds.x = texDict[mp->diffuse_texname];
-					}
-					else
-					{
-						TRTexture2D::ptr diffTex = std::make_shared<TRTexture2D>();
-						bool success = diffTex->loadTextureFromFile(baseDir + mp->diffuse_texname);
-						texIds.x = TRShadingPipeline::upload_texture_2D(diffTex);
-						texDict.insert({ mp->diffuse_texname, texIds.x });
-					}
-				}
-
-				//Load the specular texture and upload to shading pipeline
-				if (mp->specular_texname.length() > 0)
-				{
-					if (texDict.find(mp->specular_texname) != texDict.end())
-					{
-						//Already loaded
-						texIds.y = texDict[mp->specular_texname];
-					}
-					else
-					{
-						TRTexture2D::ptr specuTex = std::make_shared<TRTexture2D>();
-						bool success = specuTex->loadTextureFromFile(baseDir + mp->specular_texname);
-						texIds.y = TRShadingPipeline::upload_texture_2D(specuTex);
-						texDict.insert({ mp->specular_texname, texIds.y });
-					}
-				}
-
-				//Load the normal texture and upload to shading pipeline
-				if (mp->bump_texname.length() > 0)
-				{
-					if (texDict.find(mp->bump_texname) != texDict.end())
-					{
-						//Already loaded
-						texIds.z = texDict[mp->bump_texname];
-					}
-					else
-					{
-						TRTexture2D::ptr normTex = std::make_shared<TRTexture2D>();
-						bool success = normTex->loadTextureFromFile(baseDir + mp->bump_texname);
-						texIds.z = TRShadingPipeline::upload_texture_2D(normTex);
-					}
-				}
-
-				//Load the emissive texture and upload to shading pipeline
-				if (mp->emissive_texname.length() > 0)
-				{
-					if (texDict.find(mp->emissive_texname) != texDict.end())
-					{
-						//Already loaded
-						texIds.w = texDict[mp->emissive_texname];
-					}
-					else
-					{
-						TRTexture2D::ptr glowTex = std::make_shared<TRTexture2D>();
-						bool success = glowTex->loadTextureFromFile(baseDir + mp->emissive_texname);
-						texIds.w = TRShadingPipeline::upload_texture_2D(glowTex);
-						texDict.insert({ mp->emissive_texname, texIds.w });
-					}
+					iter = texDict.insert({ texname, static_cast<int>(texNames.size()) }).first;
+					texNames.push_back(texname);
 				}
+				return iter->second;
+			};
 
-				matTextureIds.push_back(texIds);
+			for (size_t m = 0; m < materials.size(); ++m)
+			{
+				//Note: diffuse, specular, normal and emissive textures
+				const tinyobj::material_t* mp = &materials[m];
+				TRMaterial material;
+				material.kA = glm::vec3(mp->ambient[0], mp->ambient[1], mp->ambient[2]);
+				material.kD = glm::vec3(mp->diffuse[0], mp->diffuse[1], mp->diffuse[2]);
+				material.kS = glm::vec3(mp->specular[0], mp->specular[1], mp->specular[2]);
+				material.kE = glm::vec3(mp->emission[0], mp->emission[1], mp->emission[2]);
+				material.shininess = mp->shininess;
+				material.diffuseMapTexId = addTexture(mp->diffuse_texname);
+				material.specularMapTexId = addTexture(mp->specular_texname);
+				material.normalMapTexId = addTexture(mp->bump_texname);
+				material.glowMapTexId = addTexture(mp->emissive_texname);
+
+				auto iter = std::find(m_materials.begin(), m_materials.end(), material);
+				matIds.push_back(static_cast<unsigned int>(iter - m_materials.begin()));
+				if (iter == m_materials.end())
+					m_materials.push_back(material);
 			}
 
 		}
@@ -167,6 +312,8 @@ namespace TinyRenderer
 				m_vertices_attrib.vtexcoords.push_back(
 					glm::vec2(attrib.texcoords[i + 0], attrib.texcoords[i + 1]));
 			}
+			//(vposIndex, vnorIndex, vtexIndex) -> mesh vertex index
+			std::map<std::tuple<unsigned int, unsigned int, unsigned int>, unsigned int> vertDict;
 			for (size_t s = 0; s < shapes.size(); ++s)
 			{
 				size_t index_offset = 0;
@@ -177,40 +324,41 @@ namespace TinyRenderer
 					for (size_t v = 0; v < fv && v < 3; ++v)
 					{
 						tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-						face.vposIndex[v] = idx.vertex_index;
-						face.vnorIndex[v] = idx.normal_index;
-						face.vtexIndex[v] = idx.texcoord_index;
+						TRMeshVertex vert;
+						vert.vposIndex = idx.vertex_index;
+						vert.vnorIndex = idx.normal_index;
+						vert.vtexIndex = idx.texcoord_index;
+						auto key = std::make_tuple(vert.vposIndex, vert.vnorIndex, vert.vtexIndex);
+						auto iter = vertDict.find(key);
+						if (iter == vertDict.end())
+						{
+							iter = vertDict.insert({ key, static_cast<unsigned int>(m_mesh_vertices.size()) }).first;
+							m_mesh_vertices.push_back(vert);
+						}
+						face.vertIndex[v] = iter->second;
 					}
 					//Material
+					if (shapes[s].mesh.material_ids[f] < materials.size())
 					{
-						if (shapes[s].mesh.material_ids[f] < materials.size())
-						{
-							const tinyobj::material_t* mp = &materials[shapes[s].mesh.material_ids[f]];
-							face.kA = glm::vec3(mp->ambient[0], mp->ambient[1], mp->ambient[2]);
-							face.kD = glm::vec3(mp->diffuse[0], mp->diffuse[1], mp->diffuse[2]);
-							face.kS = glm::vec3(mp->specular[0], mp->specular[1], mp->specular[2]);
-							face.kE = glm::vec3(mp->emission[0], mp->emission[1], mp->emission[2]);
-							face.shininess = mp->shininess;
-							face.diffuseMapTexId = matTextureIds[shapes[s].mesh.material_ids[f]].x;
-							face.specularMapTexId = matTextureIds[shapes[s].mesh.material_ids[f]].y;
-							face.normalMapTexId = matTextureIds[shapes[s].mesh.material_ids[f]].z;
-							face.glowMapTexId = matTextureIds[shapes[s].mesh.material_ids[f]].w;
-						}
+						face.materialId = matIds[shapes[s].mesh.material_ids[f]];
 					}
 
 					//TBN matrix calculation for normal mapping
 					//Refs: https://learnopengl.com/Advanced-Lighting/Normal-Mapping
 					{
-						
-						glm::vec3 edge1 = glm::vec3(m_vertices_attrib.vpositions[face.vposIndex[1]]) 
-							- glm::vec3(m_vertices_attrib.vpositions[face.vposIndex[0]]);
-						glm::vec3 edge2 = glm::vec3(m_vertices_attrib.vpositions[face.vposIndex[2]])
-							- glm::vec3(m_vertices_attrib.vpositions[face.vposIndex[0]]);
+						const TRMeshVertex &v0 = m_mesh_vertices[face.vertIndex[0]];
+						const TRMeshVertex &v1 = m_mesh_vertices[face.vertIndex[1]];
+						const TRMeshVertex &v2 = m_mesh_vertices[face.vertIndex[2]];
 
-						glm::vec2 deltaUV1 = glm::vec2(m_vertices_attrib.vtexcoords[face.vtexIndex[1]])
-							- glm::vec2(m_vertices_attrib.vtexcoords[face.vtexIndex[0]]);
-						glm::vec2 deltaUV2 = glm::vec2(m_vertices_attrib.vtexcoords[face.vtexIndex[2]])
-							- glm::vec2(m_vertices_attrib.vtexcoords[face.vtexIndex[0]]);
+						glm::vec3 edge1 = glm::vec3(m_vertices_attrib.vpositions[v1.vposIndex]) 
+							- glm::vec3(m_vertices_attrib.vpositions[v0.vposIndex]);
+						glm::vec3 edge2 = glm::vec3(m_vertices_attrib.vpositions[v2.vposIndex])
+							- glm::vec3(m_vertices_attrib.vpositions[v0.vposIndex]);
+
+						glm::vec2 deltaUV1 = glm::vec2(m_vertices_attrib.vtexcoords[v1.vtexIndex])
+							- glm::vec2(m_vertices_attrib.vtexcoords[v0.vtexIndex]);
+						glm::vec2 deltaUV2 = glm::vec2(m_vertices_attrib.vtexcoords[v2.vtexIndex])
+							- glm::vec2(m_vertices_attrib.vtexcoords[v0.vtexIndex]);
 
 						float f = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV2.x * deltaUV1.y);
 
@@ -224,8 +372,10 @@ namespace TinyRenderer
 						bitangent.y = f * (-deltaUV2.x * edge1.y + deltaUV1.x * edge2.y);
 						bitangent.z = f * (-deltaUV2.x * edge1.z + deltaUV1.x * edge2.z);
 
-						face.tangent = glm::normalize(tangent);
-						face.bitangent = glm::normalize(bitangent);
+						TRFaceTangent tbn;
+						tbn.tangent = glm::normalize(tangent);
+						tbn.bitangent = glm::normalize(bitangent);
+						m_face_tangents.push_back(tbn);
 					}
 
 					m_mesh_faces.push_back(face);
@@ -233,7 +383,215 @@ namespace TinyRenderer
 				}
 			}
 		}
-		
+	}
+
+	void TRDrawableMesh::bindTextures(const std::vector<int> &texUnits)
+	{
+		auto remap = [&](int &id) { id = (id >= 0) ? texUnits[id] : -1; };
+		for (auto &material : m_materials)
+		{
+			remap(material.diffuseMapTexId);
+			remap(material.specularMapTexId);
+			remap(material.normalMapTexId);
+			remap(material.glowMapTexId);
+		}
+	}
+
+	void TRDrawableMesh::permuteFaces(const std::vector<unsigned int> &order)
+	{
+		std::vector<TRMeshFace> faces(order.size());
+		std::vector<TRFaceTangent> tangents(order.size());
+		for (size_t i = 0; i < order.size(); ++i)
+		{
+			faces[i] = m_mesh_faces[order[i]];
+			tangents[i] = m_face_tangents[order[i]];
+		}
+		m_mesh_faces.swap(faces);
+		m_face_tangents.swap(tangents);
+	}
+
+	void TRDrawableMesh::groupFacesByMaterial()
+	{
+		std::vector<unsigned int> order(m_mesh_faces.size());
+		for (size_t f = 0; f < order.size(); ++f)
+		{
+			order[f] = static_cast<unsigned int>(f);
+		}
+		const auto &faces = m_mesh_faces;
+		std::stable_sort(order.begin(), order.end(), [&faces](unsigned int a, unsigned int b)
+		{
+			return faces[a].materialId < faces[b].materialId;
+		});
+		permuteFaces(order);
+	}
+
+	void TRDrawableMesh::renumberMeshVertices()
+	{
+		//Old mesh vertex index -> new one, ~0u until referenced
+		std::vector<unsigned int> remap(m_mesh_vertices.size(), ~0u);
+		std::vector<TRMeshVertex> vertices;
+		vertices.reserve(m_mesh_vertices.size());
+		for (auto &face : m_mesh_faces)
+		{
+			for (int v = 0; v < 3; ++v)
+			{
+				unsigned int &index = remap[face.vertIndex[v]];
+				if (index == ~0u)
+				{
+					index = static_cast<unsigned int>(vertices.size());
+					vertices.push_back(m_mesh_vertices[face.vertIndex[v]]);
+				}
+				face.vertIndex[v] = index;
+			}
+		}
+		m_mesh_vertices.swap(vertices);
+	}
+
+	void TRDrawableMesh::optimizeFaceOrder()
+	{
+		//Simulated LRU cache
+		constexpr int cache_size = 32;
+		constexpr float cache_decay_power = 1.5f;
+		constexpr float last_face_score = 0.75f;
+		constexpr float valence_boost_scale = 2.0f;
+		constexpr float valence_boost_power = 0.5f;
+
+		const size_t num_faces = m_mesh_faces.size();
+		const size_t num_verts = m_mesh_vertices.size();
+		if (num_faces == 0)
+			return;
+
+		//Vertex -> faces adjacency
+		std::vector<unsigned int> adjacency_offset(num_verts + 1, 0);
+		std::vector<unsigned int> adjacency;
+		{
+			for (const auto &face : m_mesh_faces)
+			{
+				for (int v = 0; v < 3; ++v)
+					++adjacency_offset[face.vertIndex[v] + 1];
+			}
+			for (size_t i = 0; i < num_verts; ++i)
+			{
+				adjacency_offset[i + 1] += adjacency_offset[i];
+			}
+			adjacency.resize(adjacency_offset[num_verts]);
+			std::vector<unsigned int> fill(adjacency_offset.begin(), adjacency_offset.end() - 1);
+			for (size_t f = 0; f < num_faces; ++f)
+			{
+				for (int v = 0; v < 3; ++v)
+					adjacency[fill[m_mesh_faces[f].vertIndex[v]]++] = f;
+			}
+		}
+
+		std::vector<int> valence(num_verts);
+		std::vector<int> cache_pos(num_verts, -1);
+		std::vector<float> vert_score(num_verts);
+		std::vector<float> face_score(num_faces, 0.0f);
+		std::vector<bool> face_added(num_faces, false);
+
+		auto calcVertexScore = [&](unsigned int vert) -> float
+		{
+			//No face left
+			if (valence[vert] == 0)
+				return -1.0f;
+
+			float score = 0.0f;
+			int pos = cache_pos[vert];
+			if (pos >= 0)
+			{
+				//The vertices of the last face should not be favored over the others
+				if (pos < 3)
+					score = last_face_score;
+				else
+					score = std::pow(1.0f - (pos - 3) * (1.0f / (cache_size - 3)), cache_decay_power);
+			}
+
+			//Bonus points for having few faces left, which clears out lone vertices
+			score += valence_boost_scale * std::pow(static_cast<float>(valence[vert]), -valence_boost_power);
+			return score;
+		};
+
+		for (size_t i = 0; i < num_verts; ++i)
+		{
+			valence[i] = adjacency_offset[i + 1] - adjacency_offset[i];
+			vert_score[i] = calcVertexScore(i);
+		}
+		for (size_t f = 0; f < num_faces; ++f)
+		{
+			const auto &face = m_mesh_faces[f];
+			face_score[f] = vert_score[face.vertIndex[0]] + vert_score[face.vertIndex[1]] + vert_score[face.vertIndex[2]];
+		}
+
+		//Note: the faces are grouped by material, the candidates are restricted to the material of the last
+		//      face, and the fallback face is always of the lowest material left, hence the groups are kept
+		std::vector<unsigned int> order;
+		order.reserve(num_faces);
+		std::vector<unsigned int> cache, new_cache;
+		size_t next_unadded = 0;
+		int best_face = 0;
+		for (size_t i = 0; i < num_faces; ++i)
+		{
+			//Fall back to the next face in the original order if the cache got no candidate
+			if (best_face < 0)
+			{
+				while (face_added[next_unadded])
+					++next_unadded;
+				best_face = next_unadded;
+			}
+
+			const auto &face = m_mesh_faces[best_face];
+			face_added[best_face] = true;
+			order.push_back(best_face);
+
+			//Remove the face from the adjacency of its vertices
+			for (int v = 0; v < 3; ++v)
+			{
+				unsigned int vert = face.vertIndex[v];
+				auto beg = adjacency.begin() + adjacency_offset[vert];
+				auto end = beg + valence[vert];
+				std::iter_swap(std::find(beg, end, static_cast<unsigned int>(best_face)), end - 1);
+				--valence[vert];
+			}
+
+			//Move the vertices of the face to the front of the cache
+			new_cache.assign(face.vertIndex, face.vertIndex + 3);
+			for (auto vert : cache)
+			{
+				if (vert != face.vertIndex[0] && vert != face.vertIndex[1] && vert != face.vertIndex[2])
+					new_cache.push_back(vert);
+			}
+			std::swap(cache, new_cache);
+
+			//Update the scores of the touched vertices and their faces
+			for (size_t c = 0; c < cache.size(); ++c)
+			{
+				cache_pos[cache[c]] = (c < cache_size) ? static_cast<int>(c) : -1;
+				vert_score[cache[c]] = calcVertexScore(cache[c]);
+			}
+			best_face = -1;
+			float best_score = -1.0f;
+			for (size_t c = 0; c < cache.size(); ++c)
+			{
+				unsigned int vert = cache[c];
+				for (int a = 0; a < valence[vert]; ++a)
+				{
+					unsigned int f = adjacency[adjacency_offset[vert] + a];
+					const auto &adj = m_mesh_faces[f];
+					face_score[f] = vert_score[adj.vertIndex[0]] + vert_score[adj.vertIndex[1]] + vert_score[adj.vertIndex[2]];
+					if (adj.materialId == face.materialId && face_score[f] > best_score)
+					{
+						best_score = face_score[f];
+						best_face = f;
+					}
+				}
+			}
+			if (cache.size() > cache_size)
+			{
+				cache.resize(cache_size);
+			}
+		}
+
+		permuteFaces(order);
 	}
 
 }
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include "glm/glm.hpp"
 
 #include "TRShadingState.h"
+#include "TRVertexStreams.h"
 
 namespace TinyRenderer
 {
@@ -29,29 +30,66 @@ namespace TinyRenderer
 		}
 	};
 
+	//A unique (position, normal, texcoord) combination of the mesh
+	//Note: the vertex shader runs once per mesh vertex rather than once per face corner
+	class TRMeshVertex final
+	{
+	public:
+		unsigned int vposIndex;
+		unsigned int vnorIndex;
+		unsigned int vtexIndex;
+	};
+
 	class TRMeshFace final
 	{
 	public:
-		unsigned int vposIndex[3];
-		unsigned int vnorIndex[3];
-		unsigned int vtexIndex[3];
-
-		//Per face material
-		int diffuseMapTexId = -1;
-		int specularMapTexId = -1;
-		int normalMapTexId = -1;
-		int glowMapTexId = -1;
-		glm::vec3 kA = glm::vec3(0.0f);//Ambient coefficient
-		glm::vec3 kD = glm::vec3(1.0f);//Diffuse coefficient
-		glm::vec3 kS = glm::vec3(0.0f);//Specular coefficient
-		glm::vec3 kE = glm::vec3(0.0f);//Emission
-		float shininess = 1.0f;		   //Specular highlight exponment
-
-		//TBN matrix
+		unsigned int vertIndex[3];//Index into the mesh vertices, which index the attributes
+		unsigned int materialId = 0;//Index into the material table of the mesh
+	};
+
+	//TBN matrix of a face, stored apart from the faces since only the geometry stage reads it
+	class TRFaceTangent final
+	{
+	public:
 		glm::vec3 tangent;
 		glm::vec3 bitangent;
 	};
 
+	//Bounding volumes in the object space
+	class TRBoundingVolume final
+	{
+	public:
+		glm::vec3 boxMin = glm::vec3(0.0f);
+		glm::vec3 boxMax = glm::vec3(0.0f);
+		glm::vec3 sphereCenter = glm::vec3(0.0f);
+		float sphereRadius = 0.0f;
+	};
+
+	//A run of consecutive faces of a mesh sharing a material, for culling parts of the large meshes
+	class TRMeshChunk final
+	{
+	public:
+		unsigned int faceBegin, faceEnd; // Range of the faces
+		unsigned int vertBegin, vertEnd; // Range of the mesh vertices referenced by the faces
+		unsigned int materialId;
+		TRBoundingVolume bounds;
+	};
+
+	//Per-instance data of the instanced drawing
+	class TRMeshInstance final
+	{
+	public:
+		glm::mat4 modelMatrix = glm::mat4(1.0f);
+
+		//Material override, replacing the coefficients of all the faces (the textures are kept)
+		bool overrideMaterial = false;
+		glm::vec3 kA = glm::vec3(0.0f);
+		glm::vec3 kD = glm::vec3(1.0f);
+		glm::vec3 kS = glm::vec3(0.0f);
+		glm::vec3 kE = glm::vec3(0.0f);
+		float shininess = 1.0f;
+	};
+
 	class TRDrawableMesh
 	{
 	public:
@@ -61,26 +99,55 @@ namespace TinyRenderer
 		TRDrawableMesh() = default;
 		~TRDrawableMesh() = default;
 		
-		TRDrawableMesh(const std::string &filename);
+		TRDrawableMesh(const std::string &filename, bool reorderFaces = false);
 		TRDrawableMesh(const TRDrawableMesh& mesh)
-			: m_vertices_attrib(mesh.m_vertices_attrib), m_mesh_faces(mesh.m_mesh_faces) {}
+			: m_vertices_attrib(mesh.m_vertices_attrib), m_mesh_vertices(mesh.m_mesh_vertices), 
+			m_mesh_faces(mesh.m_mesh_faces), m_face_tangents(mesh.m_face_tangents), m_materials(mesh.m_materials),
+			m_vertex_streams(mesh.m_vertex_streams), m_bounds(mesh.m_bounds), m_chunks(mesh.m_chunks) {}
 		TRDrawableMesh& operator=(const TRDrawableMesh& mesh);
 
-		void loadMeshFromFile(const std::string &filename);
+		//Note: reorderFaces reorders the faces for vertex reuse (Forsyth's algorithm)
+		//      the parsed mesh is cached in a binary file next to the obj file (see TRMeshCache)
+		void loadMeshFromFile(const std::string &filename, bool reorderFaces = false);
 
 		TRVertexAttrib& getVerticesAttrib() { return m_vertices_attrib; }
+		std::vector<TRMeshVertex>& getMeshVertices() { return m_mesh_vertices; }
 		std::vector<TRMeshFace>& getMeshFaces() { return m_mesh_faces; }
 		const TRVertexAttrib& getVerticesAttrib() const { return m_vertices_attrib; }
+		const std::vector<TRMeshVertex>& getMeshVertices() const { return m_mesh_vertices; }
 		const std::vector<TRMeshFace>& getMeshFaces() const { return m_mesh_faces; }
 
+		//Deduplicated materials, the faces are grouped by material in ascending order
+		const std::vector<TRMaterial>& getMaterials() const { return m_materials; }
+		const std::vector<TRFaceTangent>& getFaceTangents() const { return m_face_tangents; }
+
+		//Attributes of the mesh vertices for the vertex shading, built at load time
+		//Note: must be rebuilt if the vertices are edited through the non-const accessors above
+		const TRVertexStreams& getVertexStreams() const { return m_vertex_streams; }
+		void buildVertexStreams();
+
 		void clear();
 
+		//Bounding volumes computed at load time
+		//Note: the faces of each material are split into chunks of chunk_size faces in their drawing order
+		static constexpr unsigned int chunk_size = 256;
+		const TRBoundingVolume& getBounds() const { return m_bounds; }
+		const std::vector<TRMeshChunk>& getChunks() const { return m_chunks; }
+
+		//Instanced drawing: the mesh is drawn once per instance, sharing the geometry
+		//Note: a mesh without instances is drawn once with the model matrix of its config
+		//Note: the non-const getter counts as a change of the instances
+		void addInstance(const TRMeshInstance &instance) { m_instances.push_back(instance); ++m_revision; }
+		void clearInstances() { std::vector<TRMeshInstance>().swap(m_instances); ++m_revision; }
+		std::vector<TRMeshInstance>& getInstances() { ++m_revision; return m_instances; }
+		const std::vector<TRMeshInstance>& getInstances() const { return m_instances; }
+
 		//Setting
 		void setPolygonMode(TRPolygonMode mode) { m_drawing_config.polygonMode = mode; }
 		void setCullfaceMode(TRCullFaceMode mode) { m_drawing_config.cullfaceMode = mode; }
 		void setDepthtestMode(TRDepthTestMode mode) { m_drawing_config.depthtestMode = mode; }
 		void setDepthwriteMode(TRDepthWriteMode mode) { m_drawing_config.depthwriteMode = mode; }
-		void setModelMatrix(const glm::mat4& mat) { m_drawing_config.modelMatrix = mat; }
+		void setModelMatrix(const glm::mat4& mat) { m_drawing_config.modelMatrix = mat; ++m_revision; }
 		void setLightingMode(TRLightingMode mode) { m_drawing_config.lightingMode = mode; }
 
 		TRPolygonMode getPolygonMode() const { return m_drawing_config.polygonMode; }
@@ -90,9 +157,52 @@ namespace TinyRenderer
 		const glm::mat4& getModelMatrix() const { return m_drawing_config.modelMatrix; }
 		TRLightingMode getLightingMode() const { return m_drawing_config.lightingMode; }
 
+		//Bumped whenever the geometry, the model matrix or the instances change (see TRSceneBVH)
+		unsigned int getRevision() const { return m_revision; }
+
+	protected:
+		//Parsing of the obj file
+		//Note: the texture ids of the materials index into texNames, mtlNames are the material libraries
+		void loadMeshFromObj(const std::string &filename, std::vector<std::string> &texNames, std::vector<std::string> &mtlNames);
+
+		//Geometry loading, from the mesh cache or the obj file
+		//Note: the texture ids of the materials index into texPaths until bindTextures is called
+		void loadMeshData(const std::string &filename, bool reorderFaces, std::vector<std::string> &texPaths);
+
+		//The texture ids of the materials are replaced with the texture units uploaded for them
+		void bindTextures(const std::vector<int> &texUnits);
+
+		//Exchange the geometry with another mesh, the configs and the instances are kept
+		void swapMeshData(TRDrawableMesh &mesh);
+
+		void calcBoundingVolumes();
+
+		//Vertex cache optimization
+		//Refs: Tom Forsyth, Linear-Speed Vertex Cache Optimisation, 2006.
+		//      https://tomforsyth1000.github.io/papers/fast_vert_cache_opt.html
+		void optimizeFaceOrder();
+
+		//Vertices are renumbered in the order they are first referenced by the faces
+		void renumberMeshVertices();
+
+		//Stable sort of the faces by material
+		void groupFacesByMaterial();
+
+		//The faces and their tangents are reordered, order[i] being the old index of the i-th face
+		void permuteFaces(const std::vector<unsigned int> &order);
+
 	protected:
 		TRVertexAttrib m_vertices_attrib;
+		std::vector<TRMeshVertex> m_mesh_vertices;
 		std::vector<TRMeshFace> m_mesh_faces;
+		std::vector<TRFaceTangent> m_face_tangents;
+		std::vector<TRMaterial> m_materials;
+		TRVertexStreams m_vertex_streams;
+		TRBoundingVolume m_bounds;
+		std::vector<TRMeshChunk> m_chunks;
+
+		std::vector<TRMeshInstance> m_instances;
+		unsigned int m_revision = 0;
 
 		//Configuration
 		struct DrawableConfig
@@ -105,6 +215,9 @@ namespace TinyRenderer
 			glm::mat4 modelMatrix = glm::mat4(1.0f);
 		};
 		DrawableConfig m_drawing_config;
+
+		friend class TRMeshCache;
+		friend class TRAssetLoader;
 	};
 
 }
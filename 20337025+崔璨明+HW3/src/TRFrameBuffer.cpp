@@ -1,67 +1,459 @@
 #include "TRFrameBuffer.h"
 
 #include <cmath>
+#include <cstring>
 #include <algorithm>
 
+#include "TRShadingPipeline.h"
+
 namespace TinyRenderer
 {
 	TRFrameBuffer::TRFrameBuffer(int width, int height)
-		: m_channel(4), m_width(width), m_height(height)
+		: m_depthFormat(TRDepthFormat::TR_DEPTH_32F), m_numSamples(1), m_clearColor(1.0f), m_width(width), m_height(height), m_channel(4)
 	{
-		m_depthBuffer.resize(m_width * m_height, 1.0f);
 		m_colorBuffer.resize(m_width * m_height * m_channel, 255);
+		setColorTarget(nullptr, 0, TRPixelFormat::rgba8());
+
+		m_hizWidth = (m_width + hiz_tile_size - 1) / hiz_tile_size;
+		m_hizHeight = (m_height + hiz_tile_size - 1) / hiz_tile_size;
+		allocate_aux();
+	}
+
+	constexpr int TRFrameBuffer::hiz_tile_size;
+
+	void TRFrameBuffer::setDepthFormat(TRDepthFormat format)
+	{
+		m_depthFormat = format;
+		allocate_aux();
+	}
+
+	void TRFrameBuffer::setSampleCount(int num_samples)
+	{
+		m_numSamples = TRShadingPipeline::getSupportedSampleCount(num_samples);
+		allocate_aux();
+	}
+
+	void TRFrameBuffer::allocate_aux()
+	{
+		const unsigned int num_pixels = m_width * m_height;
+		m_depthBuffer.assign(num_pixels * m_numSamples * (m_depthFormat == TRDepthFormat::TR_DEPTH_16 ? 2 : 4), 0);
+		m_clearDepth = (m_depthFormat == TRDepthFormat::TR_DEPTH_32F_REVERSED) ? 0.0f : quantizeDepth_aux(1.0f);
+		m_hizBuffer.assign(m_hizWidth * m_hizHeight, { m_clearDepth, m_clearDepth, false, true, false });
+
+		//Note: nothing per sample without multisampling
+		m_sampleColors.assign(m_numSamples > 1 ? num_pixels * m_numSamples : 0, 0);
+		m_sampleExpanded.assign(m_numSamples > 1 ? num_pixels : 0, 0);
+	}
+
+	float TRFrameBuffer::loadDepth_aux(const unsigned int &index) const
+	{
+		switch (m_depthFormat)
+		{
+			case TRDepthFormat::TR_DEPTH_24:
+				return reinterpret_cast<const std::uint32_t*>(m_depthBuffer.data())[index] * (2.0f / 0xffffff) - 1.0f;
+			case TRDepthFormat::TR_DEPTH_16:
+				return reinterpret_cast<const std::uint16_t*>(m_depthBuffer.data())[index] * (2.0f / 0xffff) - 1.0f;
+			default:
+				return reinterpret_cast<const float*>(m_depthBuffer.data())[index];
+		}
+	}
+
+	void TRFrameBuffer::storeDepth_aux(const unsigned int &index, const float &value)
+	{
+		//Note: the unsigned normalized formats map the ndc range [-1, 1] to [0, 1]
+		const float unorm = std::min(std::max(value * 0.5f + 0.5f, 0.0f), 1.0f);
+		switch (m_depthFormat)
+		{
+			case TRDepthFormat::TR_DEPTH_24:
+				reinterpret_cast<std::uint32_t*>(m_depthBuffer.data())[index] = static_cast<std::uint32_t>(unorm * 0xffffff + 0.5f);
+				break;
+			case TRDepthFormat::TR_DEPTH_16:
+				reinterpret_cast<std::uint16_t*>(m_depthBuffer.data())[index] = static_cast<std::uint16_t>(unorm * 0xffff + 0.5f);
+				break;
+			default:
+				reinterpret_cast<float*>(m_depthBuffer.data())[index] = value;
+				break;
+		}
+	}
+
+	float TRFrameBuffer::quantizeDepth_aux(const float &value) const
+	{
+		switch (m_depthFormat)
+		{
+			case TRDepthFormat::TR_DEPTH_24:
+				return static_cast<std::uint32_t>(std::min(std::max(value * 0.5f + 0.5f, 0.0f), 1.0f) * 0xffffff + 0.5f)
+					* (2.0f / 0xffffff) - 1.0f;
+			case TRDepthFormat::TR_DEPTH_16:
+				return static_cast<std::uint16_t>(std::min(std::max(value * 0.5f + 0.5f, 0.0f), 1.0f) * 0xffff + 0.5f)
+					* (2.0f / 0xffff) - 1.0f;
+			default:
+				return value;
+		}
 	}
 
 	float TRFrameBuffer::readDepth(const unsigned int &x, const unsigned int &y) const
+	{
+		return readDepth(x, y, 0);
+	}
+
+	float TRFrameBuffer::readDepth(const unsigned int &x, const unsigned int &y, const unsigned int &sample) const
 	{
 		if (x < 0 || x >= m_width || y < 0 || y >= m_height)
 			return 0.0f;
-		return m_depthBuffer[y*m_width + x];
+		if (m_hizBuffer[(y / hiz_tile_size) * m_hizWidth + x / hiz_tile_size].cleared)
+			return m_clearDepth;
+		return loadDepth_aux((y * m_width + x) * m_numSamples + sample);
 	}
 
 	void TRFrameBuffer::clear(const glm::vec4 &color)
 	{
-		unsigned char red = static_cast<unsigned char>(255 * color.x);
-		unsigned char green = static_cast<unsigned char>(255 * color.y);
-		unsigned char blue = static_cast<unsigned char>(255 * color.z);
-		unsigned char alpha = static_cast<unsigned char>(255 * color.w);
+		//Note: the tiles keep their clear values until they are written to, see fillTile_aux
+		m_clearColor = color;
+		std::fill(m_hizBuffer.begin(), m_hizBuffer.end(), HiZTile{ m_clearDepth, m_clearDepth, false, true, false });
+	}
+
+	void TRFrameBuffer::resolve()
+	{
+		for (unsigned int ty = 0; ty < m_hizHeight; ++ty)
+		{
+			for (unsigned int tx = 0; tx < m_hizWidth; ++tx)
+			{
+				const HiZTile &tile = m_hizBuffer[ty * m_hizWidth + tx];
+				if (tile.cleared)
+				{
+					fillTile_aux(tx, ty, true);
+					continue;
+				}
+				if (!tile.multisampled)
+					continue;
+
+				//Note: the pixels of a single color are in the color target already
+				unsigned int min_x = tx * hiz_tile_size, max_x = std::min(min_x + hiz_tile_size, m_width);
+				unsigned int min_y = ty * hiz_tile_size, max_y = std::min(min_y + hiz_tile_size, m_height);
+				for (unsigned int y = min_y; y < max_y; ++y)
+				{
+					std::uint32_t *dst = reinterpret_cast<std::uint32_t*>(m_color + y * m_pitch);
+					for (unsigned int x = min_x; x < max_x; ++x)
+					{
+						if (m_sampleExpanded[y * m_width + x])
+							dst[x] = resolveSamples_aux(&m_sampleColors[(y * m_width + x) * m_numSamples]);
+					}
+				}
+			}
+		}
+	}
+
+	std::uint32_t TRFrameBuffer::resolveSamples_aux(const std::uint32_t *samples) const
+	{
+		//Note: 4 or 8 samples, the channels of the pixels are summed up in 16-bit lanes
+#if defined(TR_RASTER_AVX2) || defined(TR_RASTER_SSE2)
+		const __m128i zero = _mm_setzero_si128();
+		__m128i sum = _mm_setzero_si128();
+		for (unsigned int s = 0; s < m_numSamples; s += 4)
+		{
+			__m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + s));
+			sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_unpacklo_epi8(pixels, zero), _mm_unpackhi_epi8(pixels, zero)));
+		}
+		sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+		sum = _mm_add_epi16(sum, _mm_set1_epi16(static_cast<short>(m_numSamples / 2)));
+		sum = _mm_srl_epi16(sum, _mm_cvtsi32_si128(m_numSamples == 8 ? 3 : 2));
+		return static_cast<std::uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(sum, sum)));
+#else
+		std::uint32_t result = 0;
+		for (int shift = 0; shift < 32; shift += 8)
+		{
+			unsigned int sum = m_numSamples / 2;
+			for (unsigned int s = 0; s < m_numSamples; ++s)
+			{
+				sum += (samples[s] >> shift) & 0xffu;
+			}
+			result |= (sum / m_numSamples) << shift;
+		}
+		return result;
+#endif
+	}
+
+	void TRFrameBuffer::fillTile_aux(const unsigned int &tx, const unsigned int &ty, bool color_only)
+	{
+		unsigned int min_x = tx * hiz_tile_size, max_x = std::min(min_x + hiz_tile_size, m_width);
+		unsigned int min_y = ty * hiz_tile_size, max_y = std::min(min_y + hiz_tile_size, m_height);
+		const std::uint32_t pixel = packColor_aux(m_clearColor);
+		for (unsigned int y = min_y; y < max_y; ++y)
+		{
+			std::uint32_t *dst = reinterpret_cast<std::uint32_t*>(m_color + y * m_pitch);
+			std::fill(dst + min_x, dst + max_x, pixel);
+		}
 
-		for (unsigned int row = 0; row < m_height; ++row)
+		//Note: the tile of a color only filling still reads as cleared, hence could be filled again later
+		if (color_only)
+			return;
+		for (unsigned int y = min_y; y < max_y; ++y)
 		{
-			for (unsigned int col = 0; col < m_width; ++col)
+			for (unsigned int i = (y * m_width + min_x) * m_numSamples; i < (y * m_width + max_x) * m_numSamples; ++i)
+			{
+				storeDepth_aux(i, m_clearDepth);
+			}
+			if (!m_sampleExpanded.empty())
 			{
-				m_depthBuffer[row * m_width + col] = 1.0f;
-				m_colorBuffer[row * m_width * m_channel + col * m_channel + 0] = red;
-				m_colorBuffer[row * m_width * m_channel + col * m_channel + 1] = green;
-				m_colorBuffer[row * m_width * m_channel + col * m_channel + 2] = blue;
-				m_colorBuffer[row * m_width * m_channel + col * m_channel + 3] = alpha;
+				std::fill(m_sampleExpanded.begin() + y * m_width + min_x, m_sampleExpanded.begin() + y * m_width + max_x, 0);
+			}
+			if (!m_gBuffer.empty())
+			{
+				for (unsigned int x = min_x; x < max_x; ++x)
+				{
+					m_gBuffer[y * m_width + x].covered = false;
+				}
 			}
 		}
+		m_hizBuffer[ty * m_hizWidth + tx].cleared = false;
+		m_hizBuffer[ty * m_hizWidth + tx].multisampled = false;
+	}
+
+	TRFrameBuffer::HiZTile &TRFrameBuffer::getWrittenTile_aux(const unsigned int &x, const unsigned int &y)
+	{
+		const unsigned int tx = x / hiz_tile_size, ty = y / hiz_tile_size;
+		HiZTile &tile = m_hizBuffer[ty * m_hizWidth + tx];
+		if (tile.cleared)
+			fillTile_aux(tx, ty, false);
+		return tile;
+	}
+
+	void TRFrameBuffer::createGBuffer()
+	{
+		if (m_gBuffer.empty())
+		{
+			m_gBuffer.resize(m_width * m_height);
+		}
+	}
+
+	const TRGBufferSample &TRFrameBuffer::readGBuffer(const unsigned int &x, const unsigned int &y) const
+	{
+		static const TRGBufferSample empty = TRGBufferSample();
+		if (x >= m_width || y >= m_height || m_gBuffer.empty())
+			return empty;
+		if (m_hizBuffer[(y / hiz_tile_size) * m_hizWidth + x / hiz_tile_size].cleared)
+			return empty;
+		return m_gBuffer[y * m_width + x];
+	}
+
+	void TRFrameBuffer::writeGBuffer(const unsigned int &x, const unsigned int &y, const TRGBufferSample &sample)
+	{
+		if (x >= m_width || y >= m_height || m_gBuffer.empty())
+			return;
+		getWrittenTile_aux(x, y);
+		TRGBufferSample &dst = m_gBuffer[y * m_width + x];
+		dst = sample;
+		dst.covered = true;
 	}
 
 	void TRFrameBuffer::writeDepth(const unsigned int &x, const unsigned int &y, const float &value)
+	{
+		if (m_numSamples == 1)
+		{
+			writeDepth(x, y, 0, value);
+			return;
+		}
+		for (unsigned int s = 0; s < m_numSamples; ++s)
+		{
+			writeDepth(x, y, s, value);
+		}
+	}
+
+	void TRFrameBuffer::writeDepth(const unsigned int &x, const unsigned int &y, const unsigned int &sample, const float &value)
 	{
 		if (x < 0 || x >= m_width || y < 0 || y >= m_height)
 			return;
-		unsigned int index = y * m_width + x;
-		m_depthBuffer[index] = value;
+		HiZTile &tile = getWrittenTile_aux(x, y);
+		unsigned int index = (y * m_width + x) * m_numSamples + sample;
+		float old = loadDepth_aux(index);
+		float depth = quantizeDepth_aux(value);
+		storeDepth_aux(index, depth);
+
+		// Grow the range of the tile at once, and mark it as dirty if the old depth was on the bound
+		if (depth >= tile.maxDepth)
+			tile.maxDepth = depth;
+		else if (old == tile.maxDepth)
+			tile.dirty = true;
+		if (depth <= tile.minDepth)
+			tile.minDepth = depth;
+		else if (old == tile.minDepth)
+			tile.dirty = true;
+	}
+
+	TRFrameBuffer::HiZTile &TRFrameBuffer::getHiZTile(const unsigned int &tx, const unsigned int &ty)
+	{
+		HiZTile &tile = m_hizBuffer[ty * m_hizWidth + tx];
+		if (tile.dirty)
+		{
+			unsigned int min_x = tx * hiz_tile_size, max_x = std::min(min_x + hiz_tile_size, m_width);
+			unsigned int min_y = ty * hiz_tile_size, max_y = std::min(min_y + hiz_tile_size, m_height);
+			tile.minDepth = tile.maxDepth = loadDepth_aux((min_y * m_width + min_x) * m_numSamples);
+			for (unsigned int y = min_y; y < max_y; ++y)
+			{
+				for (unsigned int i = (y * m_width + min_x) * m_numSamples; i < (y * m_width + max_x) * m_numSamples; ++i)
+				{
+					float depth = loadDepth_aux(i);
+					tile.minDepth = std::min(tile.minDepth, depth);
+					tile.maxDepth = std::max(tile.maxDepth, depth);
+				}
+			}
+			tile.dirty = false;
+		}
+		return tile;
+	}
+
+	float TRFrameBuffer::readHiZMinDepth(const unsigned int &tx, const unsigned int &ty)
+	{
+		if (tx >= m_hizWidth || ty >= m_hizHeight)
+			return 0.0f;
+		return getHiZTile(tx, ty).minDepth;
+	}
+
+	float TRFrameBuffer::readHiZMaxDepth(const unsigned int &tx, const unsigned int &ty)
+	{
+		if (tx >= m_hizWidth || ty >= m_hizHeight)
+			return 0.0f;
+		return getHiZTile(tx, ty).maxDepth;
+	}
+
+	std::uint32_t TRFrameBuffer::packColor_aux(const glm::vec4 &color) const
+	{
+		//Truncated like a cast, but saturated instead of wrapping around
+		std::uint32_t rgba;
+#if defined(TR_RASTER_AVX2) || defined(TR_RASTER_SSE2)
+		//Note: clamped before the scaling, since the conversion turns the out of range values into 0x80000000,
+		//      and a NaN becomes 0 as the second operand of the max
+		__m128 clamped = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(&color.x), _mm_setzero_ps()), _mm_set1_ps(1.0f));
+		__m128i channels = _mm_cvttps_epi32(_mm_mul_ps(clamped, _mm_set1_ps(255.0f)));
+		channels = _mm_packs_epi32(channels, channels);
+		rgba = static_cast<std::uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(channels, channels)));
+#else
+		auto saturate = [](float value) -> std::uint32_t
+		{
+			return value > 0.0f ? static_cast<std::uint32_t>(std::min(value * 255.0f, 255.0f)) : 0u;
+		};
+		rgba = saturate(color.x) | (saturate(color.y) << 8) | (saturate(color.z) << 16) | (saturate(color.w) << 24);
+#endif
+		if (m_format == TRPixelFormat::rgba8())
+			return rgba;
+		return ((rgba & 0xffu) << m_format.redShift) | (((rgba >> 8) & 0xffu) << m_format.greenShift)
+			| (((rgba >> 16) & 0xffu) << m_format.blueShift) | ((rgba >> 24) << m_format.alphaShift);
 	}
 
 	void TRFrameBuffer::writeColor(const unsigned int &x, const unsigned int &y, const glm::vec4 &color)
 	{
 		if (x < 0 || x >= m_width || y < 0 || y >= m_height)
 			return;
+		getWrittenTile_aux(x, y);
+		*reinterpret_cast<std::uint32_t*>(m_color + y * m_pitch + x * m_channel) = packColor_aux(color);
+		if (m_numSamples > 1)
+			m_sampleExpanded[y * m_width + x] = 0;
+	}
 
-		// Clamping in case overflow
-		unsigned char red = static_cast<unsigned char>(color.x * 255);
-		unsigned char green = static_cast<unsigned char>(color.y * 255);
-		unsigned char blue = static_cast<unsigned char>(color.z * 255);
-		unsigned char alpha = static_cast<unsigned char>(std::min(255 * color.w, 255.0f));
-		unsigned int index = y * m_width*m_channel + x * m_channel;
-		m_colorBuffer[index + 0] = red;
-		m_colorBuffer[index + 1] = green;
-		m_colorBuffer[index + 2] = blue;
-		m_colorBuffer[index + 3] = alpha;
+	void TRFrameBuffer::writeColor(const unsigned int &x, const unsigned int &y, const glm::vec4 &color, const unsigned int &coverage)
+	{
+		if (coverage == (1u << m_numSamples) - 1)
+		{
+			writeColor(x, y, color);
+			return;
+		}
+		if (x >= m_width || y >= m_height)
+			return;
+
+		HiZTile &tile = getWrittenTile_aux(x, y);
+		const std::uint32_t pixel = packColor_aux(color);
+		std::uint32_t &target = *reinterpret_cast<std::uint32_t*>(m_color + y * m_pitch + x * m_channel);
+		std::uint32_t *samples = &m_sampleColors[(y * m_width + x) * m_numSamples];
+		unsigned char &expanded = m_sampleExpanded[y * m_width + x];
+		if (!expanded)
+		{
+			//Still a single color if the samples have it already
+			if (target == pixel)
+				return;
+			std::fill(samples, samples + m_numSamples, target);
+			expanded = 1;
+			tile.multisampled = true;
+		}
+		for (unsigned int s = 0; s < m_numSamples; ++s)
+		{
+			if (coverage & (1u << s))
+				samples[s] = pixel;
+		}
+	}
+
+	void TRFrameBuffer::setColorTarget(unsigned char *pixels, int pitch, const TRPixelFormat &format)
+	{
+		if (pixels == nullptr)
+		{
+			m_color = m_colorBuffer.data();
+			m_pitch = m_width * m_channel;
+			m_format = TRPixelFormat::rgba8();
+			return;
+		}
+		m_color = pixels;
+		m_pitch = pitch;
+		m_format = format;
+	}
+
+	void TRFrameBuffer::convertPixels(
+		const unsigned char *src, int src_pitch, const TRPixelFormat &src_format,
+		unsigned char *dst, int dst_pitch, const TRPixelFormat &dst_format,
+		int width, int height)
+	{
+		if (src_format == dst_format)
+		{
+			for (int y = 0; y < height; ++y)
+			{
+				std::memcpy(dst + y * dst_pitch, src + y * src_pitch, width * 4);
+			}
+			return;
+		}
+
+		// Every channel is shifted down to the lowest byte, masked, then shifted up to its place
+		const int from[4] = { src_format.redShift, src_format.greenShift, src_format.blueShift, src_format.alphaShift };
+		const int to[4] = { dst_format.redShift, dst_format.greenShift, dst_format.blueShift, dst_format.alphaShift };
+		for (int y = 0; y < height; ++y)
+		{
+			const std::uint32_t *src_row = reinterpret_cast<const std::uint32_t*>(src + y * src_pitch);
+			std::uint32_t *dst_row = reinterpret_cast<std::uint32_t*>(dst + y * dst_pitch);
+			int x = 0;
+#if defined(TR_RASTER_AVX2)
+			const __m256i mask = _mm256_set1_epi32(0xff);
+			for (; x + 8 <= width; x += 8)
+			{
+				__m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src_row + x));
+				__m256i result = _mm256_setzero_si256();
+				for (int c = 0; c < 4; ++c)
+				{
+					__m256i channel = _mm256_and_si256(_mm256_srl_epi32(pixels, _mm_cvtsi32_si128(from[c])), mask);
+					result = _mm256_or_si256(result, _mm256_sll_epi32(channel, _mm_cvtsi32_si128(to[c])));
+				}
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst_row + x), result);
+			}
+#elif defined(TR_RASTER_SSE2)
+			const __m128i mask = _mm_set1_epi32(0xff);
+			for (; x + 4 <= width; x += 4)
+			{
+				__m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src_row + x));
+				__m128i result = _mm_setzero_si128();
+				for (int c = 0; c < 4; ++c)
+				{
+					__m128i channel = _mm_and_si128(_mm_srl_epi32(pixels, _mm_cvtsi32_si128(from[c])), mask);
+					result = _mm_or_si128(result, _mm_sll_epi32(channel, _mm_cvtsi32_si128(to[c])));
+				}
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst_row + x), result);
+			}
+#endif
+			for (; x < width; ++x)
+			{
+				std::uint32_t result = 0;
+				for (int c = 0; c < 4; ++c)
+				{
+					result |= ((src_row[x] >> from[c]) & 0xffu) << to[c];
+				}
+				dst_row[x] = result;
+			}
+		}
 	}
 
 }
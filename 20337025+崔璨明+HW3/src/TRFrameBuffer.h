@@ -3,11 +3,29 @@
 
 #include <vector>
 #include <memory>
+#include <cstdint>
 
 #include "glm/glm.hpp"
 
+#include "TRShadingState.h"
+
 namespace TinyRenderer
 {
+	// Layout of a 32-bit color pixel: the bit offsets of the 8-bit channels in the native 32-bit word.
+	struct TRPixelFormat
+	{
+		int redShift, greenShift, blueShift, alphaShift;
+
+		bool operator==(const TRPixelFormat &other) const
+		{
+			return redShift == other.redShift && greenShift == other.greenShift
+				&& blueShift == other.blueShift && alphaShift == other.alphaShift;
+		}
+
+		// The bytes R, G, B, A in memory order on a little-endian machine.
+		static TRPixelFormat rgba8() { return TRPixelFormat{ 0, 8, 16, 24 }; }
+	};
+
 	/**
 	 * @projectName   TinyRenderer
 	 * @brief         Frame buffer class.
@@ -23,21 +41,106 @@ namespace TinyRenderer
 		TRFrameBuffer(int width, int height);
 		~TRFrameBuffer() = default;
 
+		// Clear in O(tiles): a tile only holds its clear values once it is first written to.
+		// Note: resolve() writes the clear color into the tiles left untouched, and the average of the samples
+		//       into the pixels of several colors, before the colors are read.
 		void clear(const glm::vec4 &color);
+		void resolve();
+
+		// The depth values are always the ones of the ndc space, whatever the storage format.
+		// Note: the depth buffer is cleared by a change of the format. The reversed format is cleared to 0,
+		//       and the nearer depth is the greater one.
+		void setDepthFormat(TRDepthFormat format);
+		TRDepthFormat getDepthFormat() const { return m_depthFormat; }
+
+		// Multisampling with 1, 4 or 8 samples per pixel, see TRShadingPipeline::getSamplePositions.
+		// Note: the depth is stored per sample. A pixel whose samples share one color keeps it in the color
+		//       target only, the others hold a color per sample until resolve(). The frame buffer is cleared
+		//       by a change of the sample count.
+		void setSampleCount(int num_samples);
+		int getSampleCount() const { return m_numSamples; }
 
 		// Getter.
 		int getWidth()const { return m_width; }
 		int getHeight()const { return m_height; }
-		unsigned char *getColorBuffer() { return m_colorBuffer.data(); }
+		unsigned char *getColorBuffer() { return m_color; }
+		int getColorPitch() const { return m_pitch; }
+		const TRPixelFormat &getColorFormat() const { return m_format; }
+
+		// Render the colors into pixels (e.g. the locked window surface) instead of the own color buffer,
+		// whose rows are pitch bytes apart. A null pixels switches back to the own buffer in rgba8.
+		// Note: the caller keeps the pixels valid as long as they are set.
+		void setColorTarget(unsigned char *pixels, int pitch, const TRPixelFormat &format);
 
+		// Copy of 32-bit pixels with the channels reordered, in a single SIMD pass.
+		static void convertPixels(
+			const unsigned char *src, int src_pitch, const TRPixelFormat &src_format,
+			unsigned char *dst, int dst_pitch, const TRPixelFormat &dst_format,
+			int width, int height);
+
+		// Without a sample, the depth of the first sample is read, and the depth of all of them is written.
 		float readDepth(const unsigned int &x, const unsigned int &y) const;
+		float readDepth(const unsigned int &x, const unsigned int &y, const unsigned int &sample) const;
 		void writeDepth(const unsigned int &x, const unsigned int &y, const float &value);
+		void writeDepth(const unsigned int &x, const unsigned int &y, const unsigned int &sample, const float &value);
 		void writeColor(const unsigned int &x, const unsigned int &y, const glm::vec4 &color);
+		// Only the samples of the bits of coverage are written.
+		void writeColor(const unsigned int &x, const unsigned int &y, const glm::vec4 &color, const unsigned int &coverage);
+
+		// Hierarchical z-buffer: the depth range of each tile of hiz_tile_size x hiz_tile_size pixels.
+		// Note: kept up to date by writeDepth, a tile is only rescanned when a write shrinks its range.
+		static constexpr int hiz_tile_size = 8;
+		float readHiZMinDepth(const unsigned int &tx, const unsigned int &ty);
+		float readHiZMaxDepth(const unsigned int &tx, const unsigned int &ty);
+
+		// G-buffer for deferred shading, allocated on first use.
+		void createGBuffer();
+		bool hasGBuffer() const { return !m_gBuffer.empty(); }
+		const TRGBufferSample &readGBuffer(const unsigned int &x, const unsigned int &y) const;
+		void writeGBuffer(const unsigned int &x, const unsigned int &y, const TRGBufferSample &sample);
 
 	private:
-		std::vector<float> m_depthBuffer;          // Z-buffer
+		struct HiZTile
+		{
+			float minDepth, maxDepth;
+			bool dirty;
+			bool cleared;       // Still to be filled with the clear values
+			bool multisampled;  // Holding pixels of a color per sample
+		};
+		HiZTile &getHiZTile(const unsigned int &tx, const unsigned int &ty);
+		HiZTile &getWrittenTile_aux(const unsigned int &x, const unsigned int &y);
+		void fillTile_aux(const unsigned int &tx, const unsigned int &ty, bool color_only);
+		void allocate_aux();
+
+		// Average of the colors of the samples of a pixel, each channel rounded.
+		std::uint32_t resolveSamples_aux(const std::uint32_t *samples) const;
+
+		// Saturated to [0, 255] per channel, then packed in the format of the color target.
+		std::uint32_t packColor_aux(const glm::vec4 &color) const;
+
+		// Depth value in the storage format, quantized when it is stored.
+		float loadDepth_aux(const unsigned int &index) const;
+		void storeDepth_aux(const unsigned int &index, const float &value);
+		float quantizeDepth_aux(const float &value) const;
+
+	private:
+		std::vector<unsigned char> m_depthBuffer;  // Z-buffer, in m_depthFormat
+		TRDepthFormat m_depthFormat;
+		float m_clearDepth;                        // The far plane, as stored in m_depthFormat
+		unsigned int m_numSamples;
+		std::vector<std::uint32_t> m_sampleColors; // Colors per sample, of the pixels of several colors only
+		std::vector<unsigned char> m_sampleExpanded; // Whether a pixel holds a color per sample
+		glm::vec4 m_clearColor;
+		std::vector<HiZTile> m_hizBuffer;          // Hierarchical Z-buffer
+		std::vector<TRGBufferSample> m_gBuffer;    // G-buffer
+		unsigned int m_hizWidth, m_hizHeight;
 		std::vector<unsigned char> m_colorBuffer;   // Color buffer
 		unsigned int m_width, m_height, m_channel;  // Viewport
+
+		// Color target, the own color buffer or the pixels of the caller
+		unsigned char *m_color;
+		unsigned int m_pitch;
+		TRPixelFormat m_format;
 	};
 }
 
@@ -0,0 +1,141 @@
+#include "TRLightGrid.h"
+
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+namespace TinyRenderer
+{
+	constexpr int TRLightGrid::tile_size;
+	constexpr float TRLightGrid::influence_threshold;
+
+	TRLightGrid::TRLightGrid(int width, int height)
+		: m_width(width), m_height(height)
+	{
+		m_num_tiles_x = (width + tile_size - 1) / tile_size;
+		m_num_tiles_y = (height + tile_size - 1) / tile_size;
+		m_tile_lights.resize(m_num_tiles_x * m_num_tiles_y);
+		m_tile_depth_range.resize(m_num_tiles_x * m_num_tiles_y);
+	}
+
+	float TRLightGrid::calcInfluenceRadius(const TRPointLight &light)
+	{
+		//Refs: Brian Karis, Real Shading in Unreal Engine 4, 2013 (windowed falloff)
+		//The ambient, diffuse and specular terms are bounded by lightColor * attenuation each,
+		//so solve c + l*d + q*d^2 = 3 * max(lightColor) / influence_threshold for d
+		float max_color = std::max(light.lightColor.x, std::max(light.lightColor.y, light.lightColor.z));
+		float k = 3.0f * max_color / influence_threshold;
+		float c = light.attenuation.x - k, l = light.attenuation.y, q = light.attenuation.z;
+		if (c >= 0.0f)
+			return 0.0f;
+		if (q > 0.0f)
+			return (-l + std::sqrt(l * l - 4.0f * q * c)) / (2.0f * q);
+		if (l > 0.0f)
+			return -c / l;
+		return -1.0f;
+	}
+
+	void TRLightGrid::build(
+		const std::vector<TRPointLight> &lights,
+		const glm::mat4 &view,
+		const glm::mat4 &project,
+		float near,
+		TRFrameBuffer *depth)
+	{
+		for (auto &tile : m_tile_lights)
+		{
+			tile.clear();
+		}
+
+		//Depth range of each tile, from the hierarchical z-buffer
+		static_assert(tile_size % TRFrameBuffer::hiz_tile_size == 0, "Light tiles must be aligned to the hierarchical z-buffer");
+		if (depth != nullptr)
+		{
+			const int ratio = tile_size / TRFrameBuffer::hiz_tile_size;
+			for (int ty = 0; ty < m_num_tiles_y; ++ty)
+			{
+				for (int tx = 0; tx < m_num_tiles_x; ++tx)
+				{
+					glm::vec2 range(1.0f, -1.0f);
+					for (int y = ty * ratio; y < (ty + 1) * ratio; ++y)
+					{
+						for (int x = tx * ratio; x < (tx + 1) * ratio; ++x)
+						{
+							//Note: the tiles out of the screen read 0
+							range.x = std::min(range.x, depth->readHiZMinDepth(x, y));
+							range.y = std::max(range.y, depth->readHiZMaxDepth(x, y));
+						}
+					}
+					m_tile_depth_range[ty * m_num_tiles_x + tx] = range;
+				}
+			}
+		}
+
+		auto ndc_depth = [&](float z) -> float
+		{
+			glm::vec4 p = project * glm::vec4(0.0f, 0.0f, z, 1.0f);
+			return p.z / p.w;
+		};
+
+		m_light_radius.resize(lights.size());
+		for (size_t i = 0; i < lights.size(); ++i)
+		{
+			float radius = calcInfluenceRadius(lights[i]);
+			m_light_radius[i] = radius;
+			if (radius == 0.0f)
+				continue;
+
+			//Screen space bounding rectangle & ndc depth range of the influence sphere
+			//Note: the nearer bound is the greater ndc depth of a reversed projection, hence the range is
+			//      ordered once both bounds are known
+			glm::ivec2 rect_min(0, 0), rect_max(m_width - 1, m_height - 1);
+			glm::vec2 depth_range(-1.0f, 1.0f);
+			if (radius > 0.0f)
+			{
+				glm::vec3 center = glm::vec3(view * glm::vec4(lights[i].lightPos, 1.0f));
+				//Totally behind the near plane
+				if (center.z - radius > -near)
+					continue;
+				const float far_depth = ndc_depth(center.z - radius);
+				float near_depth = ndc_depth(-near);
+
+				//Note: the projection of the corners of the bounding box is conservative
+				//      unless the sphere crosses the near plane
+				if (center.z + radius < -near)
+				{
+					near_depth = ndc_depth(center.z + radius);
+					glm::vec2 ndc_min(+FLT_MAX), ndc_max(-FLT_MAX);
+					for (int c = 0; c < 8; ++c)
+					{
+						glm::vec3 corner = center + radius * glm::vec3(
+							(c & 1) ? 1.0f : -1.0f, (c & 2) ? 1.0f : -1.0f, (c & 4) ? 1.0f : -1.0f);
+						glm::vec4 p = project * glm::vec4(corner, 1.0f);
+						glm::vec2 ndc = glm::vec2(p) / p.w;
+						ndc_min = glm::min(ndc_min, ndc);
+						ndc_max = glm::max(ndc_max, ndc);
+					}
+					//ndc space -> screen space (y-down)
+					rect_min.x = std::max(rect_min.x, static_cast<int>(std::floor((ndc_min.x * 0.5f + 0.5f) * m_width)));
+					rect_max.x = std::min(rect_max.x, static_cast<int>(std::floor((ndc_max.x * 0.5f + 0.5f) * m_width)));
+					rect_min.y = std::max(rect_min.y, static_cast<int>(std::floor((0.5f - ndc_max.y * 0.5f) * m_height)));
+					rect_max.y = std::min(rect_max.y, static_cast<int>(std::floor((0.5f - ndc_min.y * 0.5f) * m_height)));
+					if (rect_min.x > rect_max.x || rect_min.y > rect_max.y)
+						continue;
+				}
+				depth_range = glm::vec2(std::min(near_depth, far_depth), std::max(near_depth, far_depth));
+			}
+
+			for (int ty = rect_min.y / tile_size; ty <= rect_max.y / tile_size; ++ty)
+			{
+				for (int tx = rect_min.x / tile_size; tx <= rect_max.x / tile_size; ++tx)
+				{
+					int tile = ty * m_num_tiles_x + tx;
+					if (depth != nullptr &&
+						(depth_range.x > m_tile_depth_range[tile].y || depth_range.y < m_tile_depth_range[tile].x))
+						continue;
+					m_tile_lights[tile].push_back(static_cast<unsigned int>(i));
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,71 @@
+#ifndef TRLIGHTGRID_H
+#define TRLIGHTGRID_H
+
+#include <vector>
+#include <memory>
+
+#include "glm/glm.hpp"
+
+#include "TRShadingState.h"
+#include "TRFrameBuffer.h"
+
+namespace TinyRenderer
+{
+	//Per-frame light culling: the point lights influencing each screen tile
+	class TRLightGrid final
+	{
+	public:
+		typedef std::shared_ptr<TRLightGrid> ptr;
+
+		static constexpr int tile_size = 16;
+
+		//A light is dropped where its contribution falls below this value (before tone mapping)
+		static constexpr float influence_threshold = 1.0f / 256.0f;
+
+		TRLightGrid(int width, int height);
+		~TRLightGrid() = default;
+
+		//Bin the lights into the tiles they could reach
+		//Note: with a frame buffer, the tiles are also culled by the depth range of their content
+		void build(
+			const std::vector<TRPointLight> &lights,
+			const glm::mat4 &view,
+			const glm::mat4 &project,
+			float near,
+			TRFrameBuffer *depth);
+
+		//Indices of the point lights influencing the pixel (x, y), in ascending order
+		const std::vector<unsigned int> &getTileLights(int x, int y) const
+		{
+			x = glm::clamp(x / tile_size, 0, m_num_tiles_x - 1);
+			y = glm::clamp(y / tile_size, 0, m_num_tiles_y - 1);
+			return m_tile_lights[y * m_num_tiles_x + x];
+		}
+
+		//Influence radius of the i-th light in the last build
+		float getLightRadius(unsigned int i) const { return m_light_radius[i]; }
+
+		//Distance beyond which the light is negligible, negative for an infinite one
+		//Note: the attenuation is windowed by calcInfluenceWindow so that the light vanishes there
+		static float calcInfluenceRadius(const TRPointLight &light);
+		static float calcInfluenceWindow(float distance, float radius)
+		{
+			if (radius < 0.0f)
+				return 1.0f;
+			if (radius == 0.0f)
+				return 0.0f;
+			float x = distance / radius;
+			x = glm::clamp(1.0f - x * x * x * x, 0.0f, 1.0f);
+			return x * x;
+		}
+
+	private:
+		int m_width, m_height;
+		int m_num_tiles_x, m_num_tiles_y;
+		std::vector<std::vector<unsigned int>> m_tile_lights;
+		std::vector<float> m_light_radius;
+		std::vector<glm::vec2> m_tile_depth_range;  // NDC depth range of each tile
+	};
+}
+
+#endif
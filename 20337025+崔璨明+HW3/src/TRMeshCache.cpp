@@ -0,0 +1,287 @@
+#include "TRMeshCache.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "TRDrawableMesh.h"
+
+namespace TinyRenderer
+{
+	//----------------------------------------------TRMappedFile----------------------------------------------
+
+	TRMappedFile::TRMappedFile(const std::string &filepath)
+	{
+#ifdef _WIN32
+		m_file = CreateFileA(filepath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_file == INVALID_HANDLE_VALUE)
+			return;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+			return;
+		m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (m_mapping == nullptr)
+			return;
+		m_data = static_cast<const unsigned char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+		m_size = (m_data != nullptr) ? static_cast<size_t>(size.QuadPart) : 0;
+#else
+		int fd = open(filepath.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+			void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data != MAP_FAILED)
+			{
+				m_data = static_cast<const unsigned char*>(data);
+				m_size = st.st_size;
+			}
+		}
+		//Note: the mapping stays valid after closing the descriptor
+		close(fd);
+#endif
+	}
+
+	TRMappedFile::~TRMappedFile()
+	{
+#ifdef _WIN32
+		if (m_data != nullptr)
+			UnmapViewOfFile(m_data);
+		if (m_mapping != nullptr)
+			CloseHandle(m_mapping);
+		if (m_file != INVALID_HANDLE_VALUE)
+			CloseHandle(m_file);
+#else
+		if (m_data != nullptr)
+			munmap(const_cast<unsigned char*>(m_data), m_size);
+#endif
+	}
+
+	//----------------------------------------------TRMeshCache----------------------------------------------
+
+	static_assert(std::is_trivially_copyable<TRMeshFace>::value, "TRMeshFace is stored as raw bytes");
+	static_assert(std::is_trivially_copyable<TRMeshVertex>::value, "TRMeshVertex is stored as raw bytes");
+	static_assert(std::is_trivially_copyable<TRFaceTangent>::value, "TRFaceTangent is stored as raw bytes");
+	static_assert(std::is_trivially_copyable<TRMaterial>::value, "TRMaterial is stored as raw bytes");
+
+	TRMeshCache::FileStamp TRMeshCache::getFileStamp(const std::string &filepath)
+	{
+		FileStamp stamp;
+		struct stat st;
+		if (stat(filepath.c_str(), &st) == 0)
+		{
+			stamp.size = st.st_size;
+			stamp.mtime = st.st_mtime;
+		}
+		return stamp;
+	}
+
+	bool TRMeshCache::Reader::read(void *dst, size_t bytes)
+	{
+		if (static_cast<size_t>(end - cur) < bytes)
+			return false;
+		std::memcpy(dst, cur, bytes);
+		cur += bytes;
+		return true;
+	}
+
+	bool TRMeshCache::Reader::readString(std::string &str)
+	{
+		unsigned int length;
+		if (!read(&length, sizeof(length)) || static_cast<size_t>(end - cur) < length)
+			return false;
+		str.assign(reinterpret_cast<const char*>(cur), length);
+		cur += length;
+		return true;
+	}
+
+	void TRMeshCache::writeString(std::ofstream &out, const std::string &str)
+	{
+		unsigned int length = static_cast<unsigned int>(str.size());
+		out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+		out.write(str.data(), length);
+	}
+
+	bool TRMeshCache::load(
+		const std::string &filename,
+		bool reorderFaces,
+		TRDrawableMesh &mesh,
+		std::vector<std::string> &texNames)
+	{
+		TRMappedFile file(getCachePath(filename));
+		if (!file.isOpen())
+			return false;
+
+		Reader reader = { file.data(), file.data() + file.size() };
+		Header header;
+		if (!reader.read(&header, sizeof(header)))
+			return false;
+
+		//Validation
+		{
+			FileStamp stamp = getFileStamp(filename);
+			if (std::memcmp(header.magic, "TRMESH", 7) != 0
+				|| header.version != m_version
+				|| header.face_size != sizeof(TRMeshFace)
+				|| header.vertex_size != sizeof(TRMeshVertex)
+				|| header.tangent_size != sizeof(TRFaceTangent)
+				|| header.material_size != sizeof(TRMaterial)
+				|| header.reorder_faces != (reorderFaces ? 1u : 0u)
+				|| header.source_size != stamp.size
+				|| header.source_mtime != stamp.mtime)
+				return false;
+		}
+
+		auto &attrib = mesh.m_vertices_attrib;
+		if (!reader.readArray(attrib.vpositions, header.num_positions)
+			|| !reader.readArray(attrib.vcolors, header.num_colors)
+			|| !reader.readArray(attrib.vtexcoords, header.num_texcoords)
+			|| !reader.readArray(attrib.vnormals, header.num_normals)
+			|| !reader.readArray(mesh.m_mesh_vertices, header.num_mesh_vertices)
+			|| !reader.readArray(mesh.m_mesh_faces, header.num_faces)
+			|| !reader.readArray(mesh.m_face_tangents, header.num_faces)
+			|| !reader.readArray(mesh.m_materials, header.num_materials))
+		{
+			mesh.clear();
+			return false;
+		}
+
+		texNames.resize(header.num_textures);
+		for (auto &name : texNames)
+		{
+			if (!reader.readString(name))
+			{
+				mesh.clear();
+				return false;
+			}
+		}
+
+		//The mtl files
+		size_t pos = filename.find_last_of("/\\");
+		std::string baseDir = (pos != std::string::npos) ? filename.substr(0, pos + 1) : "./";
+		for (unsigned int i = 0; i < header.num_dependencies; ++i)
+		{
+			std::string name;
+			FileStamp cached;
+			if (!reader.readString(name)
+				|| !reader.read(&cached.size, sizeof(cached.size))
+				|| !reader.read(&cached.mtime, sizeof(cached.mtime)))
+			{
+				mesh.clear();
+				return false;
+			}
+			FileStamp stamp = getFileStamp(baseDir + name);
+			if (stamp.size != cached.size || stamp.mtime != cached.mtime)
+			{
+				mesh.clear();
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	bool TRMeshCache::save(
+		const std::string &filename,
+		bool reorderFaces,
+		const TRDrawableMesh &mesh,
+		const std::vector<std::string> &texNames,
+		const std::vector<std::string> &dependencies)
+	{
+		//Note: written to a unique temporary file and then renamed over the cache, so that the other loaders
+		//      never map a truncated or half written one
+		static std::atomic<unsigned int> counter(0);
+		const std::string cachepath = getCachePath(filename);
+#ifdef _WIN32
+		const unsigned long pid = GetCurrentProcessId();
+#else
+		const unsigned long pid = static_cast<unsigned long>(getpid());
+#endif
+		const std::string temppath = cachepath + ".tmp" + std::to_string(pid) + "_" + std::to_string(counter++);
+		std::ofstream out(temppath, std::ios::binary | std::ios::trunc);
+		if (!out)
+		{
+			std::cerr << "Failed to write the mesh cache " << cachepath << std::endl;
+			return false;
+		}
+
+		const auto &attrib = mesh.m_vertices_attrib;
+		FileStamp stamp = getFileStamp(filename);
+		Header header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, "TRMESH", 7);
+		header.version = m_version;
+		header.face_size = sizeof(TRMeshFace);
+		header.vertex_size = sizeof(TRMeshVertex);
+		header.tangent_size = sizeof(TRFaceTangent);
+		header.material_size = sizeof(TRMaterial);
+		header.reorder_faces = reorderFaces ? 1u : 0u;
+		header.source_size = stamp.size;
+		header.source_mtime = stamp.mtime;
+		header.num_positions = static_cast<unsigned int>(attrib.vpositions.size());
+		header.num_colors = static_cast<unsigned int>(attrib.vcolors.size());
+		header.num_texcoords = static_cast<unsigned int>(attrib.vtexcoords.size());
+		header.num_normals = static_cast<unsigned int>(attrib.vnormals.size());
+		header.num_mesh_vertices = static_cast<unsigned int>(mesh.m_mesh_vertices.size());
+		header.num_faces = static_cast<unsigned int>(mesh.m_mesh_faces.size());
+		header.num_materials = static_cast<unsigned int>(mesh.m_materials.size());
+		header.num_textures = static_cast<unsigned int>(texNames.size());
+		header.num_dependencies = static_cast<unsigned int>(dependencies.size());
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+		writeArray(out, attrib.vpositions);
+		writeArray(out, attrib.vcolors);
+		writeArray(out, attrib.vtexcoords);
+		writeArray(out, attrib.vnormals);
+		writeArray(out, mesh.m_mesh_vertices);
+		writeArray(out, mesh.m_mesh_faces);
+		writeArray(out, mesh.m_face_tangents);
+		writeArray(out, mesh.m_materials);
+		for (const auto &name : texNames)
+		{
+			writeString(out, name);
+		}
+
+		size_t pos = filename.find_last_of("/\\");
+		std::string baseDir = (pos != std::string::npos) ? filename.substr(0, pos + 1) : "./";
+		for (const auto &name : dependencies)
+		{
+			FileStamp dep = getFileStamp(baseDir + name);
+			writeString(out, name);
+			out.write(reinterpret_cast<const char*>(&dep.size), sizeof(dep.size));
+			out.write(reinterpret_cast<const char*>(&dep.mtime), sizeof(dep.mtime));
+		}
+
+		out.close();
+		if (!out)
+		{
+			std::cerr << "Failed to write the mesh cache " << cachepath << std::endl;
+			std::remove(temppath.c_str());
+			return false;
+		}
+
+#ifdef _WIN32
+		const bool renamed = MoveFileExA(temppath.c_str(), cachepath.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		const bool renamed = std::rename(temppath.c_str(), cachepath.c_str()) == 0;
+#endif
+		if (!renamed)
+		{
+			std::cerr << "Failed to replace the mesh cache " << cachepath << std::endl;
+			std::remove(temppath.c_str());
+			return false;
+		}
+		return true;
+	}
+}
\ No newline at end of file
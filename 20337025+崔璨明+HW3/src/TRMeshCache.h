@@ -0,0 +1,120 @@
+#ifndef TRMESHCACHE_H
+#define TRMESHCACHE_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+namespace TinyRenderer
+{
+	class TRDrawableMesh;
+
+	//Read-only memory mapping of a whole file
+	class TRMappedFile final
+	{
+	public:
+		TRMappedFile(const std::string &filepath);
+		~TRMappedFile();
+
+		TRMappedFile(const TRMappedFile &) = delete;
+		TRMappedFile &operator=(const TRMappedFile &) = delete;
+
+		bool isOpen() const { return m_data != nullptr; }
+		const unsigned char *data() const { return m_data; }
+		size_t size() const { return m_size; }
+
+	private:
+		const unsigned char *m_data = nullptr;
+		size_t m_size = 0;
+#ifdef _WIN32
+		HANDLE m_file = INVALID_HANDLE_VALUE;
+		HANDLE m_mapping = nullptr;
+#endif
+	};
+
+	//Binary cache of the parsed meshes, written next to the obj file as <filename>.trmesh
+	//Note: the arrays are stored in the in-memory layout of TRDrawableMesh, hence loading is a plain
+	//      copy out of the mapped file. The cache is rebuilt if the size or modification time of the
+	//      obj file or one of its mtl files changes, or if the layout of the mesh structures changes.
+	class TRMeshCache final
+	{
+	public:
+
+		static std::string getCachePath(const std::string &filename) { return filename + ".trmesh"; }
+
+		//Note: the texture ids of the materials index into texNames, i.e. the textures are not uploaded yet
+		static bool load(
+			const std::string &filename,
+			bool reorderFaces,
+			TRDrawableMesh &mesh,
+			std::vector<std::string> &texNames);
+
+		//Note: dependencies are the mtl files of the obj file, relative to its directory
+		static bool save(
+			const std::string &filename,
+			bool reorderFaces,
+			const TRDrawableMesh &mesh,
+			const std::vector<std::string> &texNames,
+			const std::vector<std::string> &dependencies);
+
+	private:
+
+		//Size and modification time of a file, both -1 if it does not exist
+		struct FileStamp
+		{
+			long long size = -1;
+			long long mtime = -1;
+		};
+		static FileStamp getFileStamp(const std::string &filepath);
+
+		//Sequential reading of the mapped file with bounds checking
+		//Note: a truncated file is treated as a stale one
+		struct Reader
+		{
+			const unsigned char *cur, *end;
+
+			bool read(void *dst, size_t bytes);
+			bool readString(std::string &str);
+			template<typename T>
+			bool readArray(std::vector<T> &vec, unsigned int count)
+			{
+				if (static_cast<size_t>(end - cur) / sizeof(T) < count)
+					return false;
+				vec.resize(count);
+				return read(vec.data(), count * sizeof(T));
+			}
+		};
+
+		static void writeString(std::ofstream &out, const std::string &str);
+		template<typename T>
+		static void writeArray(std::ofstream &out, const std::vector<T> &vec)
+		{
+			out.write(reinterpret_cast<const char*>(vec.data()), vec.size() * sizeof(T));
+		}
+
+		struct Header
+		{
+			char magic[8];
+			unsigned int version;
+			unsigned int face_size;   // Layout check of TRMeshFace
+			unsigned int vertex_size; // Layout check of TRMeshVertex
+			unsigned int tangent_size;  // Layout check of TRFaceTangent
+			unsigned int material_size; // Layout check of TRMaterial
+			unsigned int reorder_faces;
+			long long source_size, source_mtime;
+			unsigned int num_positions, num_colors, num_texcoords, num_normals;
+			unsigned int num_mesh_vertices, num_faces, num_materials;
+			unsigned int num_textures, num_dependencies;
+		};
+		static constexpr unsigned int m_version = 3;
+	};
+}
+
+#endif
\ No newline at end of file
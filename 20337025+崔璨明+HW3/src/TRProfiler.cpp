@@ -0,0 +1,266 @@
+#include "TRProfiler.h"
+
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+
+namespace TinyRenderer
+{
+	constexpr size_t TRProfiler::m_max_frames;
+	constexpr size_t TRProfiler::m_max_events;
+
+	//----------------------------------------------ScopedTimer----------------------------------------------
+
+	TRProfiler::ScopedTimer::ScopedTimer(TRProfiler *profiler, Stage stage, const char *name)
+		: m_profiler(profiler), m_stage(stage), m_thread(0), m_name(name != nullptr ? name : getStageName(stage))
+	{
+		m_begin = m_profiler->isRecording() ? now() : 0;
+	}
+
+	TRProfiler::ScopedTimer::ScopedTimer(TRProfiler *profiler, const char *name, int thread)
+		: m_profiler(profiler), m_stage(TR_STAGE_COUNT), m_thread(thread), m_name(name)
+	{
+		m_begin = m_profiler->isRecording() ? now() : 0;
+	}
+
+	TRProfiler::ScopedTimer::~ScopedTimer()
+	{
+		//Note: a frame begun or ended inside the scope is left alone
+		if (m_begin == 0 || !m_profiler->isRecording())
+			return;
+		Ticks end = now();
+		if (m_stage != TR_STAGE_COUNT)
+			m_profiler->addStageTime(static_cast<Stage>(m_stage), end - m_begin);
+		m_profiler->recordEvent(m_name, m_thread, m_begin, end);
+	}
+
+	//----------------------------------------------LapTimer----------------------------------------------
+
+	TRProfiler::LapTimer::LapTimer(TRProfiler *profiler)
+		: m_profiler(profiler), m_active(profiler->isRecording()), m_last(0)
+	{
+		std::fill(m_stages, m_stages + TR_STAGE_COUNT, 0);
+		if (m_active)
+			m_last = now();
+	}
+
+	TRProfiler::LapTimer::~LapTimer()
+	{
+		if (!m_active || !m_profiler->isRecording())
+			return;
+		for (int s = 0; s < TR_STAGE_COUNT; ++s)
+		{
+			m_profiler->addStageTime(static_cast<Stage>(s), m_stages[s]);
+		}
+	}
+
+	//----------------------------------------------TRProfiler----------------------------------------------
+
+	TRProfiler::TRProfiler()
+	{
+		m_origin = now();
+		m_events.resize(1);
+	}
+
+	void TRProfiler::setThreadNum(int num)
+	{
+		m_events.resize(std::max(num, 1));
+	}
+
+	void TRProfiler::beginFrame()
+	{
+		beginFrame(m_next_index);
+	}
+
+	void TRProfiler::beginFrame(unsigned int index)
+	{
+		if (!m_enabled)
+			return;
+		if (m_in_frame)
+			endFrame();
+
+		m_in_frame = true;
+		m_next_index = index + 1;
+		m_frame.index = index;
+		std::fill(m_frame.stages, m_frame.stages + TR_STAGE_COUNT, 0);
+		std::fill(m_frame.counters, m_frame.counters + TR_COUNTER_COUNT, 0);
+		m_frame.begin = now();
+		m_frame.end = m_frame.begin;
+	}
+
+	void TRProfiler::endFrame()
+	{
+		if (!m_in_frame)
+			return;
+		m_in_frame = false;
+		m_frame.end = now();
+		std::lock_guard<std::mutex> lock(m_frames_mutex);
+		m_frames.push_back(m_frame);
+		if (m_frames.size() > m_max_frames)
+			m_frames.pop_front();
+	}
+
+	void TRProfiler::addPresentTime(unsigned int index, Ticks time)
+	{
+		//Note: the frames are presented in order, the one looked for is among the latest
+		std::lock_guard<std::mutex> lock(m_frames_mutex);
+		for (auto it = m_frames.rbegin(); it != m_frames.rend(); ++it)
+		{
+			if (it->index == index)
+			{
+				it->stages[TR_STAGE_PRESENT] += time;
+				return;
+			}
+		}
+	}
+
+	void TRProfiler::addStageTime(Stage stage, Ticks time)
+	{
+		if (m_in_frame)
+			m_frame.stages[stage] += time;
+	}
+
+	void TRProfiler::addCounter(Counter counter, std::uint64_t value)
+	{
+		if (m_in_frame)
+			m_frame.counters[counter] += value;
+	}
+
+	void TRProfiler::recordEvent(const char *name, int thread, Ticks begin, Ticks end)
+	{
+		if (thread < 0 || thread >= static_cast<int>(m_events.size()))
+			return;
+		auto &events = m_events[thread];
+		Event event = { name, begin, end };
+		events.push_back(event);
+		if (events.size() > m_max_events)
+			events.pop_front();
+	}
+
+	const char *TRProfiler::getStageName(Stage stage)
+	{
+		static const char *names[TR_STAGE_COUNT] = { "vertex", "clip", "setup", "raster", "depth", "fragment", "present" };
+		return names[stage];
+	}
+
+	const char *TRProfiler::getCounterName(Counter counter)
+	{
+		static const char *names[TR_COUNTER_COUNT] = { "shaded_vertices", "triangles", "fragments_generated",
+			"fragments_passed", "fragments_shaded", "texture_samples", "allocated_bytes", "culled_meshes", "culled_chunks" };
+		return names[counter];
+	}
+
+	bool TRProfiler::exportChromeTrace(const std::string &filename) const
+	{
+		std::ofstream out(filename, std::ios::trunc);
+		if (!out)
+		{
+			std::cerr << "Failed to write the trace " << filename << std::endl;
+			return false;
+		}
+
+		//Timestamps in microseconds since the creation of the profiler
+		auto toMicroseconds = [this](Ticks time) { return (time - m_origin) * 1e-3; };
+		out << std::fixed << std::setprecision(3);
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+		out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"render\"}}";
+		for (size_t t = 1; t < m_events.size(); ++t)
+		{
+			out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t
+				<< ",\"args\":{\"name\":\"worker " << t << "\"}}";
+		}
+
+		for (const auto &frame : m_frames)
+		{
+			out << ",\n{\"name\":\"frame\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":0,\"ts\":"
+				<< toMicroseconds(frame.begin) << ",\"dur\":" << (frame.end - frame.begin) * 1e-3 << "}";
+
+			//Note: the stages share one track, stacked in the viewer
+			out << ",\n{\"name\":\"stage time (ms)\",\"ph\":\"C\",\"pid\":1,\"ts\":" << toMicroseconds(frame.begin) << ",\"args\":{";
+			for (int s = 0; s < TR_STAGE_COUNT; ++s)
+			{
+				out << (s > 0 ? "," : "") << "\"" << getStageName(static_cast<Stage>(s)) << "\":" << frame.stages[s] * 1e-6;
+			}
+			out << "}}";
+			for (int c = 0; c < TR_COUNTER_COUNT; ++c)
+			{
+				out << ",\n{\"name\":\"" << getCounterName(static_cast<Counter>(c)) << "\",\"ph\":\"C\",\"pid\":1,\"ts\":"
+					<< toMicroseconds(frame.begin) << ",\"args\":{\"value\":" << frame.counters[c] << "}}";
+			}
+		}
+
+		for (size_t t = 0; t < m_events.size(); ++t)
+		{
+			for (const auto &event : m_events[t])
+			{
+				out << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":1,\"tid\":" << t
+					<< ",\"ts\":" << toMicroseconds(event.begin) << ",\"dur\":" << (event.end - event.begin) * 1e-3 << "}";
+			}
+		}
+		out << "\n]}\n";
+		return static_cast<bool>(out);
+	}
+
+	double TRProfiler::percentile(const std::vector<double> &sorted, double p)
+	{
+		if (sorted.empty())
+			return 0.0;
+		size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+		return sorted[std::min(std::max(rank, static_cast<size_t>(1)), sorted.size()) - 1];
+	}
+
+	bool TRProfiler::exportFrameTimeCSV(const std::string &filename) const
+	{
+		std::ofstream out(filename, std::ios::trunc);
+		if (!out)
+		{
+			std::cerr << "Failed to write the frame times " << filename << std::endl;
+			return false;
+		}
+
+		out << "metric,unit,frames,mean,p50,p90,p95,p99,max\n";
+		std::vector<double> values(m_frames.size());
+		auto writeRow = [&](const char *metric, const char *unit)
+		{
+			std::sort(values.begin(), values.end());
+			double sum = 0.0;
+			for (auto value : values)
+			{
+				sum += value;
+			}
+			out << metric << "," << unit << "," << values.size() << ","
+				<< (values.empty() ? 0.0 : sum / values.size()) << ","
+				<< percentile(values, 0.50) << "," << percentile(values, 0.90) << ","
+				<< percentile(values, 0.95) << "," << percentile(values, 0.99) << ","
+				<< (values.empty() ? 0.0 : values.back()) << "\n";
+		};
+
+		out << std::fixed << std::setprecision(4);
+		for (size_t f = 0; f < m_frames.size(); ++f)
+		{
+			values[f] = (m_frames[f].end - m_frames[f].begin) * 1e-6;
+		}
+		writeRow("frame", "ms");
+		for (int s = 0; s < TR_STAGE_COUNT; ++s)
+		{
+			for (size_t f = 0; f < m_frames.size(); ++f)
+			{
+				values[f] = m_frames[f].stages[s] * 1e-6;
+			}
+			writeRow(getStageName(static_cast<Stage>(s)), "ms");
+		}
+
+		out << std::setprecision(1);
+		for (int c = 0; c < TR_COUNTER_COUNT; ++c)
+		{
+			for (size_t f = 0; f < m_frames.size(); ++f)
+			{
+				values[f] = static_cast<double>(m_frames[f].counters[c]);
+			}
+			writeRow(getCounterName(static_cast<Counter>(c)), "count");
+		}
+		return static_cast<bool>(out);
+	}
+}
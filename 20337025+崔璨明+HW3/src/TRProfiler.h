@@ -0,0 +1,182 @@
+#ifndef TRPROFILER_H
+#define TRPROFILER_H
+
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+
+namespace TinyRenderer
+{
+	//Per-frame timings of the pipeline stages and counters of the work done by the renderer
+	//Note: cheap enough to stay enabled, a stage costs a couple of clock reads per scope or per triangle.
+	//      Only the frames between beginFrame() and endFrame() are recorded, the latest m_max_frames of them
+	//      are kept for the export.
+	class TRProfiler final
+	{
+	public:
+		typedef std::shared_ptr<TRProfiler> ptr;
+
+		enum Stage
+		{
+			TR_STAGE_VERTEX = 0, // Vertex shading
+			TR_STAGE_CLIP,       // Scene culling, back face culling, clipping & perspective division
+			TR_STAGE_SETUP,      // Viewport transform, triangle setup & binning
+			TR_STAGE_RASTER,     // Triangle traversal, with the depth test & the shaders of the fragments fused in
+			TR_STAGE_DEPTH,      // Clearing of the depth buffer & the hierarchical z-buffer (with the color buffer)
+			TR_STAGE_FRAGMENT,   // Light culling & the lighting pass of the deferred shading
+			TR_STAGE_PRESENT,    // Copy of the color buffer to the screen, given by addPresentTime()
+			TR_STAGE_COUNT
+		};
+
+		enum Counter
+		{
+			TR_COUNTER_SHADED_VERTICES = 0,
+			TR_COUNTER_TRIANGLES,           // Triangles assembled for the rasterization, after culling & clipping
+			TR_COUNTER_FRAGMENTS_GENERATED, // Covered pixels of the rasterized triangles
+			TR_COUNTER_FRAGMENTS_PASSED,    // Survivors of the depth test
+			TR_COUNTER_FRAGMENTS_SHADED,    // Invocations of the fragment or the lighting shader
+			TR_COUNTER_TEXTURE_SAMPLES,
+			TR_COUNTER_ALLOCATED_BYTES,
+			TR_COUNTER_CULLED_MESHES,       // Meshes outside the view frustum
+			TR_COUNTER_CULLED_CHUNKS,       // Chunks outside the view frustum, of the meshes partially inside
+			TR_COUNTER_COUNT
+		};
+
+		//Nanoseconds of a steady clock
+		typedef std::int64_t Ticks;
+		static Ticks now()
+		{
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		struct Frame
+		{
+			unsigned int index;
+			Ticks begin, end;
+			Ticks stages[TR_STAGE_COUNT];
+			std::uint64_t counters[TR_COUNTER_COUNT];
+		};
+
+		//Time of a scope, recorded as an event of the trace
+		//Note: the stage constructor adds the time to the stage of the frame and must be used by the rendering
+		//      thread, the other one records the event only and could be used by the workers of a thread pool.
+		//      The name must be a string literal.
+		class ScopedTimer final
+		{
+		public:
+			ScopedTimer(TRProfiler *profiler, Stage stage, const char *name = nullptr);
+			ScopedTimer(TRProfiler *profiler, const char *name, int thread);
+			~ScopedTimer();
+
+			ScopedTimer(const ScopedTimer&) = delete;
+			ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+		private:
+			TRProfiler *m_profiler;
+			int m_stage;
+			int m_thread;
+			const char *m_name;
+			Ticks m_begin;
+		};
+
+		//Time of the stages interleaved in a loop, each lap is added to the stage it closes
+		//Note: one clock read per lap and no event, the times are added to the frame on destruction
+		class LapTimer final
+		{
+		public:
+			LapTimer(TRProfiler *profiler);
+			~LapTimer();
+
+			void lap(Stage stage)
+			{
+				if (!m_active)
+					return;
+				Ticks time = now();
+				m_stages[stage] += time - m_last;
+				m_last = time;
+			}
+
+			LapTimer(const LapTimer&) = delete;
+			LapTimer& operator=(const LapTimer&) = delete;
+
+		private:
+			TRProfiler *m_profiler;
+			bool m_active;
+			Ticks m_last;
+			Ticks m_stages[TR_STAGE_COUNT];
+		};
+
+		TRProfiler();
+		~TRProfiler() = default;
+
+		TRProfiler(const TRProfiler&) = delete;
+		TRProfiler& operator=(const TRProfiler&) = delete;
+
+		void setEnabled(bool enable) { m_enabled = enable; }
+		bool isEnabled() const { return m_enabled; }
+		bool isRecording() const { return m_enabled && m_in_frame; }
+
+		//Threads recording events, thread 0 is the rendering thread
+		//Note: must not be called inside a frame
+		void setThreadNum(int num);
+
+		//The frames are numbered one after another, unless the index is given
+		void beginFrame();
+		void beginFrame(unsigned int index);
+		void endFrame();
+
+		//Must be called by the rendering thread inside a frame
+		void addStageTime(Stage stage, Ticks time);
+		void addCounter(Counter counter, std::uint64_t value);
+
+		//Time of the presentation of the recorded frame index, added once the frame is shown
+		//Note: thread safe, for the presenting thread of a renderer running on a thread of its own. Ignored if
+		//      the frame is no longer recorded.
+		void addPresentTime(unsigned int index, Ticks time);
+
+		//Must not be called while frames are recorded or presented by another thread
+		const std::deque<Frame> &getFrames() const { return m_frames; }
+		static const char *getStageName(Stage stage);
+		static const char *getCounterName(Counter counter);
+
+		//Trace event format of chrome://tracing and Perfetto: the scopes as complete events per thread,
+		//the stage times and the counters of each frame as counter events
+		bool exportChromeTrace(const std::string &filename) const;
+
+		//Mean, percentiles and maximum over the recorded frames of the frame time, the stage times and the counters
+		bool exportFrameTimeCSV(const std::string &filename) const;
+
+		//Nearest-rank percentile of the sorted values, p in [0, 1]
+		static double percentile(const std::vector<double> &sorted, double p);
+
+	private:
+		struct Event
+		{
+			const char *name;
+			Ticks begin, end;
+		};
+
+		void recordEvent(const char *name, int thread, Ticks begin, Ticks end);
+
+	private:
+		static constexpr size_t m_max_frames = 1 << 14;
+		static constexpr size_t m_max_events = 1 << 16;  // Per thread
+
+		bool m_enabled = true;
+		bool m_in_frame = false;
+		Ticks m_origin;
+		unsigned int m_next_index = 0;
+
+		Frame m_frame;
+		std::deque<Frame> m_frames;
+		std::mutex m_frames_mutex;  // m_frames is also written by addPresentTime()
+		std::vector<std::deque<Event>> m_events; // Per thread, only written by the thread
+	};
+}
+
+#endif
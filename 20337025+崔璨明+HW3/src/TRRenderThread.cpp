@@ -0,0 +1,194 @@
+#include "TRRenderThread.h"
+
+#include <algorithm>
+
+#include "TRAssetLoader.h"
+
+namespace TinyRenderer
+{
+	//----------------------------------------------Command----------------------------------------------
+
+	TRRenderThread::Command TRRenderThread::Command::view(const glm::mat4 &view, const glm::vec3 &viewer)
+	{
+		Command command = {};
+		command.type = TR_COMMAND_VIEW;
+		command.matrix = view;
+		command.position = viewer;
+		return command;
+	}
+
+	TRRenderThread::Command TRRenderThread::Command::pointLight(int index, const glm::vec3 &position)
+	{
+		Command command = {};
+		command.type = TR_COMMAND_POINT_LIGHT;
+		command.index = index;
+		command.position = position;
+		return command;
+	}
+
+	TRRenderThread::Command TRRenderThread::Command::modelMatrix(TRDrawableMesh *mesh, const glm::mat4 &model)
+	{
+		Command command = {};
+		command.type = TR_COMMAND_MODEL_MATRIX;
+		command.mesh = mesh;
+		command.matrix = model;
+		return command;
+	}
+
+	TRRenderThread::Command TRRenderThread::Command::streamAssets(TRAssetLoader *loader)
+	{
+		Command command = {};
+		command.type = TR_COMMAND_STREAM_ASSETS;
+		command.loader = loader;
+		return command;
+	}
+
+	//----------------------------------------------TRRenderThread----------------------------------------------
+
+	TRRenderThread::TRRenderThread(TRRenderer::ptr renderer, int width, int height, const TRPixelFormat &format,
+		int num_frames, const glm::vec4 &clear_color)
+		: m_renderer(renderer), m_width(width), m_height(height), m_format(format), m_clear_color(clear_color),
+		m_commands(1024)
+	{
+		//Note: two frames at least, one presented while the other is rendered
+		m_frames.resize(std::max(num_frames, 2));
+		m_states.resize(m_frames.size(), TR_FRAME_FREE);
+		for (auto &frame : m_frames)
+		{
+			frame.pixels.resize(static_cast<size_t>(width) * height * 4);
+		}
+		m_thread = std::thread(&TRRenderThread::renderLoop, this);
+	}
+
+	TRRenderThread::~TRRenderThread()
+	{
+		//Note: the frame being rendered is finished first
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_state_cond.notify_all();
+		m_thread.join();
+	}
+
+	void TRRenderThread::submit(const Command &command)
+	{
+		if (m_commands.push(command))
+			return;
+
+		//Note: the render thread drains the queue as soon as it sees the flag, even without a free frame
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_submit_waiting = true;
+		m_state_cond.notify_all();
+		m_state_cond.wait(lock, [&]() { return m_commands.push(command); });
+	}
+
+	void TRRenderThread::applyCommands_aux()
+	{
+		Command command;
+		while (m_commands.pop(command))
+		{
+			switch (command.type)
+			{
+				case Command::TR_COMMAND_VIEW:
+					m_renderer->setViewMatrix(command.matrix);
+					m_renderer->setViewerPos(command.position);
+					break;
+				case Command::TR_COMMAND_POINT_LIGHT:
+					m_renderer->getPointLight(command.index).lightPos = command.position;
+					break;
+				case Command::TR_COMMAND_MODEL_MATRIX:
+					command.mesh->setModelMatrix(command.matrix);
+					break;
+				case Command::TR_COMMAND_STREAM_ASSETS:
+					command.loader->update();
+					break;
+			}
+		}
+
+		//Note: the flag is cleared once the queue has room, under the lock the waiting submit() checks
+		bool notify;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			notify = m_submit_waiting;
+			m_submit_waiting = false;
+		}
+		if (notify)
+			m_state_cond.notify_all();
+	}
+
+	const TRRenderThread::Frame &TRRenderThread::acquireFrame()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_state_cond.wait(lock, [this]() { return m_states[m_next_present] == TR_FRAME_READY; });
+		m_states[m_next_present] = TR_FRAME_PRESENTING;
+		return m_frames[m_next_present];
+	}
+
+	void TRRenderThread::releaseFrame(TRProfiler::Ticks present_time)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_states[m_next_present] != TR_FRAME_PRESENTING)
+				return;
+			Frame &frame = m_frames[m_next_present];
+			frame.presentTime = present_time;
+			if (present_time > 0)
+				m_renderer->getProfiler()->addPresentTime(frame.index, present_time);
+			m_states[m_next_present] = TR_FRAME_FREE;
+			m_next_present = (m_next_present + 1) % m_frames.size();
+		}
+		m_state_cond.notify_all();
+	}
+
+	void TRRenderThread::renderLoop()
+	{
+		TRProfiler::ptr profiler = m_renderer->getProfiler();
+		unsigned int index = 0;
+		while (true)
+		{
+			//Wait for the next frame of the ring to be presented
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_state_cond.wait(lock, [this]()
+				{
+					return m_stop || m_submit_waiting || m_states[m_next_render] == TR_FRAME_FREE;
+				});
+				if (m_stop)
+					return;
+				if (m_states[m_next_render] != TR_FRAME_FREE)
+				{
+					//The queue is full while every frame is ready or presented
+					lock.unlock();
+					applyCommands_aux();
+					continue;
+				}
+				m_states[m_next_render] = TR_FRAME_RENDERING;
+			}
+			Frame &frame = m_frames[m_next_render];
+
+			//The updates submitted so far
+			applyCommands_aux();
+
+			profiler->beginFrame(index);
+			m_renderer->setColorTarget(frame.pixels.data(), m_width * 4, m_format);
+			m_renderer->clearColor(m_clear_color);
+			m_renderer->renderAllDrawableMeshes();
+			profiler->endFrame();
+
+			frame.index = index++;
+			frame.numClipedFaces = m_renderer->getNumberOfClipFaces();
+			frame.numCulledFaces = m_renderer->getNumberOfCullFaces();
+			frame.numCulledMeshes = m_renderer->getNumberOfCulledMeshes();
+			frame.numCulledChunks = m_renderer->getNumberOfCulledChunks();
+			frame.numShadedVertices = m_renderer->getNumberOfShadedVertices();
+			frame.presentTime = 0;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_states[m_next_render] = TR_FRAME_READY;
+				m_next_render = (m_next_render + 1) % m_frames.size();
+			}
+			m_state_cond.notify_all();
+		}
+	}
+}
@@ -0,0 +1,169 @@
+#ifndef TRRENDERTHREAD_H
+#define TRRENDERTHREAD_H
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+#include "TRRenderer.h"
+
+namespace TinyRenderer
+{
+	//Bounded queue of one producer thread and one consumer thread, without any lock
+	//Note: the capacity is rounded up to a power of two
+	template<typename T>
+	class TRSpscQueue final
+	{
+	public:
+		explicit TRSpscQueue(size_t capacity)
+			: m_head(0), m_tail(0)
+		{
+			size_t size = 1;
+			while (size < capacity)
+				size <<= 1;
+			m_items.resize(size);
+			m_mask = size - 1;
+		}
+
+		TRSpscQueue(const TRSpscQueue&) = delete;
+		TRSpscQueue& operator=(const TRSpscQueue&) = delete;
+
+		//Producer only, return false if the queue is full
+		bool push(const T &item)
+		{
+			const size_t tail = m_tail.load(std::memory_order_relaxed);
+			if (tail - m_head.load(std::memory_order_acquire) == m_items.size())
+				return false;
+			m_items[tail & m_mask] = item;
+			m_tail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		//Consumer only, return false if the queue is empty
+		bool pop(T &item)
+		{
+			const size_t head = m_head.load(std::memory_order_relaxed);
+			if (head == m_tail.load(std::memory_order_acquire))
+				return false;
+			item = std::move(m_items[head & m_mask]);
+			m_head.store(head + 1, std::memory_order_release);
+			return true;
+		}
+
+	private:
+		std::vector<T> m_items;
+		size_t m_mask;
+		std::atomic<size_t> m_head; // Next item to pop
+		std::atomic<size_t> m_tail; // Next item to push
+	};
+
+	class TRAssetLoader;
+
+	//Renderer driven by a thread of its own, which renders into a ring of frames ahead of the presentation
+	//Note: while a frame is presented, the next ones are rendered. The renderer, the meshes and the lights
+	//      belong to the render thread once it runs, and are only changed by the submitted commands, which
+	//      are applied in order right before a frame is rendered.
+	class TRRenderThread final
+	{
+	public:
+		typedef std::shared_ptr<TRRenderThread> ptr;
+
+		//A change of the scene
+		//Note: plain data copied into the preallocated queue, so submitting allocates nothing. The meshes
+		//      and the asset loader pointed to must outlive the render thread.
+		struct Command
+		{
+			enum Type
+			{
+				TR_COMMAND_VIEW,         //View matrix and viewer position
+				TR_COMMAND_POINT_LIGHT,  //Position of the point light index
+				TR_COMMAND_MODEL_MATRIX, //Model matrix of mesh
+				TR_COMMAND_STREAM_ASSETS //Publish the meshes loader finished loading
+			};
+
+			Type type;
+			int index;
+			glm::vec3 position;
+			glm::mat4 matrix;
+			TRDrawableMesh *mesh;
+			TRAssetLoader *loader;
+
+			static Command view(const glm::mat4 &view, const glm::vec3 &viewer);
+			static Command pointLight(int index, const glm::vec3 &position);
+			static Command modelMatrix(TRDrawableMesh *mesh, const glm::mat4 &model);
+			static Command streamAssets(TRAssetLoader *loader);
+		};
+
+		//A rendered frame, with the statistics of its rendering
+		struct Frame
+		{
+			std::vector<unsigned char> pixels; // 32-bit pixels in the format of the ring, tightly packed rows
+			unsigned int index;
+			unsigned int numClipedFaces;
+			unsigned int numCulledFaces;
+			unsigned int numCulledMeshes;
+			unsigned int numCulledChunks;
+			unsigned int numShadedVertices;
+			TRProfiler::Ticks presentTime;     // Acquisition, upload & presentation, as given on release
+		};
+
+		//The frames are rendered in format, for presenting them without any reordering of the channels
+		TRRenderThread(TRRenderer::ptr renderer, int width, int height, const TRPixelFormat &format,
+			int num_frames = 3, const glm::vec4 &clear_color = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+		~TRRenderThread();
+
+		TRRenderThread(const TRRenderThread&) = delete;
+		TRRenderThread& operator=(const TRRenderThread&) = delete;
+
+		//Must be called by one thread only, wait if the queue is full
+		void submit(const Command &command);
+
+		//The oldest rendered frame, waiting for it if none is ready. Must be released before the next one
+		//is acquired, with the time spent presenting it since before the acquisition, which goes to the
+		//present stage of the frame in the profiler of the renderer.
+		const Frame &acquireFrame();
+		void releaseFrame(TRProfiler::Ticks present_time = 0);
+
+		int getWidth() const { return m_width; }
+		int getHeight() const { return m_height; }
+		const TRPixelFormat &getPixelFormat() const { return m_format; }
+
+	private:
+		void renderLoop();
+
+		//Apply the submitted commands in order, waking up submit() if it waits for room
+		void applyCommands_aux();
+
+	private:
+		enum FrameState
+		{
+			TR_FRAME_FREE = 0,
+			TR_FRAME_RENDERING,
+			TR_FRAME_READY,
+			TR_FRAME_PRESENTING
+		};
+
+		TRRenderer::ptr m_renderer;
+		int m_width, m_height;
+		TRPixelFormat m_format;
+		glm::vec4 m_clear_color;
+
+		//Ring of frames, rendered and presented in the same order
+		std::vector<Frame> m_frames;
+		std::vector<FrameState> m_states;
+		size_t m_next_render = 0;
+		size_t m_next_present = 0;
+		std::mutex m_mutex;
+		std::condition_variable m_state_cond;
+		bool m_stop = false;
+		bool m_submit_waiting = false;  // submit() waits for the queue to be drained
+
+		TRSpscQueue<Command> m_commands;
+		std::thread m_thread;
+	};
+}
+
+#endif
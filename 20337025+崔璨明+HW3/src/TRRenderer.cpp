@@ -6,29 +6,61 @@
 #include "TRUtils.h"
 
 #include <cmath>
+#include <algorithm>
+#include <typeinfo>
 
 namespace TinyRenderer
 {
+	constexpr int TRRenderer::m_tile_size;
+	constexpr int TRRenderer::m_max_clip_vertices;
 
 	TRRenderer::TRRenderer(int width, int height)
 		: m_backBuffer(nullptr), m_frontBuffer(nullptr)
 	{
+		m_profiler = std::make_shared<TRProfiler>();
+
 		//Double buffer to avoid flickering
 		m_backBuffer = std::make_shared<TRFrameBuffer>(width, height);
 		m_frontBuffer = std::make_shared<TRFrameBuffer>(width, height);
 
 		//Setup viewport matrix (ndc space -> screen space)
 		m_viewportMatrix = TRUtils::calcViewPortMatrix(width, height);
+
+		//Screen tiles for binned rasterization
+		//Note: the tiles of the hierarchical z-buffer must not be shared by two threads
+		static_assert(m_tile_size % TRFrameBuffer::hiz_tile_size == 0, "Tiles must be aligned to the hierarchical z-buffer");
+		static_assert(TRShadingPipeline::RasterSetup::block_size == TRFrameBuffer::hiz_tile_size,
+			"Rasterization blocks must match the tiles of the hierarchical z-buffer");
+		m_num_tiles_x = (width + m_tile_size - 1) / m_tile_size;
+		m_num_tiles_y = (height + m_tile_size - 1) / m_tile_size;
+		m_tile_bins.resize(m_num_tiles_x * m_num_tiles_y);
+		setThreadNum(1);
+
+		setGuardBand(2.0f);
+
+		m_light_grid = std::make_shared<TRLightGrid>(width, height);
+
+		m_scene = std::make_shared<TRSceneBVH>();
+	}
+
+	void TRRenderer::setGuardBand(float scale)
+	{
+		//Note: the edge functions of the rasterizer are exact as long as the triangles are smaller than max_extent
+		float max_scale = static_cast<float>(TRShadingPipeline::RasterSetup::max_extent)
+			/ std::max(m_backBuffer->getWidth(), m_backBuffer->getHeight());
+		m_guard_band = std::max(1.0f, std::min(scale, max_scale));
 	}
 
 	void TRRenderer::addDrawableMesh(TRDrawableMesh::ptr mesh)
 	{
 		m_drawableMeshes.push_back(mesh);
+		m_scene->invalidate();
 	}
 
 	void TRRenderer::addDrawableMesh(const std::vector<TRDrawableMesh::ptr> &meshes)
 	{
 		m_drawableMeshes.insert(m_drawableMeshes.end(), meshes.begin(), meshes.end());
+		m_scene->invalidate();
 	}
 
 	void TRRenderer::unloadDrawableMesh()
@@ -38,6 +70,7 @@ namespace TinyRenderer
 			m_drawableMeshes[i]->clear();
 		}
 		std::vector<TRDrawableMesh::ptr>().swap(m_drawableMeshes);
+		m_scene->invalidate();
 	}
 
 	void TRRenderer::setViewMatrix(const glm::mat4 &view)
@@ -71,6 +104,16 @@ namespace TinyRenderer
 		m_shader_handler->setViewerPos(viewer);
 	}
 
+	void TRRenderer::setThreadNum(int num)
+	{
+		num = std::max(num, 1);
+		if (m_thread_pool != nullptr && m_thread_pool->getThreadNum() == num)
+			return;
+		m_thread_pool = nullptr;
+		m_thread_pool = std::make_shared<TRThreadPool>(num);
+		m_profiler->setThreadNum(num);
+	}
+
 	glm::mat4 TRRenderer::getMVPMatrix()
 	{
 		if (m_mvp_dirty)
@@ -81,8 +124,29 @@ namespace TinyRenderer
 		return m_mvp_matrix;
 	}
 
+	void TRRenderer::setColorTarget(unsigned char *pixels, int pitch, const TRPixelFormat &format)
+	{
+		//The presented frame no longer refers to the pixels, it has been displayed already
+		m_frontBuffer->setColorTarget(nullptr, 0, TRPixelFormat::rgba8());
+		m_backBuffer->setColorTarget(pixels, pitch, format);
+	}
+
+	void TRRenderer::setDepthFormat(TRDepthFormat format)
+	{
+		m_backBuffer->setDepthFormat(format);
+		m_frontBuffer->setDepthFormat(format);
+		m_reversed_depth = (format == TRDepthFormat::TR_DEPTH_32F_REVERSED);
+	}
+
+	void TRRenderer::setSampleCount(int num_samples)
+	{
+		m_backBuffer->setSampleCount(num_samples);
+		m_frontBuffer->setSampleCount(num_samples);
+	}
+
 	void TRRenderer::clearColor(glm::vec4 color)
 	{
+		TRProfiler::ScopedTimer timer(m_profiler.get(), TRProfiler::TR_STAGE_DEPTH, "clear");
 		m_backBuffer->clear(color);
 	}
 
@@ -113,6 +177,7 @@ namespace TinyRenderer
 		{
 			m_shader_handler = std::make_shared<TRDefaultShadingPipeline>();
 		}
+		bindShaderPipeline();
 		
 		//Load the matrices
 		m_shader_handler->setModelMatrix(m_modelMatrix);
@@ -121,70 +186,350 @@ namespace TinyRenderer
 		//Draw a mesh step by step
 		m_clip_cull_profile.m_num_cliped_triangles = 0;
 		m_clip_cull_profile.m_num_culled_triangles = 0;
-		std::vector<TRShadingPipeline::VertexData> rasterized_points;
-		rasterized_points.reserve(m_backBuffer->getWidth() * m_backBuffer->getHeight());
-		for (size_t m = 0; m < m_drawableMeshes.size(); ++m)
+		m_clip_cull_profile.m_num_allocated_bytes = 0;
+		m_clip_cull_profile.m_num_shaded_vertices = 0;
+		m_clip_cull_profile.m_num_raster_triangles = 0;
+		m_clip_cull_profile.m_num_culled_instances = 0;
+		m_clip_cull_profile.m_num_culled_meshes = 0;
+		m_clip_cull_profile.m_num_culled_chunks = 0;
+		m_clip_cull_profile.m_raster_counters = RasterCounters();
+		const bool binned = (m_raster_mode == TRRasterMode::TR_RASTER_TILE_BINNED);
+		if (m_shading_mode == TRShadingMode::TR_SHADING_DEFERRED)
 		{
-			//Configuration
-			TRPolygonMode polygonMode = m_drawableMeshes[m]->getPolygonMode();
-			TRCullFaceMode cullfaceMode = m_drawableMeshes[m]->getCullfaceMode();
-			TRDepthTestMode depthtestMode = m_drawableMeshes[m]->getDepthtestMode();
-			TRDepthWriteMode depthwriteMode = m_drawableMeshes[m]->getDepthwriteMode();
-			m_shader_handler->setModelMatrix(m_drawableMeshes[m]->getModelMatrix());
-			m_shader_handler->setLightingEnable(m_drawableMeshes[m]->getLightingMode() == TRLightingMode::TR_LIGHTING_ENABLE);
-
-			const auto& vertices = m_drawableMeshes[m]->getVerticesAttrib();
-			const auto& faces = m_drawableMeshes[m]->getMeshFaces();
-			for (size_t f = 0; f < faces.size(); ++f)
+			m_backBuffer->createGBuffer();
+		}
+		else
+		{
+			//Forward shading: light culling before the fragments are shaded, in screen space only
+			TRProfiler::ScopedTimer timer(m_profiler.get(), TRProfiler::TR_STAGE_FRAGMENT, "light culling");
+			m_light_grid->build(TRShadingPipeline::getPointLights(), m_viewMatrix, m_projectMatrix, m_frustum_near_far.x, nullptr);
+		}
+		TRShadingPipeline::setLightGrid(m_light_grid);
+		if (binned)
+		{
+			//Geometry phase only, the rasterization is deferred to the tiles
+			m_raster_triangles.clear();
+			for (auto &bin : m_tile_bins)
+			{
+				bin.clear();
+			}
+		}
+		const glm::mat4 view_project = m_projectMatrix * m_viewMatrix;
+		{
+			TRProfiler::ScopedTimer timer(m_profiler.get(), TRProfiler::TR_STAGE_CLIP, "scene culling");
+			buildDrawCalls(view_project);
+		}
+		for (const auto &draw : m_draw_calls)
+		{
+			const TRDrawableMesh *mesh = m_drawableMeshes[draw.mesh].get();
+			const auto &chunks = mesh->getChunks();
+			size_t capacity = m_visible_chunks.capacity();
+			m_visible_chunks.clear();
+			if (draw.instance == TRSceneBVH::no_index)
 			{
-				//Setup the shading options
+				for (unsigned int i = draw.first; i < draw.first + draw.count; ++i)
+				{
+					m_visible_chunks.push_back(m_scene->getItem(m_sorted_items[i].first).chunk);
+				}
+				if (m_visible_chunks.capacity() != capacity)
 				{
-					m_shader_handler->setAmbientCoef(faces[f].kA);
-					m_shader_handler->setDiffuseCoef(faces[f].kD);
-					m_shader_handler->setSpecularCoef(faces[f].kS);
-					m_shader_handler->setEmissionColor(faces[f].kE);
-					m_shader_handler->setDiffuseTexId(faces[f].diffuseMapTexId);
-					m_shader_handler->setSpecularTexId(faces[f].specularMapTexId);
-					m_shader_handler->setNormalTexId(faces[f].normalMapTexId);
-					m_shader_handler->setGlowTexId(faces[f].glowMapTexId);
-					m_shader_handler->setShininess(faces[f].shininess);
-					m_shader_handler->setTangent(faces[f].tangent);
-					m_shader_handler->setBitangent(faces[f].bitangent);
+					m_clip_cull_profile.m_num_allocated_bytes += m_visible_chunks.capacity() * sizeof(unsigned int);
 				}
+				drawMesh(mesh, mesh->getModelMatrix(), nullptr, m_visible_chunks);
+				continue;
+			}
 
-				//A triangle as primitive
-				TRShadingPipeline::VertexData v[3];
+			//Instanced drawing: the geometry is shared, the chunks of the instance are culled here
+			const TRMeshInstance &instance = mesh->getInstances()[draw.instance];
+			const glm::mat4 mvp = view_project * instance.modelMatrix;
+			for (size_t c = 0; c < chunks.size(); ++c)
+			{
+				if (chunks.size() > 1 && isBoundsOutsideFrustum(chunks[c].bounds, mvp))
 				{
-					v[0].pos = vertices.vpositions[faces[f].vposIndex[0]];
-					v[0].col = glm::vec3(vertices.vcolors[faces[f].vposIndex[0]]);
-					v[0].nor = vertices.vnormals[faces[f].vnorIndex[0]];
-					v[0].tex = vertices.vtexcoords[faces[f].vtexIndex[0]];
-
-					v[1].pos = vertices.vpositions[faces[f].vposIndex[1]];
-					v[1].col = glm::vec3(vertices.vcolors[faces[f].vposIndex[1]]);
-					v[1].nor = vertices.vnormals[faces[f].vnorIndex[1]];
-					v[1].tex = vertices.vtexcoords[faces[f].vtexIndex[1]];
-
-					v[2].pos = vertices.vpositions[faces[f].vposIndex[2]];
-					v[2].col = glm::vec3(vertices.vcolors[faces[f].vposIndex[2]]);
-					v[2].nor = vertices.vnormals[faces[f].vnorIndex[2]];
-					v[2].tex = vertices.vtexcoords[faces[f].vtexIndex[2]];
+					++m_clip_cull_profile.m_num_culled_chunks;
+					continue;
 				}
+				m_visible_chunks.push_back(static_cast<unsigned int>(c));
+			}
+			if (m_visible_chunks.capacity() != capacity)
+			{
+				m_clip_cull_profile.m_num_allocated_bytes += m_visible_chunks.capacity() * sizeof(unsigned int);
+			}
+			if (!m_visible_chunks.empty())
+			{
+				drawMesh(mesh, instance.modelMatrix, &instance, m_visible_chunks);
+			}
+		}
+
+		if (binned)
+		{
+			rasterizeTiles();
+		}
+
+		if (m_shading_mode == TRShadingMode::TR_SHADING_DEFERRED)
+		{
+			//Deferred shading: the tiles are also culled by the depth range of the visible surfaces
+			{
+				TRProfiler::ScopedTimer timer(m_profiler.get(), TRProfiler::TR_STAGE_FRAGMENT, "light culling");
+				m_light_grid->build(TRShadingPipeline::getPointLights(), m_viewMatrix, m_projectMatrix, m_frustum_near_far.x, m_backBuffer.get());
+			}
+			shadeGBuffer();
+		}
+
+		//Counters of the frame
+		{
+			const RasterCounters &counters = m_clip_cull_profile.m_raster_counters;
+			m_profiler->addCounter(TRProfiler::TR_COUNTER_SHADED_VERTICES, m_clip_cull_profile.m_num_shaded_vertices);
+			m_profiler->addCounter(TRProfiler::TR_COUNTER_TRIANGLES, m_clip_cull_profile.m_num_raster_triangles);
+			m_profiler->addCounter(TRProfiler::TR_COUNTER_FRAGMENTS_GENERATED, counters.fragments);
+			m_profiler->addCounter(TRProfiler::TR_COUNTER_FRAGMENTS_PASSED, counters.passed);
+			m_profiler->addCounter(TRProfiler::TR_COUNTER_FRAGMENTS_SHADED, counters.shaded);
+			m_profiler->addCounter(TRProfiler::TR_COUNTER_TEXTURE_SAMPLES, counters.textureSamples);
+			m_profiler->addCounter(TRProfiler::TR_COUNTER_ALLOCATED_BYTES, m_clip_cull_profile.m_num_allocated_bytes);
+			m_profiler->addCounter(TRProfiler::TR_COUNTER_CULLED_MESHES, m_clip_cull_profile.m_num_culled_meshes);
+			m_profiler->addCounter(TRProfiler::TR_COUNTER_CULLED_CHUNKS, m_clip_cull_profile.m_num_culled_chunks);
+		}
+
+		//The tiles not drawn to still miss the clear color, and the pixels of several samples their average
+		{
+			TRProfiler::ScopedTimer timer(m_profiler.get(), TRProfiler::TR_STAGE_FRAGMENT, "resolve");
+			m_backBuffer->resolve();
+		}
+
+		//Swap double buffers
+		{
+			std::swap(m_backBuffer, m_frontBuffer);
+		}
+		
+	}
+
+	void TRRenderer::buildDrawCalls(const glm::mat4 &view_project)
+	{
+		size_t item_capacity = m_visible_items.capacity();
+		size_t sorted_capacity = m_sorted_items.capacity();
+		size_t draw_capacity = m_draw_calls.capacity();
+
+		//Hierarchical view frustum culling of the scene
+		const glm::vec3 viewer = glm::vec3(glm::inverse(m_viewMatrix)[3]);
+		m_scene->update(m_drawableMeshes);
+		m_scene->cull(view_project, m_reversed_depth, viewer, m_visible_items);
+
+		//Group the visible items by mesh and instance, a draw is ranked by its first item in the traversal
+		//Note: the items of a mesh are sorted by chunk, hence the faces keep their order inside a draw
+		m_sorted_items.clear();
+		for (size_t i = 0; i < m_visible_items.size(); ++i)
+		{
+			m_sorted_items.push_back(std::make_pair(m_visible_items[i], static_cast<unsigned int>(i)));
+		}
+		std::sort(m_sorted_items.begin(), m_sorted_items.end());
+
+		m_draw_calls.clear();
+		size_t num_items = 0;
+		glm::mat4 mesh_mvp;
+		for (size_t i = 0; i < m_sorted_items.size(); ++i)
+		{
+			//The world space boxes are loose, the bounds are tested in the object space as well
+			const TRSceneBVH::Item &item = m_scene->getItem(m_sorted_items[i].first);
+			const TRDrawableMesh *mesh = m_drawableMeshes[item.mesh].get();
+			const bool same_draw = !m_draw_calls.empty()
+				&& m_draw_calls.back().mesh == item.mesh && m_draw_calls.back().instance == item.instance;
+			if (item.instance == TRSceneBVH::no_index)
+			{
+				if (!same_draw)
+					mesh_mvp = view_project * mesh->getModelMatrix();
+				if (isBoundsOutsideFrustum(mesh->getChunks()[item.chunk].bounds, mesh_mvp))
+					continue;
+			}
+			else if (isBoundsOutsideFrustum(mesh->getBounds(), view_project * mesh->getInstances()[item.instance].modelMatrix))
+			{
+				continue;
+			}
+
+			m_sorted_items[num_items++] = m_sorted_items[i];
+			if (same_draw)
+			{
+				++m_draw_calls.back().count;
+				m_draw_calls.back().rank = std::min(m_draw_calls.back().rank, m_sorted_items[i].second);
+				continue;
+			}
+			DrawCall draw;
+			draw.mesh = item.mesh;
+			draw.instance = item.instance;
+			draw.first = static_cast<unsigned int>(num_items - 1);
+			draw.count = 1;
+			draw.rank = m_sorted_items[i].second;
+			draw.frontToBack = mesh->getDepthtestMode() == TRDepthTestMode::TR_DEPTH_TEST_ENABLE
+				&& mesh->getDepthwriteMode() == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE;
+			m_draw_calls.push_back(draw);
+		}
+		m_sorted_items.resize(num_items);
+
+		//Front-to-back for the early depth rejection, then the meshes relying on the drawing order
+		//(without depth test or depth write) in their submission order
+		std::sort(m_draw_calls.begin(), m_draw_calls.end(), [](const DrawCall &a, const DrawCall &b)
+		{
+			if (a.frontToBack != b.frontToBack)
+				return a.frontToBack;
+			if (a.frontToBack)
+				return a.rank < b.rank;
+			return a.mesh < b.mesh || (a.mesh == b.mesh && a.instance < b.instance);
+		});
+
+		//Statistics of the culling
+		unsigned int num_drawn_meshes = 0, num_drawn_instances = 0;
+		for (const auto &draw : m_draw_calls)
+		{
+			if (draw.instance != TRSceneBVH::no_index)
+			{
+				++num_drawn_instances;
+				continue;
+			}
+			++num_drawn_meshes;
+			m_clip_cull_profile.m_num_culled_chunks +=
+				static_cast<unsigned int>(m_drawableMeshes[draw.mesh]->getChunks().size()) - draw.count;
+		}
+		unsigned int num_meshes = 0, num_instances = 0;
+		for (size_t m = 0; m < m_drawableMeshes.size(); ++m)
+		{
+			const TRDrawableMesh *mesh = m_drawableMeshes[m].get();
+			if (mesh->getChunks().empty())
+				continue;
+			if (mesh->getInstances().empty())
+				++num_meshes;
+			else
+				num_instances += static_cast<unsigned int>(mesh->getInstances().size());
+		}
+		m_clip_cull_profile.m_num_culled_meshes = num_meshes - num_drawn_meshes;
+		m_clip_cull_profile.m_num_culled_instances = num_instances - num_drawn_instances;
+
+		if (m_visible_items.capacity() != item_capacity)
+		{
+			m_clip_cull_profile.m_num_allocated_bytes += m_visible_items.capacity() * sizeof(unsigned int);
+		}
+		if (m_sorted_items.capacity() != sorted_capacity)
+		{
+			m_clip_cull_profile.m_num_allocated_bytes += m_sorted_items.capacity() * sizeof(std::pair<unsigned int, unsigned int>);
+		}
+		if (m_draw_calls.capacity() != draw_capacity)
+		{
+			m_clip_cull_profile.m_num_allocated_bytes += m_draw_calls.capacity() * sizeof(DrawCall);
+		}
+	}
+
+	void TRRenderer::drawMesh(
+		const TRDrawableMesh *mesh,
+		const glm::mat4 &model,
+		const TRMeshInstance *instance,
+		const std::vector<unsigned int> &visible_chunks)
+	{
+		const bool binned = (m_raster_mode == TRRasterMode::TR_RASTER_TILE_BINNED);
+		const glm::ivec2 screen_min(0, 0);
+		const glm::ivec2 screen_max(m_backBuffer->getWidth() - 1, m_backBuffer->getHeight() - 1);
+		RasterCounters &counters = m_clip_cull_profile.m_raster_counters;
+		const unsigned int texture_samples = TRShadingPipeline::getNumberOfTextureSamples();
+
+		//The stages are interleaved per triangle, each one is timed up to the start of the next one
+		TRProfiler::ScopedTimer timer(m_profiler.get(), "draw", 0);
+		TRProfiler::LapTimer stages(m_profiler.get());
+
+		//Configuration
+		TRCullFaceMode cullfaceMode = mesh->getCullfaceMode();
+		m_shader_handler->setModelMatrix(model);
+		m_shader_handler->setLightingEnable(mesh->getLightingMode() == TRLightingMode::TR_LIGHTING_ENABLE);
+
+		const auto& streams = mesh->getVertexStreams();
+		const auto& faces = mesh->getMeshFaces();
+		const auto& tangents = mesh->getFaceTangents();
+		const auto& materials = mesh->getMaterials();
+		const auto& chunks = mesh->getChunks();
+
+		//Only the faces and the vertices of the visible chunks are processed
+		{
+			size_t range_capacity = m_vertex_ranges.capacity();
+			m_vertex_ranges.clear();
+			for (auto c : visible_chunks)
+			{
+				m_vertex_ranges.push_back(glm::uvec2(chunks[c].vertBegin, chunks[c].vertEnd));
+			}
+			if (m_vertex_ranges.capacity() != range_capacity)
+			{
+				m_clip_cull_profile.m_num_allocated_bytes += m_vertex_ranges.capacity() * sizeof(glm::uvec2);
+			}
+
+			//Merge the overlapping vertex ranges of the visible chunks
+			std::sort(m_vertex_ranges.begin(), m_vertex_ranges.end(),
+				[](const glm::uvec2 &a, const glm::uvec2 &b) { return a.x < b.x; });
+			size_t num_ranges = 0;
+			for (size_t r = 0; r < m_vertex_ranges.size(); ++r)
+			{
+				if (num_ranges > 0 && m_vertex_ranges[r].x <= m_vertex_ranges[num_ranges - 1].y)
+					m_vertex_ranges[num_ranges - 1].y = std::max(m_vertex_ranges[num_ranges - 1].y, m_vertex_ranges[r].y);
+				else
+					m_vertex_ranges[num_ranges++] = m_vertex_ranges[r];
+			}
+			m_vertex_ranges.resize(num_ranges);
+		}
+
+		//Vertex shader stage: each unique vertex of the visible chunks is transformed only once
+		//Note: bound statically for the built-in pipelines, which shade a batch of vertices per SIMD instruction
+		{
+			const TRDefaultShadingPipeline *builtin = m_builtin_pipeline ?
+				static_cast<const TRDefaultShadingPipeline*>(m_shader_handler.get()) : nullptr;
+			size_t capacity = m_transformed_vertices.capacity();
+			m_transformed_vertices.resize(streams.size());
+			if (m_transformed_vertices.capacity() != capacity)
+			{
+				m_clip_cull_profile.m_num_allocated_bytes += 
+					m_transformed_vertices.capacity() * sizeof(TRShadingPipeline::VertexData);
+			}
+
+			for (const auto &range : m_vertex_ranges)
+			{
+				if (builtin != nullptr)
+					builtin->transformVertices(streams, range.x, range.y, m_transformed_vertices.data());
+				else
+					m_shader_handler->vertexShaderBatch(streams, range.x, range.y, m_transformed_vertices.data());
+				m_clip_cull_profile.m_num_shaded_vertices += range.y - range.x;
+			}
+		}
+		stages.lap(TRProfiler::TR_STAGE_VERTEX);
+
+		ClipPolygon clipped;
+		const TRMaterial *material = nullptr;
+		for (auto c : visible_chunks)
+		{
+			const TRMeshChunk &chunk = chunks[c];
+
+			//Setup the shading options, once per run of the chunks sharing a material
+			if (material != &materials[chunk.materialId])
+			{
+				material = &materials[chunk.materialId];
+				setupMaterial(m_shader_handler.get(), *material, instance);
+			}
 
-				//Vertex shader stage
-				std::vector<TRShadingPipeline::VertexData> clipped_vertices;
+			for (size_t f = chunk.faceBegin; f < chunk.faceEnd; ++f)
+			{
+				//Backface culling before any clipping work
+				if (isBackFacing(
+					m_transformed_vertices[faces[f].vertIndex[0]].cpos,
+					m_transformed_vertices[faces[f].vertIndex[1]].cpos,
+					m_transformed_vertices[faces[f].vertIndex[2]].cpos, cullfaceMode))
 				{
-					//Vertex shader
-					{
-						m_shader_handler->vertexShader(v[0]);
-						m_shader_handler->vertexShader(v[1]);
-						m_shader_handler->vertexShader(v[2]);
-					}
+					++m_clip_cull_profile.m_num_culled_triangles;
+					continue;
+				}
+
+				//A triangle as primitive
+				TRShadingPipeline::VertexData v[3] = {
+					m_transformed_vertices[faces[f].vertIndex[0]],
+					m_transformed_vertices[faces[f].vertIndex[1]],
+					m_transformed_vertices[faces[f].vertIndex[2]] };
+				m_shader_handler->calcTangentSpace(v[0], v[1], v[2], tangents[f].tangent, tangents[f].bitangent);
 
+				{
 					//Homogeneous space cliping
 					{
-						clipped_vertices = clipingSutherlandHodgeman(v[0], v[1], v[2]);
-						if (clipped_vertices.empty())
+						if (!clipingSutherlandHodgeman(v[0], v[1], v[2], clipped))
 						{
 							++m_clip_cull_profile.m_num_cliped_triangles;
 							continue;
@@ -192,89 +537,476 @@ namespace TinyRenderer
 					}
 
 					//Perspective division
-					for (auto &vert : clipped_vertices)
+					for (int i = 0; i < clipped.size; ++i)
 					{
 						//From clip space -> ndc space
+						auto &vert = clipped.vertices[i];
 						TRShadingPipeline::VertexData::prePerspCorrection(vert);
 						vert.cpos /= vert.cpos.w;
 					}
 				}
+				stages.lap(TRProfiler::TR_STAGE_CLIP);
 
-				int num_verts = clipped_vertices.size();
-				for (int i = 0; i < num_verts - 2; ++i)
+				const auto &clipped_vertices = clipped.vertices;
+				m_clip_cull_profile.m_num_raster_triangles += clipped.size - 2;
+				for (int i = 0; i < clipped.size - 2; ++i)
 				{
 					//Triangle assembly
-					TRShadingPipeline::VertexData vert[3] = {
-							clipped_vertices[0],
-							clipped_vertices[i + 1],
-							clipped_vertices[i + 2] };
+					RasterTriangle tri = { 
+						{ clipped_vertices[0], clipped_vertices[i + 1], clipped_vertices[i + 2] },
+						material,
+						mesh,
+						instance };
+					TRShadingPipeline::VertexData *vert = tri.v;
 
+					//Transform to screen space
+					{
+						vert[0].spos = glm::vec2(m_viewportMatrix * vert[0].cpos);
+						vert[1].spos = glm::vec2(m_viewportMatrix * vert[1].cpos);
+						vert[2].spos = glm::vec2(m_viewportMatrix * vert[2].cpos);
+					}
 
-					//Rasterization stage
+					if (binned)
 					{
-						//Transform to screen space & Rasterization
-						{
-							vert[0].spos = glm::ivec2(m_viewportMatrix * vert[0].cpos + glm::vec4(0.5f));
-							vert[1].spos = glm::ivec2(m_viewportMatrix * vert[1].cpos + glm::vec4(0.5f));
-							vert[2].spos = glm::ivec2(m_viewportMatrix * vert[2].cpos + glm::vec4(0.5f));
-
-							//Backface culling
-							if (isBackFacing(vert[0].spos, vert[1].spos, vert[2].spos, cullfaceMode))
-							{
-								++m_clip_cull_profile.m_num_culled_triangles;
-								continue;
-							}
-
-							switch (polygonMode)
-							{
-								case TRPolygonMode::TR_TRIANGLE_FILL:
-									m_shader_handler->rasterize_fill_edge_function(vert[0], vert[1], vert[2],
-										m_backBuffer->getWidth(), m_backBuffer->getHeight(), rasterized_points);
-									break;
-								case TRPolygonMode::TR_TRIANGLE_WIRE:
-									m_shader_handler->rasterize_wire(vert[0], vert[1], vert[2],
-										m_backBuffer->getWidth(), m_backBuffer->getHeight(), rasterized_points);
-									break;
-							}
-						}
+						binTriangle(tri);
+						stages.lap(TRProfiler::TR_STAGE_SETUP);
+						continue;
 					}
+					stages.lap(TRProfiler::TR_STAGE_SETUP);
 
-					if (rasterized_points.empty())
+					//Rasterization stage
+					if (rasterizeTriangle(m_shader_handler.get(), tri, screen_min, screen_max, counters) == 0)
 					{
 						++m_clip_cull_profile.m_num_culled_triangles;
 					}
+					stages.lap(TRProfiler::TR_STAGE_RASTER);
+				}
+			}
+		}
+		stages.lap(TRProfiler::TR_STAGE_CLIP);
+		counters.textureSamples += TRShadingPipeline::getNumberOfTextureSamples() - texture_samples;
+	}
+
+	unsigned int TRRenderer::rasterizeTriangle(
+		TRShadingPipeline *shader,
+		const RasterTriangle &tri,
+		const glm::ivec2 &scissor_min,
+		const glm::ivec2 &scissor_max,
+		RasterCounters &counters)
+	{
+		//Dispatch once per triangle, on the material features set up for it
+		return (this->*m_raster_funcs[shader->getMaterialFeatures()])(shader, tri, scissor_min, scissor_max, counters);
+	}
+
+	template<typename Binding>
+	unsigned int TRRenderer::rasterizeTriangle_aux(
+		TRShadingPipeline *shader,
+		const RasterTriangle &tri,
+		const glm::ivec2 &scissor_min,
+		const glm::ivec2 &scissor_max,
+		RasterCounters &counters)
+	{
+		const bool depthtest = (tri.mesh->getDepthtestMode() == TRDepthTestMode::TR_DEPTH_TEST_ENABLE);
+		const bool depthwrite = (tri.mesh->getDepthwriteMode() == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE);
+		const bool deferred = (m_shading_mode == TRShadingMode::TR_SHADING_DEFERRED);
+		const auto &v = tri.v;
+		TRFrameBuffer *framebuffer = m_backBuffer.get();
+		const int num_samples = deferred ? 1 : framebuffer->getSampleCount();
+		const unsigned int all_samples = (1u << framebuffer->getSampleCount()) - 1;
+		unsigned int num_fragments = 0;
+		unsigned int num_passed = 0;
+		unsigned int num_rejections = 0;
+
+		//Hierarchical depth test: skip the blocks whose nearest depth is behind the farthest stored one
+		//Note: the depth is linear in screen space, its extremes over a block lie at the corners. The nearest
+		//      depth is the minimum, or the maximum with the reversed depth, whose farthest stored one is the
+		//      minimum of the tile instead.
+		const bool reversed = m_reversed_depth;
+		const glm::vec3 z(v[0].cpos.z, v[1].cpos.z, v[2].cpos.z);
+		const float z_nearest = reversed ? std::max(z.x, std::max(z.y, z.z)) : std::min(z.x, std::min(z.y, z.z));
+		auto block_func = [&](const glm::ivec2 &block_min, const glm::ivec2 &block_max, 
+			const glm::vec3 &w, const glm::vec3 &dw_dx, const glm::vec3 &dw_dy) -> bool
+		{
+			if (!depthtest)
+				return true;
+			const unsigned int tx = block_min.x / TRFrameBuffer::hiz_tile_size;
+			const unsigned int ty = block_min.y / TRFrameBuffer::hiz_tile_size;
+			float dz_dx = glm::dot(dw_dx, z) * (block_max.x - block_min.x);
+			float dz_dy = glm::dot(dw_dy, z) * (block_max.y - block_min.y);
+			//Note: the samples lie up to half a pixel away from the centers
+			float margin = (num_samples > 1) ? 0.5f * (std::abs(glm::dot(dw_dx, z)) + std::abs(glm::dot(dw_dy, z))) : 0.0f;
+			bool occluded;
+			if (reversed)
+			{
+				float depth = glm::dot(w, z) + std::max(dz_dx, 0.0f) + std::max(dz_dy, 0.0f) + margin;
+				depth = std::min(depth, z_nearest) + 1e-5f;
+				occluded = depth <= framebuffer->readHiZMinDepth(tx, ty);
+			}
+			else
+			{
+				float depth = glm::dot(w, z) + std::min(dz_dx, 0.0f) + std::min(dz_dy, 0.0f) - margin;
+				depth = std::max(depth, z_nearest) - 1e-5f;
+				occluded = depth >= framebuffer->readHiZMaxDepth(tx, ty);
+			}
+			if (occluded)
+			{
+				++num_rejections;
+				return false;
+			}
+			return true;
+		};
+
+		//Screen space gradients of the barycentric weights
+		glm::vec3 dw_dx(0.0f), dw_dy(0.0f);
+		{
+			float area = (v[1].spos.x - v[0].spos.x) * (v[2].spos.y - v[0].spos.y)
+				- (v[1].spos.y - v[0].spos.y) * (v[2].spos.x - v[0].spos.x);
+			if (area != 0.0f)
+			{
+				dw_dx = glm::vec3(v[1].spos.y - v[2].spos.y, v[2].spos.y - v[0].spos.y, v[0].spos.y - v[1].spos.y) / area;
+				dw_dy = glm::vec3(v[2].spos.x - v[1].spos.x, v[0].spos.x - v[2].spos.x, v[1].spos.x - v[0].spos.x) / area;
+			}
+		}
+
+		//Only the attributes read by the shaders are interpolated
+		TRShadingPipeline::VaryingPlanes planes;
+		planes.setup(v[0], v[1], v[2], dw_dx, dw_dy, Binding::varyings);
+
+		//Interpolation & fragment shader at the pixel center, for the samples of coverage
+		auto shade_func = [&](int x, int y, const glm::vec3 &w, unsigned int coverage)
+		{
+			TRShadingPipeline::VertexData point;
+			planes.interpolate<Binding::varyings>(x, y, w, point);
+			point.spos = glm::vec2(x + 0.5f, y + 0.5f);
+
+			if (deferred)
+			{
+				TRGBufferSample sample;
+				Binding::surface(shader, point, sample);
+				framebuffer->writeGBuffer(x, y, sample);
+			}
+			else
+			{
+				glm::vec4 fragColor;
+				Binding::fragment(shader, point, fragColor);
+				if (coverage == all_samples)
+					framebuffer->writeColor(x, y, fragColor);
+				else
+					framebuffer->writeColor(x, y, fragColor, coverage);
+			}
+		};
+
+		if (num_samples > 1)
+		{
+			//Depth offsets of the samples from the pixel center
+			const glm::ivec2 *positions = TRShadingPipeline::getSamplePositions(num_samples);
+			const float dz_dx = glm::dot(dw_dx, z), dz_dy = glm::dot(dw_dy, z);
+			float sample_dz[TRShadingPipeline::RasterSetup::max_samples];
+			for (int s = 0; s < num_samples; ++s)
+			{
+				sample_dz[s] = (positions[s].x * dz_dx + positions[s].y * dz_dy) * (1.0f / 16.0f);
+			}
+
+			//Depth testing per sample, then shading once for the samples passed
+			auto fragment_func = [&](int x, int y, const glm::vec3 &w, unsigned int coverage)
+			{
+				++num_fragments;
+				const float depth = w.x * v[0].cpos.z + w.y * v[1].cpos.z + w.z * v[2].cpos.z;
+				unsigned int passed = coverage;
+				if (depthtest)
+				{
+					passed = 0;
+					for (int s = 0; s < num_samples; ++s)
+					{
+						if ((coverage & (1u << s)) && isDepthNearer_aux(depth + sample_dz[s], framebuffer->readDepth(x, y, s), reversed))
+							passed |= 1u << s;
+					}
+				}
+				if (passed == 0)
+					return;
+				++num_passed;
 
-					//Fragment shader & Depth testing
-					for (auto &point : rasterized_points)
+				shade_func(x, y, w, passed);
+				if (depthwrite)
+				{
+					for (int s = 0; s < num_samples; ++s)
 					{
-						//Perspective correction after rasterization
-						TRShadingPipeline::VertexData::aftPrespCorrection(point);
-						if (depthtestMode == TRDepthTestMode::TR_DEPTH_TEST_ENABLE &&
-							m_backBuffer->readDepth(point.spos.x, point.spos.y) > point.cpos.z)
-						{
-							glm::vec4 fragColor;
-							m_shader_handler->fragmentShader(point, fragColor);
-							m_backBuffer->writeColor(point.spos.x, point.spos.y, fragColor);
-							if (depthwriteMode == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE)
-							{
-								m_backBuffer->writeDepth(point.spos.x, point.spos.y, point.cpos.z);
-							}
-						}
+						if (passed & (1u << s))
+							framebuffer->writeDepth(x, y, s, depth + sample_dz[s]);
 					}
+				}
+			};
+
+			switch (tri.mesh->getPolygonMode())
+			{
+				case TRPolygonMode::TR_TRIANGLE_FILL:
+					TRShadingPipeline::rasterize_fill_multisample(v[0], v[1], v[2],
+						scissor_min, scissor_max, num_samples, fragment_func, block_func);
+					break;
+				case TRPolygonMode::TR_TRIANGLE_WIRE:
+					//Note: the lines cover whole pixels
+					TRShadingPipeline::rasterize_wire(v[0], v[1], v[2], scissor_min, scissor_max,
+						[&](int x, int y, const glm::vec3 &w) { fragment_func(x, y, w, all_samples); });
+					break;
+			}
+		}
+		else
+		{
+			//Depth testing first, then interpolation & fragment shader only for the survivors
+			auto fragment_func = [&](int x, int y, const glm::vec3 &w)
+			{
+				++num_fragments;
+				float depth = w.x * v[0].cpos.z + w.y * v[1].cpos.z + w.z * v[2].cpos.z;
+				if (depthtest && !isDepthNearer_aux(depth, framebuffer->readDepth(x, y), reversed))
+					return;
+				++num_passed;
 
-					rasterized_points.clear();
+				shade_func(x, y, w, all_samples);
+				if (depthwrite)
+				{
+					framebuffer->writeDepth(x, y, depth);
 				}
+			};
+
+			//Rasterization
+			switch (tri.mesh->getPolygonMode())
+			{
+				case TRPolygonMode::TR_TRIANGLE_FILL:
+					TRShadingPipeline::rasterize_fill_edge_function(v[0], v[1], v[2],
+						scissor_min, scissor_max, fragment_func, block_func);
+					break;
+				case TRPolygonMode::TR_TRIANGLE_WIRE:
+					TRShadingPipeline::rasterize_wire(v[0], v[1], v[2],
+						scissor_min, scissor_max, fragment_func);
+					break;
+			}
+		}
+
+		counters.fragments += num_fragments;
+		counters.passed += num_passed;
+		counters.shaded += deferred ? 0 : num_passed;
+		counters.hizRejections += num_rejections;
+
+		//Note: a triangle hidden by the hierarchical z-buffer is not counted as culled
+		return num_fragments + num_rejections;
+	}
+
+	void TRRenderer::shadeGBuffer()
+	{
+		//Lighting pass: each covered pixel is shaded exactly once, the rows are shared by the threads
+		//Note: the lighting shader only reads the global shading settings, hence no copy per thread
+		TRProfiler::ScopedTimer timer(m_profiler.get(), TRProfiler::TR_STAGE_FRAGMENT, "lighting pass");
+		TRFrameBuffer *framebuffer = m_backBuffer.get();
+		const TRShadingPipeline *shader = m_shader_handler.get();
+		const int width = framebuffer->getWidth();
+		m_thread_counters.assign(m_thread_pool->getThreadNum(), RasterCounters());
+		m_thread_pool->parallelFor(framebuffer->getHeight(), [&](int y, int thread)
+		{
+			const unsigned int texture_samples = TRShadingPipeline::getNumberOfTextureSamples();
+			unsigned int num_shaded = 0;
+			for (int x = 0; x < width; ++x)
+			{
+				const TRGBufferSample &sample = framebuffer->readGBuffer(x, y);
+				if (!sample.covered)
+					continue;
+				glm::vec4 fragColor;
+				shader->lightingShader(sample, TRShadingPipeline::getPointLightsOfPixel(x, y), fragColor);
+				framebuffer->writeColor(x, y, fragColor);
+				++num_shaded;
 			}
+			m_thread_counters[thread].shaded += num_shaded;
+			m_thread_counters[thread].textureSamples += TRShadingPipeline::getNumberOfTextureSamples() - texture_samples;
+		});
+		for (const auto &counters : m_thread_counters)
+		{
+			m_clip_cull_profile.m_raster_counters += counters;
+		}
+	}
 
+	void TRRenderer::binTriangle(const RasterTriangle &tri)
+	{
+		//Screen space bounding box
+		const auto &v = tri.v;
+		int min_x, min_y, max_x, max_y;
+		TRShadingPipeline::RasterSetup setup;
+		const bool filled = (tri.mesh->getPolygonMode() == TRPolygonMode::TR_TRIANGLE_FILL);
+		const int num_samples = (m_shading_mode == TRShadingMode::TR_SHADING_DEFERRED) ? 1 : m_backBuffer->getSampleCount();
+		if (filled)
+		{
+			if (!TRShadingPipeline::setupTriangle(v[0].spos, v[1].spos, v[2].spos, setup, num_samples))
+			{
+				++m_clip_cull_profile.m_num_culled_triangles;
+				return;
+			}
+			min_x = setup.bbox_min.x; min_y = setup.bbox_min.y;
+			max_x = setup.bbox_max.x; max_y = setup.bbox_max.y;
+		}
+		else
+		{
+			glm::ivec2 pmin(glm::floor(glm::min(v[0].spos, glm::min(v[1].spos, v[2].spos))));
+			glm::ivec2 pmax(glm::floor(glm::max(v[0].spos, glm::max(v[1].spos, v[2].spos))));
+			min_x = pmin.x; min_y = pmin.y;
+			max_x = pmax.x; max_y = pmax.y;
+		}
+		min_x = std::max(min_x, 0);
+		min_y = std::max(min_y, 0);
+		max_x = std::min(max_x, m_backBuffer->getWidth() - 1);
+		max_y = std::min(max_y, m_backBuffer->getHeight() - 1);
+		if (min_x > max_x || min_y > max_y)
+		{
+			++m_clip_cull_profile.m_num_culled_triangles;
+			return;
 		}
 
-		//Swap double buffers
+		//Append the triangle to every tile overlapped by it
+		unsigned int index = m_raster_triangles.size();
+		size_t capacity = m_raster_triangles.capacity();
+		m_raster_triangles.push_back(tri);
+		if (m_raster_triangles.capacity() != capacity)
 		{
-			std::swap(m_backBuffer, m_frontBuffer);
+			m_clip_cull_profile.m_num_allocated_bytes += m_raster_triangles.capacity() * sizeof(RasterTriangle);
 		}
-		
+		for (int ty = min_y / m_tile_size; ty <= max_y / m_tile_size; ++ty)
+		{
+			for (int tx = min_x / m_tile_size; tx <= max_x / m_tile_size; ++tx)
+			{
+				//Hierarchical rejection: skip the tiles inside the bounding box but outside the triangle
+				glm::ivec2 tile_min(tx * m_tile_size, ty * m_tile_size);
+				glm::ivec2 tile_max(tile_min.x + m_tile_size - 1, tile_min.y + m_tile_size - 1);
+				if (filled && TRShadingPipeline::isRectOutsideTriangle(setup, tile_min, tile_max))
+					continue;
+
+				auto &bin = m_tile_bins[ty * m_num_tiles_x + tx];
+				capacity = bin.capacity();
+				bin.push_back(index);
+				if (bin.capacity() != capacity)
+				{
+					m_clip_cull_profile.m_num_allocated_bytes += bin.capacity() * sizeof(unsigned int);
+				}
+			}
+		}
+	}
+
+	void TRRenderer::rasterizeTiles()
+	{
+		//Each thread works on its own copy of the shader since the material settings change per face
+		TRProfiler::ScopedTimer timer(m_profiler.get(), TRProfiler::TR_STAGE_RASTER, "raster tiles");
+		int num_threads = m_thread_pool->getThreadNum();
+		m_thread_shaders.resize(num_threads);
+		for (int t = 0; t < num_threads; ++t)
+		{
+			m_thread_shaders[t] = m_shader_handler->clone();
+		}
+		m_thread_counters.assign(num_threads, RasterCounters());
+
+		m_thread_pool->parallelFor(m_num_tiles_x * m_num_tiles_y, [this](int tile, int thread)
+		{
+			const auto &bin = m_tile_bins[tile];
+			if (bin.empty())
+				return;
+			TRProfiler::ScopedTimer timer(m_profiler.get(), "tile", thread);
+			RasterCounters counters;
+			const unsigned int texture_samples = TRShadingPipeline::getNumberOfTextureSamples();
+
+			glm::ivec2 tile_min((tile % m_num_tiles_x) * m_tile_size, (tile / m_num_tiles_x) * m_tile_size);
+			glm::ivec2 tile_max(
+				std::min(tile_min.x + m_tile_size, m_backBuffer->getWidth()) - 1,
+				std::min(tile_min.y + m_tile_size, m_backBuffer->getHeight()) - 1);
+
+			//Note: the triangles of a bin keep the submission order, hence the material mostly stays the same
+			TRShadingPipeline *shader = m_thread_shaders[thread].get();
+			const TRMaterial *material = nullptr;
+			const TRDrawableMesh *mesh = nullptr;
+			const TRMeshInstance *instance = nullptr;
+			for (size_t i = 0; i < bin.size(); ++i)
+			{
+				const RasterTriangle &tri = m_raster_triangles[bin[i]];
+				if (tri.material != material || tri.instance != instance)
+				{
+					material = tri.material;
+					instance = tri.instance;
+					setupMaterial(shader, *material, instance);
+				}
+				if (tri.mesh != mesh)
+				{
+					mesh = tri.mesh;
+					shader->setLightingEnable(mesh->getLightingMode() == TRLightingMode::TR_LIGHTING_ENABLE);
+				}
+				rasterizeTriangle(shader, tri, tile_min, tile_max, counters);
+			}
+			counters.textureSamples = TRShadingPipeline::getNumberOfTextureSamples() - texture_samples;
+			m_thread_counters[thread] += counters;
+		});
+		for (const auto &counters : m_thread_counters)
+		{
+			m_clip_cull_profile.m_raster_counters += counters;
+		}
+	}
+
+	void TRRenderer::setupMaterial(TRShadingPipeline *shader, const TRMaterial &material, const TRMeshInstance *instance)
+	{
+		if (instance == nullptr || !instance->overrideMaterial)
+		{
+			shader->setMaterial(material);
+			return;
+		}
+
+		TRMaterial overridden = material;
+		overridden.kA = instance->kA;
+		overridden.kD = instance->kD;
+		overridden.kS = instance->kS;
+		overridden.kE = instance->kE;
+		overridden.shininess = instance->shininess;
+		shader->setMaterial(overridden);
+	}
+
+	void TRRenderer::bindShaderPipeline()
+	{
+		//One instance of the rasterizer per built-in pipeline and material features
+		//Note: only the exact types, a class derived from a built-in one may override its shaders
+		struct RasterFuncTables
+		{
+			RasterFunc custom[TRShadingPipeline::TR_FEATURE_COMBINATIONS];
+			RasterFunc standard[TRShadingPipeline::TR_FEATURE_COMBINATIONS];
+			RasterFunc texture[TRShadingPipeline::TR_FEATURE_COMBINATIONS];
+			RasterFunc phong[TRShadingPipeline::TR_FEATURE_COMBINATIONS];
+
+			RasterFuncTables()
+			{
+				const std::integral_constant<unsigned int, TRShadingPipeline::TR_FEATURE_COMBINATIONS> all;
+				fillRasterFuncs<TRShadingPipeline>(custom, all);
+				fillRasterFuncs<TRDefaultShadingPipeline>(standard, all);
+				fillRasterFuncs<TRTextureShadingPipeline>(texture, all);
+				fillRasterFuncs<TRPhongShadingPipeline>(phong, all);
+			}
+		};
+		static const RasterFuncTables tables;
+
+		const TRShadingPipeline &shader = *m_shader_handler;
+		if (typeid(shader) == typeid(TRDefaultShadingPipeline))
+			m_raster_funcs = tables.standard;
+		else if (typeid(shader) == typeid(TRTextureShadingPipeline))
+			m_raster_funcs = tables.texture;
+		else if (typeid(shader) == typeid(TRPhongShadingPipeline))
+			m_raster_funcs = tables.phong;
+		else
+			m_raster_funcs = tables.custom;
+
+		//The built-in pipelines share the vertex shader
+		m_builtin_pipeline = (m_raster_funcs != tables.custom);
+	}
+
+	template<typename Pipeline, unsigned int count>
+	void TRRenderer::fillRasterFuncs(RasterFunc *funcs, std::integral_constant<unsigned int, count>)
+	{
+		//Note: the features not used by the pipeline share the same instance
+		funcs[count - 1] = &TRRenderer::rasterizeTriangle_aux<TRShaderBinding<Pipeline, (count - 1) & Pipeline::material_features>>;
+		fillRasterFuncs<Pipeline>(funcs, std::integral_constant<unsigned int, count - 1>());
 	}
 
+	template<typename Pipeline>
+	void TRRenderer::fillRasterFuncs(RasterFunc *, std::integral_constant<unsigned int, 0>) {}
+
 	unsigned char* TRRenderer::commitRenderedColorBuffer()
 	{
 		return m_frontBuffer->getColorBuffer();
@@ -290,10 +1022,104 @@ namespace TinyRenderer
 		return m_clip_cull_profile.m_num_culled_triangles;
 	}
 
-	std::vector<TRShadingPipeline::VertexData> TRRenderer::clipingSutherlandHodgeman(
+	unsigned int TRRenderer::getNumberOfAllocatedBytes() const
+	{
+		return m_clip_cull_profile.m_num_allocated_bytes;
+	}
+
+	unsigned int TRRenderer::getNumberOfShadedVertices() const
+	{
+		return m_clip_cull_profile.m_num_shaded_vertices;
+	}
+
+	unsigned int TRRenderer::getNumberOfHiZRejections() const
+	{
+		return m_clip_cull_profile.m_raster_counters.hizRejections;
+	}
+
+	unsigned int TRRenderer::getNumberOfCulledInstances() const
+	{
+		return m_clip_cull_profile.m_num_culled_instances;
+	}
+
+	unsigned int TRRenderer::getNumberOfCulledMeshes() const
+	{
+		return m_clip_cull_profile.m_num_culled_meshes;
+	}
+
+	unsigned int TRRenderer::getNumberOfCulledChunks() const
+	{
+		return m_clip_cull_profile.m_num_culled_chunks;
+	}
+
+	bool TRRenderer::isBoundsOutsideFrustum(const TRBoundingVolume &bounds, const glm::mat4 &mvp) const
+	{
+		//Sphere test against the frustum planes in the object space, extracted from the rows of the mvp matrix
+		glm::vec4 planes[6];
+		TRUtils::calcFrustumPlanes(mvp, m_reversed_depth, planes);
+		for (const auto &plane : planes)
+		{
+			glm::vec3 normal(plane);
+			if (glm::dot(normal, bounds.sphereCenter) + plane.w < -bounds.sphereRadius * glm::length(normal))
+				return true;
+		}
+
+		//Box test: outside if all the corners are outside of the same frustum plane
+		//Note: conservative, a box crossing the extension of two planes is kept
+		const unsigned int frustum_planes = (1u << (TR_CLIP_FAR + 1)) - 1;
+		unsigned int outcode = frustum_planes;
+		for (int c = 0; c < 8; ++c)
+		{
+			glm::vec4 corner(
+				(c & 1) ? bounds.boxMax.x : bounds.boxMin.x,
+				(c & 2) ? bounds.boxMax.y : bounds.boxMin.y,
+				(c & 4) ? bounds.boxMax.z : bounds.boxMin.z, 1.0f);
+			outcode &= calcClipOutcode(mvp * corner);
+			if (outcode == 0)
+				return false;
+		}
+		return true;
+	}
+
+	unsigned int TRRenderer::calcClipOutcode(const glm::vec4 &p) const
+	{
+		unsigned int outcode = 0;
+		for (int plane = 0; plane < TR_CLIP_PLANE_NUM; ++plane)
+		{
+			if (calcClipDistance(p, plane) < 0.0f)
+			{
+				outcode |= (1u << plane);
+			}
+		}
+		return outcode;
+	}
+
+	float TRRenderer::calcClipDistance(const glm::vec4 &p, const int &plane) const
+	{
+		//Signed distance to the clipping plane, positive inside
+		constexpr float w_clipping_plane = 1e-5f;
+		switch (plane)
+		{
+			case TR_CLIP_LEFT:         return p.w + p.x;
+			case TR_CLIP_RIGHT:        return p.w - p.x;
+			case TR_CLIP_BOTTOM:       return p.w + p.y;
+			case TR_CLIP_TOP:          return p.w - p.y;
+			case TR_CLIP_NEAR:         return m_reversed_depth ? p.w - p.z : p.w + p.z;
+			case TR_CLIP_FAR:          return m_reversed_depth ? p.z : p.w - p.z;
+			case TR_CLIP_W:            return p.w - w_clipping_plane;
+			case TR_CLIP_GUARD_LEFT:   return m_guard_band * p.w + p.x;
+			case TR_CLIP_GUARD_RIGHT:  return m_guard_band * p.w - p.x;
+			case TR_CLIP_GUARD_BOTTOM: return m_guard_band * p.w + p.y;
+			case TR_CLIP_GUARD_TOP:    return m_guard_band * p.w - p.y;
+		}
+		return 0.0f;
+	}
+
+	bool TRRenderer::clipingSutherlandHodgeman(
 		const TRShadingPipeline::VertexData &v0,
 		const TRShadingPipeline::VertexData &v1,
-		const TRShadingPipeline::VertexData &v2) const
+		const TRShadingPipeline::VertexData &v2,
+		ClipPolygon &result) const
 	{
 		//Clipping in the homogeneous clipping space
 		//Refs:
@@ -302,138 +1128,99 @@ namespace TinyRenderer
 
 		//Optimization: complete outside or complete inside
 		//Note: in the following situations, we could return the answer without complicate cliping,
-		//      and this optimization should be very important.
+		//      and this optimization should be very important. The triangles inside the guard band
+		//      are left to the scissor of the rasterizer instead of being clipped against x/y.
+		unsigned int outcode0 = calcClipOutcode(v0.cpos);
+		unsigned int outcode1 = calcClipOutcode(v1.cpos);
+		unsigned int outcode2 = calcClipOutcode(v2.cpos);
 		{
+			//Totally outside of one of the planes
+			const unsigned int frustum_planes = (1u << (TR_CLIP_W + 1)) - 1;
+			if ((outcode0 & outcode1 & outcode2 & frustum_planes) != 0)
+				return false;
+
 			//Totally inside
-			if (isPointInsideInClipingFrustum(v0.cpos)
-				&& isPointInsideInClipingFrustum(v1.cpos)
-				&& isPointInsideInClipingFrustum(v2.cpos))
+			result.size = 0;
+			if (((outcode0 | outcode1 | outcode2) & ~((1u << TR_CLIP_NEAR) - 1)) == 0)
 			{
-				return { v0,v1,v2 };
+				result.vertices[0] = v0;
+				result.vertices[1] = v1;
+				result.vertices[2] = v2;
+				result.size = 3;
+				return true;
 			}
-			//Totally outside
-			if (v0.cpos.w < m_frustum_near_far.x && v1.cpos.w < m_frustum_near_far.x && v2.cpos.w < m_frustum_near_far.x)
-				return{};
-			if (v0.cpos.w > m_frustum_near_far.y && v1.cpos.w > m_frustum_near_far.y && v2.cpos.w > m_frustum_near_far.y)
-				return{};
-			if (v0.cpos.x > v0.cpos.w && v1.cpos.x > v1.cpos.w && v2.cpos.x > v2.cpos.w)
-				return{};
-			if (v0.cpos.x <-v0.cpos.w && v1.cpos.x <-v1.cpos.w && v2.cpos.x <-v2.cpos.w)
-				return{};
-			if (v0.cpos.y > v0.cpos.w && v1.cpos.y > v1.cpos.w && v2.cpos.y > v2.cpos.w)
-				return{};
-			if (v0.cpos.y <-v0.cpos.w && v1.cpos.y <-v1.cpos.w && v2.cpos.y <-v2.cpos.w)
-				return{};
-			if (v0.cpos.z > v0.cpos.w && v1.cpos.z > v1.cpos.w && v2.cpos.z > v2.cpos.w)
-				return{};
-			if (v0.cpos.z <-v0.cpos.w && v1.cpos.z <-v1.cpos.w && v2.cpos.z <-v2.cpos.w)
-				return{};
 		}
 
-		std::vector<TRShadingPipeline::VertexData> inside_vertices;
-		std::vector<TRShadingPipeline::VertexData> tmp = { v0, v1, v2 };
-		enum Axis { X = 0, Y = 1, Z = 2};
-
-		//w=x plane & w=-x plane
-		{
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::X, +1);
-			tmp = inside_vertices;
-
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::X, -1);
-			tmp = inside_vertices;
-		}
-
-		//w=y plane & w=-y plane
+		//Only clip against the planes crossed by the triangle
+		ClipPolygon tmp;
+		tmp.vertices[0] = v0;
+		tmp.vertices[1] = v1;
+		tmp.vertices[2] = v2;
+		tmp.size = 3;
+		ClipPolygon *src = &tmp, *dst = &result;
+		const unsigned int crossed = outcode0 | outcode1 | outcode2;
+		for (int plane = TR_CLIP_NEAR; plane < TR_CLIP_PLANE_NUM; ++plane)
 		{
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::Y, +1);
-			tmp = inside_vertices;
-
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::Y, -1);
-			tmp = inside_vertices;
+			if ((crossed & (1u << plane)) == 0)
+				continue;
+			clipingSutherlandHodgeman_aux(*src, plane, *dst);
+			if (dst->size < 3)
+				return false;
+			std::swap(src, dst);
 		}
-
-		//w=z plane & w=-z plane
+		if (src != &result)
 		{
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::Z, +1);
-			tmp = inside_vertices;
-
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::Z, -1);
-			tmp = inside_vertices;
+			std::copy(src->vertices, src->vertices + src->size, result.vertices);
+			result.size = src->size;
 		}
 
-		//w=1e-5 plane
-		{
-			inside_vertices = {};
-			int num_verts = tmp.size();
-			constexpr float w_clipping_plane = 1e-5;
-			for (int i = 0; i < num_verts; ++i)
-			{
-				const auto &beg_vert = tmp[(i - 1 + num_verts) % num_verts];
-				const auto &end_vert = tmp[i];
-				float beg_is_inside = (beg_vert.cpos.w < w_clipping_plane) ? -1 : 1;
-				float end_is_inside = (end_vert.cpos.w < w_clipping_plane) ? -1 : 1;
-				//One of them is outside
-				if (beg_is_inside * end_is_inside < 0)
-				{
-					// t = (w_clipping_plane-w1)/((w1-w2)
-					float t = (w_clipping_plane - beg_vert.cpos.w) / (beg_vert.cpos.w - end_vert.cpos.w);
-					auto intersected_vert = TRShadingPipeline::VertexData::lerp(beg_vert, end_vert, t);
-					inside_vertices.push_back(intersected_vert);
-				}
-				//If current vertices is inside
-				if (end_is_inside > 0)
-				{
-					inside_vertices.push_back(end_vert);
-				}
-			}
-		}
-		
-		return inside_vertices;
+		return true;
 	}
 
-	std::vector<TRShadingPipeline::VertexData> TRRenderer::clipingSutherlandHodgeman_aux(
-		const std::vector<TRShadingPipeline::VertexData> &polygon,
-		const int &axis,
-		const int &side) const
+	void TRRenderer::clipingSutherlandHodgeman_aux(
+		const ClipPolygon &polygon,
+		const int &plane,
+		ClipPolygon &result) const
 	{
-		std::vector<TRShadingPipeline::VertexData> inside_polygon;
+		result.size = 0;
 
-		int num_verts = polygon.size();
+		int num_verts = polygon.size;
 		for (int i = 0; i < num_verts; ++i)
 		{
-			const auto &beg_vert = polygon[(i - 1 + num_verts) % num_verts];
-			const auto &end_vert = polygon[i];
-			char beg_is_inside = ((side * (beg_vert.cpos[axis]) <= beg_vert.cpos.w) ? 1 : -1);
-			char end_is_inside = ((side * (end_vert.cpos[axis]) <= end_vert.cpos.w) ? 1 : -1);
+			const auto &beg_vert = polygon.vertices[(i - 1 + num_verts) % num_verts];
+			const auto &end_vert = polygon.vertices[i];
+			float beg_dist = calcClipDistance(beg_vert.cpos, plane);
+			float end_dist = calcClipDistance(end_vert.cpos, plane);
+			bool beg_is_inside = (beg_dist >= 0.0f);
+			bool end_is_inside = (end_dist >= 0.0f);
 			//One of them is outside
-			if (beg_is_inside * end_is_inside < 0)
+			if (beg_is_inside != end_is_inside)
 			{
-				// t = (w1 - y1)/((w1-y1)-(w2-y2))
-				float t = (beg_vert.cpos.w - side * beg_vert.cpos[axis])
-					/ ((beg_vert.cpos.w - side * beg_vert.cpos[axis]) - (end_vert.cpos.w - side * end_vert.cpos[axis]));
-				auto intersected_vert = TRShadingPipeline::VertexData::lerp(beg_vert, end_vert, t);
-				inside_polygon.push_back(intersected_vert);
+				// t = d1/(d1-d2)
+				float t = beg_dist / (beg_dist - end_dist);
+				result.vertices[result.size++] = TRShadingPipeline::VertexData::lerp(beg_vert, end_vert, t);
 			}
 			//If current vertices is inside
-			if (end_is_inside > 0)
+			if (end_is_inside)
 			{
-				inside_polygon.push_back(end_vert);
+				result.vertices[result.size++] = end_vert;
 			}
 		}
-		return inside_polygon;
 	}
 
-	bool TRRenderer::isBackFacing(const glm::ivec2 &v0, const glm::ivec2 &v1, const glm::ivec2 &v2, TRCullFaceMode mode) const
+	bool TRRenderer::isBackFacing(const glm::vec4 &v0, const glm::vec4 &v1, const glm::vec4 &v2, TRCullFaceMode mode) const
 	{
+		//Orientation of the triangle seen from the eye, valid even if it crosses the w=0 plane
+		//Refs: Olano & Greer, Triangle scan conversion using 2D homogeneous coordinates, 1997.
+		//Note: for w > 0 it has the same sign as the area in ndc space, which is counter-clockwise for the front faces.
+		float orient = glm::dot(glm::vec3(v0.x, v0.y, v0.w), glm::cross(glm::vec3(v1.x, v1.y, v1.w), glm::vec3(v2.x, v2.y, v2.w)));
+		if (orient == 0.0f)
+			return true;
+
 		if (mode == TRCullFaceMode::TR_CULL_DISABLE)
 			return false;
 
-		auto e1 = v1 - v0;
-		auto e2 = v2 - v0;
-
-		int orient = e1.x * e2.y - e1.y * e2.x;
-
-		return (mode == TRCullFaceMode::TR_CULL_BACK) ? (orient > 0) : (orient < 0);
+		return (mode == TRCullFaceMode::TR_CULL_BACK) ? (orient < 0) : (orient > 0);
 	}
 
 }
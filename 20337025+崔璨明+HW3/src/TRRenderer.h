@@ -8,8 +8,14 @@
 #include "TRDrawableMesh.h"
 #include "TRShadingState.h"
 #include "TRShadingPipeline.h"
+#include "TRThreadPool.h"
+#include "TRLightGrid.h"
+#include "TRSceneBVH.h"
+#include "TRProfiler.h"
 
 #include <mutex>
+#include <atomic>
+#include <type_traits>
 
 namespace TinyRenderer
 {
@@ -35,6 +41,35 @@ namespace TinyRenderer
 		void setShaderPipeline(TRShadingPipeline::ptr shader);
 		void setViewerPos(const glm::vec3 &viewer);
 
+		//Multi-thread rasterization setting
+		void setRasterMode(TRRasterMode mode) { m_raster_mode = mode; }
+		void setThreadNum(int num);
+		TRRasterMode getRasterMode() const { return m_raster_mode; }
+		int getThreadNum() const { return m_thread_pool->getThreadNum(); }
+
+		//Forward or deferred shading, could be changed between frames
+		void setShadingMode(TRShadingMode mode) { m_shading_mode = mode; }
+		TRShadingMode getShadingMode() const { return m_shading_mode; }
+
+		//Storage of the depth buffers, e.g. 16-bit to halve the depth traffic at high resolutions
+		//Note: the frame buffers are cleared by a change of the format. TR_DEPTH_32F_REVERSED also reverses the
+		//      depth test and the near/far clipping planes, and takes a projection matrix reversed accordingly
+		//      (see TRUtils::calcPerspProjectMatrix).
+		void setDepthFormat(TRDepthFormat format);
+		TRDepthFormat getDepthFormat() const { return m_backBuffer->getDepthFormat(); }
+
+		//Multisample anti-aliasing with 1, 4 or 8 samples per pixel: the coverage and the depth are evaluated
+		//per sample, the fragment shader still runs once per pixel of a triangle
+		//Note: the G-buffer of deferred shading holds one sample per pixel, hence deferred shading still
+		//      rasterizes one sample per pixel
+		void setSampleCount(int num_samples);
+		int getSampleCount() const { return m_backBuffer->getSampleCount(); }
+
+		//Guard band in units of the viewport size, the triangles inside it are not clipped against x/y
+		//Note: clamped to [1, the largest value keeping the triangles in the range of the rasterizer]
+		void setGuardBand(float scale);
+		float getGuardBand() const { return m_guard_band; }
+
 		int addPointLight(glm::vec3 pos, glm::vec3 atten, glm::vec3 color);
 		TRPointLight &getPointLight(const int &index);
 		
@@ -48,40 +83,177 @@ namespace TinyRenderer
 		//Draw call
 		void renderAllDrawableMeshes();
 
+		//Render the next frame directly into pixels (e.g. the locked window surface), null for the own buffer
+		//Note: set before clearColor() of every frame, since the back buffer changes with each frame. The
+		//      pixels must stay valid until the frame is presented.
+		void setColorTarget(unsigned char *pixels, int pitch, const TRPixelFormat &format);
+
 		//Commit rendered result
 		unsigned char* commitRenderedColorBuffer();
 		unsigned int getNumberOfClipFaces() const;
 		unsigned int getNumberOfCullFaces() const;
+		unsigned int getNumberOfAllocatedBytes() const;
+		unsigned int getNumberOfShadedVertices() const;
+		unsigned int getNumberOfHiZRejections() const;
+		unsigned int getNumberOfCulledInstances() const;
+		unsigned int getNumberOfCulledMeshes() const;
+		unsigned int getNumberOfCulledChunks() const;
+
+		//Stage timings and counters of the frames
+		//Note: the frames are delimited by the caller, so that the clearing and the presentation fall inside them
+		TRProfiler::ptr getProfiler() const { return m_profiler; }
 
 	private:
 
+		//Clipping planes in the homogeneous space, plane i is the bit (1 << i) of the outcodes
+		enum ClipPlane
+		{
+			TR_CLIP_LEFT = 0, TR_CLIP_RIGHT, TR_CLIP_BOTTOM, TR_CLIP_TOP, //The view frustum (trivial rejection only)
+			TR_CLIP_NEAR, TR_CLIP_FAR, TR_CLIP_W,                         //Always clipped against
+			TR_CLIP_GUARD_LEFT, TR_CLIP_GUARD_RIGHT,                      //The guard band
+			TR_CLIP_GUARD_BOTTOM, TR_CLIP_GUARD_TOP,
+			TR_CLIP_PLANE_NUM
+		};
+
+		//Polygon of the clipper on the stack
+		//Note: a convex polygon gains one vertex at most from each plane
+		static constexpr int m_max_clip_vertices = 3 + TR_CLIP_PLANE_NUM - TR_CLIP_NEAR;
+		struct ClipPolygon
+		{
+			TRShadingPipeline::VertexData vertices[m_max_clip_vertices];
+			int size = 0;
+		};
+
 		//Homogeneous space clipping - Sutherland Hodgeman algorithm
-		std::vector<TRShadingPipeline::VertexData> clipingSutherlandHodgeman(
+		//Note: return false if the triangle is totally outside
+		bool clipingSutherlandHodgeman(
 			const TRShadingPipeline::VertexData &v0,
 			const TRShadingPipeline::VertexData &v1,
-			const TRShadingPipeline::VertexData &v2) const;
+			const TRShadingPipeline::VertexData &v2,
+			ClipPolygon &result) const;
 
 		//Cliping auxiliary functions
-		std::vector<TRShadingPipeline::VertexData> clipingSutherlandHodgeman_aux(
-			const std::vector<TRShadingPipeline::VertexData> &polygon,
-			const int &axis, 
-			const int &side) const;
-		bool isPointInsideInClipingFrustum(const glm::vec4 &p) const
+		void clipingSutherlandHodgeman_aux(
+			const ClipPolygon &polygon,
+			const int &plane,
+			ClipPolygon &result) const;
+		unsigned int calcClipOutcode(const glm::vec4 &p) const;
+		float calcClipDistance(const glm::vec4 &p, const int &plane) const;
+
+		//View frustum culling of the bounding volumes in the object space
+		bool isBoundsOutsideFrustum(const TRBoundingVolume &bounds, const glm::mat4 &mvp) const;
+
+		//Depth test: less-than, or greater-than with the reversed depth
+		static bool isDepthNearer_aux(const float &depth, const float &stored, bool reversed)
 		{
-			return (p.x <= p.w && p.x >= -p.w)
-				&& (p.y <= p.w && p.y >= -p.w)
-				&& (p.z <= p.w && p.z >= -p.w)
-				&& (p.w <= m_frustum_near_far.y && p.w >= m_frustum_near_far.x);
+			return reversed ? depth > stored : depth < stored;
 		}
 
-		//Back face culling
-		bool isBackFacing(const glm::ivec2 &v0, const glm::ivec2 &v1, const glm::ivec2 &v2, TRCullFaceMode mode) const;
+		//Back face culling in the homogeneous clipping space
+		//Note: zero-area triangles are always culled
+		bool isBackFacing(const glm::vec4 &v0, const glm::vec4 &v1, const glm::vec4 &v2, TRCullFaceMode mode) const;
+
+		//A screen space triangle waiting for rasterization
+		struct RasterTriangle
+		{
+			TRShadingPipeline::VertexData v[3];
+			const TRMaterial *material;
+			const TRDrawableMesh *mesh;
+			const TRMeshInstance *instance; // Null if the mesh is not instanced
+		};
+
+		//The visible chunks of a mesh or of an instance
+		//Note: first and count select the items of the draw in m_sorted_items (not instanced meshes only)
+		struct DrawCall
+		{
+			unsigned int mesh;
+			unsigned int instance;     // TRSceneBVH::no_index if the mesh is not instanced
+			unsigned int first, count;
+			unsigned int rank;         // Traversal order of the nearest item
+			bool frontToBack;          // Otherwise drawn in the submission order
+		};
+
+		//Scene traversal and sorting of the draw calls of a frame
+		void buildDrawCalls(const glm::mat4 &view_project);
+
+		//Geometry processing of the given chunks of a mesh, instance is null if the mesh is not instanced
+		void drawMesh(
+			const TRDrawableMesh *mesh,
+			const glm::mat4 &model,
+			const TRMeshInstance *instance,
+			const std::vector<unsigned int> &visible_chunks);
+
+		//Work of the rasterizer, counted per thread
+		struct RasterCounters
+		{
+			unsigned int fragments = 0;      // Covered pixels
+			unsigned int passed = 0;         // Survivors of the depth test
+			unsigned int shaded = 0;         // Fragment or lighting shader invocations
+			unsigned int hizRejections = 0;  // 8x8 blocks rejected by the hierarchical z-buffer
+			unsigned int textureSamples = 0;
+
+			RasterCounters &operator+=(const RasterCounters &other)
+			{
+				fragments += other.fragments;
+				passed += other.passed;
+				shaded += other.shaded;
+				hizRejections += other.hizRejections;
+				textureSamples += other.textureSamples;
+				return *this;
+			}
+		};
+
+		//Rasterization, depth testing and fragment shading of a triangle inside the scissor rectangle
+		//Note: return the number of rasterized fragments and blocks rejected by the hierarchical z-buffer
+		unsigned int rasterizeTriangle(
+			TRShadingPipeline *shader,
+			const RasterTriangle &tri,
+			const glm::ivec2 &scissor_min,
+			const glm::ivec2 &scissor_max,
+			RasterCounters &counters);
+
+		//The rasterizer specialized for the shaders of Binding (see TRShaderBinding), selected per triangle
+		//by the material features out of the instances for the current pipeline
+		typedef unsigned int (TRRenderer::*RasterFunc)(
+			TRShadingPipeline *shader,
+			const RasterTriangle &tri,
+			const glm::ivec2 &scissor_min,
+			const glm::ivec2 &scissor_max,
+			RasterCounters &counters);
+		template<typename Binding>
+		unsigned int rasterizeTriangle_aux(
+			TRShadingPipeline *shader,
+			const RasterTriangle &tri,
+			const glm::ivec2 &scissor_min,
+			const glm::ivec2 &scissor_max,
+			RasterCounters &counters);
+		template<typename Pipeline, unsigned int count>
+		static void fillRasterFuncs(RasterFunc *funcs, std::integral_constant<unsigned int, count>);
+		template<typename Pipeline>
+		static void fillRasterFuncs(RasterFunc *funcs, std::integral_constant<unsigned int, 0>);
+		void bindShaderPipeline();
+
+		//Tile-binned rasterization
+		void binTriangle(const RasterTriangle &tri);
+		void rasterizeTiles();
+
+		//Lighting pass of the deferred shading
+		void shadeGBuffer();
+
+		//Note: the material of the instance replaces the coefficients of the mesh material if it overrides them
+		static void setupMaterial(TRShadingPipeline *shader, const TRMaterial &material, const TRMeshInstance *instance);
 
 	private:
 
 		//Drawable mesh array
 		std::vector<TRDrawableMesh::ptr> m_drawableMeshes;
 
+		//Spatial structure of the meshes and the draw calls of the frame
+		TRSceneBVH::ptr m_scene;
+		std::vector<unsigned int> m_visible_items;                          // In the traversal order
+		std::vector<std::pair<unsigned int, unsigned int>> m_sorted_items;  // (item, traversal order) sorted by item
+		std::vector<DrawCall> m_draw_calls;
+
 		//MVP transformation matrices
 		glm::mat4 m_viewMatrix = glm::mat4(1.0f);
 		glm::mat4 m_modelMatrix = glm::mat4(1.0f);
@@ -91,23 +263,59 @@ namespace TinyRenderer
 
 		//Near plane & far plane
 		glm::vec2 m_frustum_near_far;
+		bool m_reversed_depth = false;  // Reversed projection, for TR_DEPTH_32F_REVERSED
 
 		//Viewport transformation (ndc space -> screen space)
 		glm::mat4 m_viewportMatrix = glm::mat4(1.0f);
 
+		//Guard band clipping
+		float m_guard_band = 1.0f;
+
+		//Shading mode
+		TRShadingMode m_shading_mode = TRShadingMode::TR_SHADING_FORWARD;
+
+		//Point lights of each screen tile, rebuilt every frame
+		TRLightGrid::ptr m_light_grid;
+
 		//Shader pipeline handler
 		TRShadingPipeline::ptr m_shader_handler = nullptr;
+		const RasterFunc *m_raster_funcs = nullptr;  // Indexed by the material features
+		bool m_builtin_pipeline = false;
+
+		//Post-transform vertices of the mesh being drawn
+		std::vector<TRShadingPipeline::VertexData> m_transformed_vertices;
+		std::vector<unsigned int> m_visible_chunks;
+		std::vector<glm::uvec2> m_vertex_ranges; // Ranges of the mesh vertices used by the visible chunks
 
 		//Double buffers
 		TRFrameBuffer::ptr m_backBuffer;                      // The frame buffer that's going to be written.
 		TRFrameBuffer::ptr m_frontBuffer;                     // The frame buffer that's going to be displayed.
 
+		//Tile-binned rasterization
+		//Note: every tile is rasterized by one thread only, hence no locking on the frame buffer
+		static constexpr int m_tile_size = 32;
+		TRRasterMode m_raster_mode = TRRasterMode::TR_RASTER_IMMEDIATE;
+		int m_num_tiles_x, m_num_tiles_y;
+		TRThreadPool::ptr m_thread_pool;
+		std::vector<RasterTriangle> m_raster_triangles;
+		std::vector<std::vector<unsigned int>> m_tile_bins;   // Indices into m_raster_triangles, in submission order
+		std::vector<TRShadingPipeline::ptr> m_thread_shaders; // One shader copy per thread
+		std::vector<RasterCounters> m_thread_counters;        // Added to the profile after the parallel passes
+
 		struct Profile
 		{
 			unsigned int m_num_cliped_triangles = 0;
 			unsigned int m_num_culled_triangles = 0;
+			unsigned int m_num_allocated_bytes = 0;  // Heap memory requested by the renderer in a frame
+			unsigned int m_num_shaded_vertices = 0;  // Vertex shader invocations
+			unsigned int m_num_raster_triangles = 0; // Triangles assembled for the rasterization
+			unsigned int m_num_culled_instances = 0; // Instances outside the view frustum
+			unsigned int m_num_culled_meshes = 0;    // Meshes outside the view frustum
+			unsigned int m_num_culled_chunks = 0;    // Chunks outside the view frustum, of the meshes partially inside
+			RasterCounters m_raster_counters;        // Summed over the threads
 		};
 		Profile m_clip_cull_profile;
+		TRProfiler::ptr m_profiler;
 	};
 }
 
@@ -0,0 +1,270 @@
+#include "TRSceneBVH.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include "TRUtils.h"
+
+namespace TinyRenderer
+{
+	constexpr unsigned int TRSceneBVH::no_index;
+	constexpr unsigned int TRSceneBVH::m_leaf_size;
+	constexpr float TRSceneBVH::m_rebuild_ratio;
+
+	unsigned int TRSceneBVH::countItems(const TRDrawableMesh *mesh)
+	{
+		//Note: a mesh still loading has no chunk, hence no item
+		const auto &chunks = mesh->getChunks();
+		const auto &instances = mesh->getInstances();
+		if (chunks.empty())
+			return 0;
+		return static_cast<unsigned int>(instances.empty() ? chunks.size() : instances.size());
+	}
+
+	void TRSceneBVH::calcItems(const TRDrawableMesh *mesh, unsigned int index, unsigned int first)
+	{
+		const auto &chunks = mesh->getChunks();
+		const auto &instances = mesh->getInstances();
+		const unsigned int num_items = countItems(mesh);
+		for (unsigned int i = 0; i < num_items; ++i)
+		{
+			Item &item = m_items[first + i];
+			item.mesh = index;
+			if (instances.empty())
+			{
+				item.instance = no_index;
+				item.chunk = i;
+				transformBox(chunks[i].bounds, mesh->getModelMatrix(), item);
+			}
+			else
+			{
+				item.instance = i;
+				item.chunk = no_index;
+				transformBox(mesh->getBounds(), instances[i].modelMatrix, item);
+			}
+		}
+	}
+
+	void TRSceneBVH::transformBox(const TRBoundingVolume &bounds, const glm::mat4 &model, Item &item)
+	{
+		glm::vec3 center = glm::vec3(model * glm::vec4((bounds.boxMin + bounds.boxMax) * 0.5f, 1.0f));
+		glm::vec3 extent = (bounds.boxMax - bounds.boxMin) * 0.5f;
+		glm::vec3 world_extent(0.0f);
+		for (int c = 0; c < 3; ++c)
+		{
+			world_extent += glm::abs(glm::vec3(model[c])) * extent[c];
+		}
+		item.boxMin = center - world_extent;
+		item.boxMax = center + world_extent;
+	}
+
+	void TRSceneBVH::update(const std::vector<TRDrawableMesh::ptr> &meshes)
+	{
+		if (m_rebuild || meshes.size() != m_records.size())
+		{
+			rebuild(meshes);
+			return;
+		}
+
+		bool refit_needed = false;
+		for (size_t m = 0; m < meshes.size(); ++m)
+		{
+			const TRDrawableMesh *mesh = meshes[m].get();
+			MeshRecord &record = m_records[m];
+			if (mesh != record.mesh || countItems(mesh) != record.numItems)
+			{
+				rebuild(meshes);
+				return;
+			}
+			if (mesh->getRevision() != record.revision)
+			{
+				record.revision = mesh->getRevision();
+				calcItems(mesh, static_cast<unsigned int>(m), record.firstItem);
+				refit_needed = true;
+			}
+		}
+
+		//Refitting keeps the topology, rebuild once it has degraded too much
+		if (refit_needed && refit() > m_build_area * m_rebuild_ratio)
+		{
+			rebuild(meshes);
+		}
+	}
+
+	void TRSceneBVH::rebuild(const std::vector<TRDrawableMesh::ptr> &meshes)
+	{
+		m_rebuild = false;
+
+		m_records.resize(meshes.size());
+		unsigned int num_items = 0;
+		for (size_t m = 0; m < meshes.size(); ++m)
+		{
+			MeshRecord &record = m_records[m];
+			record.mesh = meshes[m].get();
+			record.revision = record.mesh->getRevision();
+			record.firstItem = num_items;
+			record.numItems = countItems(record.mesh);
+			num_items += record.numItems;
+		}
+
+		m_items.resize(num_items);
+		m_item_order.resize(num_items);
+		for (size_t m = 0; m < meshes.size(); ++m)
+		{
+			calcItems(m_records[m].mesh, static_cast<unsigned int>(m), m_records[m].firstItem);
+		}
+		for (unsigned int i = 0; i < num_items; ++i)
+		{
+			m_item_order[i] = i;
+		}
+
+		m_nodes.clear();
+		if (num_items > 0)
+		{
+			m_nodes.reserve(2 * (num_items / m_leaf_size) + 1);
+			buildNode(0, num_items);
+		}
+		m_build_area = refit();
+	}
+
+	unsigned int TRSceneBVH::buildNode(unsigned int begin, unsigned int end)
+	{
+		const unsigned int index = static_cast<unsigned int>(m_nodes.size());
+		m_nodes.push_back(Node());
+		if (end - begin <= m_leaf_size)
+		{
+			m_nodes[index].start = begin;
+			m_nodes[index].count = end - begin;
+			return index;
+		}
+
+		//Median split along the largest extent of the item centers
+		glm::vec3 center_min(m_items[m_item_order[begin]].boxMin + m_items[m_item_order[begin]].boxMax);
+		glm::vec3 center_max = center_min;
+		for (unsigned int i = begin + 1; i < end; ++i)
+		{
+			const Item &item = m_items[m_item_order[i]];
+			center_min = glm::min(center_min, item.boxMin + item.boxMax);
+			center_max = glm::max(center_max, item.boxMin + item.boxMax);
+		}
+		glm::vec3 extent = center_max - center_min;
+		int axis = (extent.x > extent.y) ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+		const unsigned int mid = begin + (end - begin) / 2;
+		const auto &items = m_items;
+		std::nth_element(m_item_order.begin() + begin, m_item_order.begin() + mid, m_item_order.begin() + end,
+			[&items, axis](unsigned int a, unsigned int b)
+		{
+			return items[a].boxMin[axis] + items[a].boxMax[axis] < items[b].boxMin[axis] + items[b].boxMax[axis];
+		});
+
+		buildNode(begin, mid);
+		unsigned int right = buildNode(mid, end);
+		m_nodes[index].start = right;
+		m_nodes[index].count = 0;
+		return index;
+	}
+
+	float TRSceneBVH::refit()
+	{
+		float area = 0.0f;
+		for (size_t n = m_nodes.size(); n-- > 0;)
+		{
+			Node &node = m_nodes[n];
+			if (node.count > 0)
+			{
+				node.boxMin = m_items[m_item_order[node.start]].boxMin;
+				node.boxMax = m_items[m_item_order[node.start]].boxMax;
+				for (unsigned int i = node.start + 1; i < node.start + node.count; ++i)
+				{
+					node.boxMin = glm::min(node.boxMin, m_items[m_item_order[i]].boxMin);
+					node.boxMax = glm::max(node.boxMax, m_items[m_item_order[i]].boxMax);
+				}
+			}
+			else
+			{
+				const Node &left = m_nodes[n + 1], &right = m_nodes[node.start];
+				node.boxMin = glm::min(left.boxMin, right.boxMin);
+				node.boxMax = glm::max(left.boxMax, right.boxMax);
+			}
+			glm::vec3 size = node.boxMax - node.boxMin;
+			area += size.x * size.y + size.y * size.z + size.z * size.x;
+		}
+		return area;
+	}
+
+	bool TRSceneBVH::isBoxOutside(const glm::vec4 *planes, const glm::vec3 &box_min, const glm::vec3 &box_max, unsigned int &mask)
+	{
+		for (int p = 0; p < 6; ++p)
+		{
+			if ((mask & (1u << p)) == 0)
+				continue;
+
+			//The corners farthest along and against the plane normal
+			const glm::vec3 normal(planes[p]);
+			glm::vec3 far_corner(
+				normal.x >= 0.0f ? box_max.x : box_min.x,
+				normal.y >= 0.0f ? box_max.y : box_min.y,
+				normal.z >= 0.0f ? box_max.z : box_min.z);
+			if (glm::dot(normal, far_corner) + planes[p].w < 0.0f)
+				return true;
+			glm::vec3 near_corner(
+				normal.x >= 0.0f ? box_min.x : box_max.x,
+				normal.y >= 0.0f ? box_min.y : box_max.y,
+				normal.z >= 0.0f ? box_min.z : box_max.z);
+			if (glm::dot(normal, near_corner) + planes[p].w >= 0.0f)
+				mask &= ~(1u << p);
+		}
+		return false;
+	}
+
+	void TRSceneBVH::cull(const glm::mat4 &view_project, bool reversed_depth, const glm::vec3 &viewer, std::vector<unsigned int> &visible)
+	{
+		visible.clear();
+		if (m_nodes.empty())
+			return;
+
+		//Frustum planes in the world space
+		glm::vec4 planes[6];
+		TRUtils::calcFrustumPlanes(view_project, reversed_depth, planes);
+
+		auto distanceToViewer = [&viewer](const Node &node)
+		{
+			glm::vec3 dist = (node.boxMin + node.boxMax) * 0.5f - viewer;
+			return glm::dot(dist, dist);
+		};
+
+		m_stack.clear();
+		m_stack.push_back(std::make_pair(0u, (1u << 6) - 1));
+		while (!m_stack.empty())
+		{
+			const Node &node = m_nodes[m_stack.back().first];
+			unsigned int mask = m_stack.back().second;
+			const unsigned int index = m_stack.back().first;
+			m_stack.pop_back();
+
+			//Note: the subtree totally inside the frustum is accepted without any further test
+			if (mask != 0 && isBoxOutside(planes, node.boxMin, node.boxMax, mask))
+				continue;
+
+			if (node.count > 0)
+			{
+				for (unsigned int i = node.start; i < node.start + node.count; ++i)
+				{
+					const Item &item = m_items[m_item_order[i]];
+					unsigned int item_mask = mask;
+					if (item_mask == 0 || !isBoxOutside(planes, item.boxMin, item.boxMax, item_mask))
+						visible.push_back(m_item_order[i]);
+				}
+				continue;
+			}
+
+			//The nearer child is popped first
+			unsigned int left = index + 1, right = node.start;
+			if (distanceToViewer(m_nodes[left]) < distanceToViewer(m_nodes[right]))
+				std::swap(left, right);
+			m_stack.push_back(std::make_pair(left, mask));
+			m_stack.push_back(std::make_pair(right, mask));
+		}
+	}
+}
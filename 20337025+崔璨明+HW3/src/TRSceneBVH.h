@@ -0,0 +1,103 @@
+#ifndef TRSCENEBVH_H
+#define TRSCENEBVH_H
+
+#include <vector>
+#include <memory>
+#include <utility>
+
+#include "glm/glm.hpp"
+
+#include "TRDrawableMesh.h"
+
+namespace TinyRenderer
+{
+	//Bounding volume hierarchy over the world space boxes of the scene, for hierarchical view frustum
+	//culling and a roughly front-to-back draw order
+	//Note: a mesh is inserted as one item per chunk, an instanced mesh as one item per instance (the
+	//      chunks of the instances are culled by the renderer). The hierarchy is rebuilt if the items
+	//      change, and only refitted if the transforms of the meshes change.
+	class TRSceneBVH final
+	{
+	public:
+		typedef std::shared_ptr<TRSceneBVH> ptr;
+
+		static constexpr unsigned int no_index = ~0u;
+
+		struct Item
+		{
+			glm::vec3 boxMin, boxMax; // World space
+			unsigned int mesh;        // Index into the mesh array
+			unsigned int instance;    // no_index if the mesh is not instanced
+			unsigned int chunk;       // no_index if the mesh is instanced
+		};
+
+		TRSceneBVH() = default;
+		~TRSceneBVH() = default;
+
+		//Synchronize with the mesh array, must be called before cull() every frame
+		//Note: the meshes are tracked by their revisions, a change of the array itself must be signaled
+		//      by invalidate()
+		void update(const std::vector<TRDrawableMesh::ptr> &meshes);
+		void invalidate() { m_rebuild = true; }
+
+		//Indices of the items intersecting the view frustum, the subtrees nearer to the viewer first
+		//Note: the items of the same mesh are stored consecutively, in the order of their instances or chunks.
+		//      The near and far planes are the ones of the reversed projection if reversed_depth is set.
+		void cull(const glm::mat4 &view_project, bool reversed_depth, const glm::vec3 &viewer, std::vector<unsigned int> &visible);
+
+		const Item &getItem(unsigned int index) const { return m_items[index]; }
+		size_t getNumberOfItems() const { return m_items.size(); }
+
+	private:
+		//Leaf if count > 0, with the items m_item_order[start, start + count)
+		//Note: the nodes are stored in pre-order, the left child follows its parent and start is the right one
+		struct Node
+		{
+			glm::vec3 boxMin;
+			unsigned int start;
+			glm::vec3 boxMax;
+			unsigned int count;
+		};
+
+		struct MeshRecord
+		{
+			const TRDrawableMesh *mesh;
+			unsigned int revision;
+			unsigned int firstItem, numItems;
+		};
+
+		static unsigned int countItems(const TRDrawableMesh *mesh);
+		void calcItems(const TRDrawableMesh *mesh, unsigned int index, unsigned int first);
+
+		//Axis-aligned box of the transformed bounding box
+		//Refs: Jim Arvo, Transforming Axis-Aligned Bounding Boxes, Graphics Gems, 1990.
+		static void transformBox(const TRBoundingVolume &bounds, const glm::mat4 &model, Item &item);
+
+		void rebuild(const std::vector<TRDrawableMesh::ptr> &meshes);
+		unsigned int buildNode(unsigned int begin, unsigned int end);
+
+		//Bottom-up update of the node boxes, return the summed surface area of the nodes
+		float refit();
+
+		//Test against the frustum planes of mask, the planes the box is totally inside are cleared from it
+		static bool isBoxOutside(const glm::vec4 *planes, const glm::vec3 &box_min, const glm::vec3 &box_max, unsigned int &mask);
+
+	private:
+		static constexpr unsigned int m_leaf_size = 4;
+
+		//Rebuild if the summed surface area of the nodes grows over this ratio by refitting
+		static constexpr float m_rebuild_ratio = 1.5f;
+
+		std::vector<Item> m_items;               // In the order of the meshes
+		std::vector<unsigned int> m_item_order;  // Item indices in the order of the leaves
+		std::vector<Node> m_nodes;
+		std::vector<MeshRecord> m_records;
+		float m_build_area = 0.0f;
+		bool m_rebuild = true;
+
+		//Traversal stack of (node, plane mask)
+		std::vector<std::pair<unsigned int, unsigned int>> m_stack;
+	};
+}
+
+#endif
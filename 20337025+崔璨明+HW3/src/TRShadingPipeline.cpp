@@ -1,5 +1,6 @@
 #include "TRShadingPipeline.h"
 
+#include <cstddef>
 #include <algorithm>
 #include <iostream>
 
@@ -72,186 +73,183 @@ namespace TinyRenderer
 		v.col = v.col * w;
 	}
 
+	//----------------------------------------------VaryingPlanes----------------------------------------------
+
+	void TRShadingPipeline::VaryingPlanes::setup(const VertexData &v0, const VertexData &v1, const VertexData &v2,
+		const glm::vec3 &dw_dx, const glm::vec3 &dw_dy, unsigned int varyings)
+	{
+		//Note: w0 = 1 - w1 - w2, hence a = a0 + (a1 - a0) * w1 + (a2 - a0) * w2
+		const bool perspective = (varyings & (TR_VARYING_POSITION | TR_VARYING_COLOR | TR_VARYING_NORMAL 
+			| TR_VARYING_TEXCOORD | TR_VARYING_TEXCOORD_DERIVATIVES)) != 0;
+		if (perspective)
+			calcPlane_aux(v0.pos, v1.pos, v2.pos, m_value.pos, m_d1.pos, m_d2.pos);
+		if (varyings & TR_VARYING_COLOR)
+			calcPlane_aux(v0.col, v1.col, v2.col, m_value.col, m_d1.col, m_d2.col);
+		if (varyings & TR_VARYING_NORMAL)
+			calcPlane_aux(v0.nor, v1.nor, v2.nor, m_value.nor, m_d1.nor, m_d2.nor);
+		if (varyings & (TR_VARYING_TEXCOORD | TR_VARYING_TEXCOORD_DERIVATIVES))
+			calcPlane_aux(v0.tex, v1.tex, v2.tex, m_value.tex, m_d1.tex, m_d2.tex);
+		if (varyings & TR_VARYING_CLIP_POSITION)
+			calcPlane_aux(v0.cpos, v1.cpos, v2.cpos, m_value.cpos, m_d1.cpos, m_d2.cpos);
+		if (varyings & TR_VARYING_TANGENT_SPACE)
+			m_value.TBN = v0.TBN;
+
+		//Screen space gradients of (tex / w, 1 / w)
+		if (varyings & TR_VARYING_TEXCOORD_DERIVATIVES)
+		{
+			const glm::vec3 d1(m_d1.tex, m_d1.pos.w), d2(m_d2.tex, m_d2.pos.w);
+			m_ddx = d1 * dw_dx.y + d2 * dw_dx.z;
+			m_ddy = d1 * dw_dy.y + d2 * dw_dy.z;
+		}
+	}
+
 	//----------------------------------------------TRShadingPipeline----------------------------------------------
 
 	std::vector<TRTexture2D::ptr> TRShadingPipeline::m_global_texture_units = {};
 	std::vector<TRPointLight> TRShadingPipeline::m_point_lights = {};
+	std::vector<unsigned int> TRShadingPipeline::m_all_point_lights = {};
+	TRLightGrid::ptr TRShadingPipeline::m_light_grid = nullptr;
 	//Task5
 	std::vector<TRSpotLight> TRShadingPipeline::m_spot_lights = {};
 
 	glm::vec3 TRShadingPipeline::m_viewer_pos = glm::vec3(0.0f);
-
-	void TRShadingPipeline::rasterize_wire(
-		const VertexData &v0,
-		const VertexData &v1,
-		const VertexData &v2,
-		const unsigned int &screen_width,
-		const unsigned int &screene_height,
-		std::vector<VertexData> &rasterized_points)
+	thread_local unsigned int TRShadingPipeline::m_num_texture_samples = 0;
+
+	constexpr unsigned int TRShadingPipeline::material_features;
+	constexpr unsigned int TRDefaultShadingPipeline::material_features;
+	constexpr unsigned int TRTextureShadingPipeline::material_features;
+	constexpr unsigned int TRPhongShadingPipeline::material_features;
+	constexpr int TRShadingPipeline::RasterSetup::subpixel_bits;
+	constexpr int TRShadingPipeline::RasterSetup::block_size;
+	constexpr int TRShadingPipeline::RasterSetup::max_extent;
+	constexpr int TRShadingPipeline::RasterSetup::max_samples;
+
+	int TRShadingPipeline::getSupportedSampleCount(int num_samples)
 	{
-		//Draw each line step by step
-		rasterize_wire_aux(v0, v1, screen_width, screene_height, rasterized_points);
-		rasterize_wire_aux(v1, v2, screen_width, screene_height, rasterized_points);
-		rasterize_wire_aux(v0, v2, screen_width, screene_height, rasterized_points);
+		return num_samples <= 1 ? 1 : (num_samples <= 4 ? 4 : 8);
 	}
 
-	void TRShadingPipeline::rasterize_fill_edge_function(
-		const VertexData &v0,
-		const VertexData &v1,
-		const VertexData &v2,
-		const unsigned int &screen_width,
-		const unsigned int &screene_height,
-		std::vector<VertexData> &rasterized_points)
+	const glm::ivec2 *TRShadingPipeline::getSamplePositions(int num_samples)
 	{
-		VertexData v[] = { v0, v1, v2 };
-		//Edge-equations rasterization algorithm
-		glm::ivec2 bounding_min;
-		glm::ivec2 bounding_max;
-		bounding_min.x = std::max(std::min(v0.spos.x, std::min(v1.spos.x, v2.spos.x)), 0);
-		bounding_min.y = std::max(std::min(v0.spos.y, std::min(v1.spos.y, v2.spos.y)), 0);
-		bounding_max.x = std::min(std::max(v0.spos.x, std::max(v1.spos.x, v2.spos.x)), (int)screen_width - 1);
-		bounding_max.y = std::min(std::max(v0.spos.y, std::max(v1.spos.y, v2.spos.y)), (int)screene_height - 1);
-
-		//Adjust the order
+		static const glm::ivec2 pattern1[1] = { glm::ivec2(0, 0) };
+		static const glm::ivec2 pattern4[4] = { 
+			glm::ivec2(-2, -6), glm::ivec2(6, -2), glm::ivec2(-6, 2), glm::ivec2(2, 6) };
+		static const glm::ivec2 pattern8[8] = { 
+			glm::ivec2(1, -3), glm::ivec2(-1, 3), glm::ivec2(5, 1), glm::ivec2(-3, -5),
+			glm::ivec2(-5, 5), glm::ivec2(-7, -1), glm::ivec2(3, 7), glm::ivec2(7, -7) };
+		switch (getSupportedSampleCount(num_samples))
 		{
-			auto e1 = v1.spos - v0.spos;
-			auto e2 = v2.spos - v0.spos;
-			int orient = e1.x * e2.y - e1.y * e2.x;
-			if (orient > 0)
-			{
-				std::swap(v[1], v[2]);
-			}
+			case 4: return pattern4;
+			case 8: return pattern8;
+			default: return pattern1;
 		}
+	}
 
-		//Accelerated Half-Space Triangle Rasterization
-		//Refs:Mileff P, Nehz K, Dudra J. Accelerated half-space triangle rasterization[J].
-		//     Acta Polytechnica Hungarica, 2015, 12(7): 217-236. http://acta.uni-obuda.hu/Mileff_Nehez_Dudra_63.pdf
-
-		const glm::ivec2 &A = v[0].spos;
-		const glm::ivec2 &B = v[1].spos;
-		const glm::ivec2 &C = v[2].spos;
-
-		const int I01 = A.y - B.y, I02 = B.y - C.y, I03 = C.y - A.y;
-		const int J01 = B.x - A.x, J02 = C.x - B.x, J03 = A.x - C.x;
-		const int K01 = A.x * B.y - A.y * B.x;
-		const int K02 = B.x * C.y - B.y * C.x;
-		const int K03 = C.x * A.y - C.y * A.x;
+	bool TRShadingPipeline::setupTriangle(const glm::vec2 &s0, const glm::vec2 &s1, const glm::vec2 &s2, RasterSetup &setup,
+		int num_samples)
+	{
+		const int one = 1 << RasterSetup::subpixel_bits;
+		const int half = one >> 1;
+		auto snap = [one](const glm::vec2 &p) -> glm::ivec2
+		{
+			return glm::ivec2(std::floor(p.x * one + 0.5f), std::floor(p.y * one + 0.5f));
+		};
+		auto floor_div = [](long long a, long long b) -> long long
+		{
+			return (a >= 0) ? (a / b) : -((-a + b - 1) / b);
+		};
 
-		int F01 = I01 * bounding_min.x + J01 * bounding_min.y + K01;
-		int F02 = I02 * bounding_min.x + J02 * bounding_min.y + K02;
-		int F03 = I03 * bounding_min.x + J03 * bounding_min.y + K03;
+		//Snap to the sub-pixel grid
+		glm::ivec2 P[3] = { snap(s0), snap(s1), snap(s2) };
+		long long area = static_cast<long long>(P[1].x - P[0].x) * (P[2].y - P[0].y)
+			- static_cast<long long>(P[1].y - P[0].y) * (P[2].x - P[0].x);
 
 		//Degenerated to a line or a point
-		if (F01 + F02 + F03 == 0)
-			return;
-
-		const float one_div_delta = 1.0f / (F01 + F02 + F03);
+		if (area == 0)
+			return false;
 
-		//Top left fill rule
-		int E1_t = (((B.y > A.y) || (A.y == B.y && A.x > B.x)) ? 0 : 0);
-		int E2_t = (((C.y > B.y) || (B.y == C.y && B.x > C.x)) ? 0 : 0);
-		int E3_t = (((A.y > C.y) || (C.y == A.y && C.x > A.x)) ? 0 : 0);
+		//Adjust the order
+		setup.swapped = (area < 0);
+		if (setup.swapped)
+		{
+			std::swap(P[1], P[2]);
+			area = -area;
+		}
+		setup.one_div_area = 1.0f / static_cast<float>(area);
+
+		//Sample offsets from the pixel center on the sub-pixel grid
+		setup.num_samples = getSupportedSampleCount(num_samples);
+		const glm::ivec2 *positions = getSamplePositions(setup.num_samples);
+		glm::ivec2 samples[RasterSetup::max_samples];
+		glm::ivec2 sample_min(0), sample_max(0);
+		for (int s = 0; s < setup.num_samples; ++s)
+		{
+			samples[s] = positions[s] * one / 16;
+			sample_min = glm::min(sample_min, samples[s]);
+			sample_max = glm::max(sample_max, samples[s]);
+		}
 
-		int Cy1 = F01, Cy2 = F02, Cy3 = F03;
-		for (int y = bounding_min.y; y <= bounding_max.y; ++y)
+		//Pixels whose centers (x*one+half, y*one+half), or any of their samples, are inside the bounding box
+		glm::ivec2 pmin = glm::min(P[0], glm::min(P[1], P[2]));
+		glm::ivec2 pmax = glm::max(P[0], glm::max(P[1], P[2]));
+		setup.bbox_min.x = static_cast<int>(-floor_div(-(pmin.x - half - sample_max.x), one));
+		setup.bbox_min.y = static_cast<int>(-floor_div(-(pmin.y - half - sample_max.y), one));
+		setup.bbox_max.x = static_cast<int>(floor_div(pmax.x - half - sample_min.x, one));
+		setup.bbox_max.y = static_cast<int>(floor_div(pmax.y - half - sample_min.y, one));
+		if (setup.bbox_min.x > setup.bbox_max.x || setup.bbox_min.y > setup.bbox_max.y)
+			return false;
+
+		const glm::ivec2 center(setup.bbox_min.x * one + half, setup.bbox_min.y * one + half);
+		for (int i = 0; i < 3; ++i)
 		{
-			int Cx1 = Cy1, Cx2 = Cy2, Cx3 = Cy3;
-			for (int x = bounding_min.x; x <= bounding_max.x; ++x)
+			const glm::ivec2 &a = P[(i + 1) % 3];
+			const glm::ivec2 &b = P[(i + 2) % 3];
+			int dx = b.x - a.x, dy = b.y - a.y;
+			setup.step_x[i] = -dy * one;
+			setup.step_y[i] = dx * one;
+			setup.origin[i] = static_cast<long long>(dx) * (center.y - a.y) - static_cast<long long>(dy) * (center.x - a.x);
+
+			//Top left fill rule
+			//Note: the screen space is y-down and the triangle is clockwise on screen now, so the
+			//      top edges go right horizontally and the left edges go up.
+			setup.bias[i] = ((dy < 0) || (dy == 0 && dx > 0)) ? 0 : 1;
+
+			for (int k = 0; k < RasterSetup::block_size; ++k)
 			{
-				int E1 = Cx1 + E1_t, E2 = Cx2 + E2_t, E3 = Cx3 + E3_t;
-				//Counter-clockwise winding order
-				if (E1 <= 0 && E2 <= 0 && E3 <= 0)
-				{
-					glm::vec3 uvw(Cx2 * one_div_delta, Cx3 * one_div_delta, Cx1 * one_div_delta);
-					auto rasterized_point = TRShadingPipeline::VertexData::barycentricLerp(v[0], v[1], v[2], uvw);
-					rasterized_point.spos = glm::ivec2(x, y);
-					rasterized_points.push_back(rasterized_point);
-				}
-				Cx1 += I01; Cx2 += I02; Cx3 += I03;
+				setup.lane_step[i][k] = k * setup.step_x[i];
+			}
+
+			//Note: exact, the samples lie on the sub-pixel grid
+			setup.sample_reach_min[i] = setup.sample_reach_max[i] = 0;
+			for (int s = 0; s < setup.num_samples; ++s)
+			{
+				setup.sample_step[i][s] = samples[s].x * -dy + samples[s].y * dx;
+				setup.sample_reach_min[i] = std::min(setup.sample_reach_min[i], setup.sample_step[i][s]);
+				setup.sample_reach_max[i] = std::max(setup.sample_reach_max[i], setup.sample_step[i][s]);
 			}
-			Cy1 += J01; Cy2 += J02; Cy3 += J03;
 		}
 
+		return true;
 	}
 
-	void TRShadingPipeline::rasterize_wire_aux(
-		const VertexData &from,
-		const VertexData &to,
-		const unsigned int &screen_width,
-		const unsigned int &screen_height,
-		std::vector<VertexData> &rasterized_points)
+	bool TRShadingPipeline::isRectOutsideTriangle(const RasterSetup &setup, const glm::ivec2 &rect_min, const glm::ivec2 &rect_max)
 	{
-		//Bresenham line rasterization
-
-		int dx = to.spos.x - from.spos.x;
-		int dy = to.spos.y - from.spos.y;
-		int stepX = 1, stepY = 1;
+		if (rect_max.x < setup.bbox_min.x || rect_min.x > setup.bbox_max.x ||
+			rect_max.y < setup.bbox_min.y || rect_min.y > setup.bbox_max.y)
+			return true;
 
-		// judge the sign
-		if (dx < 0)
+		//Outside of one edge at the corner maximizing it
+		for (int i = 0; i < 3; ++i)
 		{
-			stepX = -1;
-			dx = -dx;
-		}
-		if (dy < 0)
-		{
-			stepY = -1;
-			dy = -dy;
-		}
-
-		int d2x = 2 * dx, d2y = 2 * dy;
-		int d2y_minus_d2x = d2y - d2x;
-		int sx = from.spos.x;
-		int sy = from.spos.y;
-
-		// slope < 1.
-		if (dy <= dx)
-		{
-			int flag = d2y - dx;
-			for (int i = 0; i <= dx; ++i)
-			{
-				auto mid = VertexData::lerp(from, to, static_cast<float>(i) / dx);
-				mid.spos = glm::ivec2(sx, sy);
-				if (mid.spos.x >= 0 && mid.spos.x <= screen_width && mid.spos.y >= 0 && mid.spos.y <= screen_height)
-				{
-					rasterized_points.push_back(mid);
-				}
-				sx += stepX;
-				if (flag <= 0)
-				{
-					flag += d2y;
-				}
-				else
-				{
-					sy += stepY;
-					flag += d2y_minus_d2x;
-				}
-			}
-		}
-		// slope > 1.
-		else
-		{
-			int flag = d2x - dy;
-			for (int i = 0; i <= dy; ++i)
-			{
-				auto mid = VertexData::lerp(from, to, static_cast<float>(i) / dy);
-				mid.spos = glm::ivec2(sx, sy);
-				if (mid.spos.x >= 0 && mid.spos.x < screen_width && mid.spos.y >= 0 && mid.spos.y < screen_height)
-				{
-					rasterized_points.push_back(mid);
-				}
-				sy += stepY;
-				if (flag <= 0)
-				{
-					flag += d2x;
-				}
-				else
-				{
-					sx += stepX;
-					flag -= d2y_minus_d2x;
-				}
-			}
+			long long e = setup.origin[i]
+				+ static_cast<long long>(rect_min.x - setup.bbox_min.x) * setup.step_x[i]
+				+ static_cast<long long>(rect_min.y - setup.bbox_min.y) * setup.step_y[i];
+			e += std::max(static_cast<long long>(rect_max.x - rect_min.x) * setup.step_x[i], 0LL);
+			e += std::max(static_cast<long long>(rect_max.y - rect_min.y) * setup.step_y[i], 0LL);
+			if (e + setup.sample_reach_max[i] < setup.bias[i])
+				return true;
 		}
+		return false;
 	}
 
 	int TRShadingPipeline::upload_texture_2D(TRTexture2D::ptr tex)
@@ -274,6 +272,7 @@ namespace TinyRenderer
 	int TRShadingPipeline::addPointLight(glm::vec3 pos, glm::vec3 atten, glm::vec3 color)
 	{
 		m_point_lights.push_back(TRPointLight(pos, atten, color));
+		m_all_point_lights.push_back(m_point_lights.size() - 1);
 		return m_point_lights.size() - 1;
 	}
 
@@ -293,69 +292,236 @@ namespace TinyRenderer
 		return m_spot_lights[index];
 	}
 
+	void TRShadingPipeline::calcTangentSpace(VertexData &v0, VertexData &v1, VertexData &v2) const
+	{
+		calcTangentSpace(v0, v1, v2, m_tangent, m_bitangent);
+	}
+
+	void TRShadingPipeline::calcTangentSpace(VertexData &v0, VertexData &v1, VertexData &v2,
+		const glm::vec3 &tangent, const glm::vec3 &bitangent) const
+	{
+		//The tangent and bitangent are per face, only the normal differs among the vertices
+		glm::vec3 T = glm::normalize(m_inv_trans_model_matrix * tangent);
+		glm::vec3 B = glm::normalize(m_inv_trans_model_matrix * bitangent);
+		v0.TBN = glm::mat3(T, B, v0.nor);
+		v1.TBN = glm::mat3(T, B, v1.nor);
+		v2.TBN = glm::mat3(T, B, v2.nor);
+	}
+
+	void TRShadingPipeline::fetchVertex(const TRVertexStreams &streams, size_t index, VertexData &vertex)
+	{
+		vertex.pos = glm::vec4(streams.px[index], streams.py[index], streams.pz[index], 1.0f);
+		vertex.col = glm::vec3(streams.r[index], streams.g[index], streams.b[index]);
+		vertex.nor = glm::vec3(streams.nx[index], streams.ny[index], streams.nz[index]);
+		vertex.tex = glm::vec2(streams.u[index], streams.v[index]);
+	}
+
+	void TRShadingPipeline::vertexShaderBatch(const TRVertexStreams &streams, size_t begin, size_t end, VertexData *out)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			fetchVertex(streams, i, out[i]);
+			vertexShader(out[i]);
+		}
+	}
+
+	void TRShadingPipeline::surfaceShader(const VertexData &data, TRGBufferSample &sample)
+	{
+		glm::vec4 fragColor;
+		fragmentShader(data, fragColor);
+		sample.emission = fragColor;
+		sample.lighting = false;
+	}
+
+	void TRShadingPipeline::lightingShader(const TRGBufferSample &sample, 
+		const std::vector<unsigned int> &/*point_lights*/, glm::vec4 &fragColor) const
+	{
+		fragColor = sample.emission;
+	}
+
 	glm::vec4 TRShadingPipeline::texture2D(const unsigned int &id, const glm::vec2 &uv)
 	{
-		if (id < 0 || id >= m_global_texture_units.size())
+		return texture2D(id, uv, glm::vec2(0.0f), glm::vec2(0.0f));
+	}
+
+	glm::vec4 TRShadingPipeline::texture2D(const unsigned int &id, const glm::vec2 &uv, const glm::vec2 &duv_dx, const glm::vec2 &duv_dy)
+	{
+		if (id >= m_global_texture_units.size())
 			return glm::vec4(0.0f);
-		return m_global_texture_units[id]->sample(uv);
+		++m_num_texture_samples;
+		return m_global_texture_units[id]->sample(uv, duv_dx, duv_dy);
 	}
 
 
 	//----------------------------------------------TRDefaultShadingPipeline----------------------------------------------
 
-	void TRDefaultShadingPipeline::vertexShader(VertexData &vertex)
+	TRShadingPipeline::ptr TRDefaultShadingPipeline::clone() const
 	{
-		//Local space -> World space -> Camera space -> Project space
-		vertex.pos = m_model_matrix * glm::vec4(vertex.pos.x, vertex.pos.y, vertex.pos.z, 1.0f);
-		vertex.nor = glm::normalize(m_inv_trans_model_matrix * vertex.nor);
-		vertex.cpos = m_view_project_matrix * vertex.pos;
-
-		glm::vec3 T = glm::normalize(m_inv_trans_model_matrix * m_tangent);
-		glm::vec3 B = glm::normalize(m_inv_trans_model_matrix * m_bitangent);
-		vertex.TBN = glm::mat3(T, B, vertex.nor);
+		return std::make_shared<TRDefaultShadingPipeline>(*this);
 	}
 
-	void TRDefaultShadingPipeline::fragmentShader(const VertexData &data, glm::vec4 &fragColor)
+#if defined(TR_RASTER_AVX2) || defined(TR_RASTER_SSE2)
+	//Float lanes of the batched vertex shading
+	class TRFloatLanes final
 	{
-		//Just return the color.
-		fragColor = glm::vec4(data.tex, 0.0, 1.0f);
-	}
+	public:
+		typedef TRShadingPipeline::VertexData VertexData;
+#if defined(TR_RASTER_AVX2)
+		typedef __m256 type;
+		static constexpr int width = 8;
+		static type load(const float *p) { return _mm256_loadu_ps(p); }
+		static type set1(float a) { return _mm256_set1_ps(a); }
+		static type add(type a, type b) { return _mm256_add_ps(a, b); }
+		static type mul(type a, type b) { return _mm256_mul_ps(a, b); }
+		static type div(type a, type b) { return _mm256_div_ps(a, b); }
+		static type sqrt(type a) { return _mm256_sqrt_ps(a); }
+
+		//The k-th lane of (r0, r1, r2, r3) is written as 4 floats at the offset of out[k]
+		static void scatter4(type r0, type r1, type r2, type r3, VertexData *out, size_t offset)
+		{
+			scatter4_aux(_mm256_castps256_ps128(r0), _mm256_castps256_ps128(r1),
+				_mm256_castps256_ps128(r2), _mm256_castps256_ps128(r3), out, offset);
+			scatter4_aux(_mm256_extractf128_ps(r0, 1), _mm256_extractf128_ps(r1, 1),
+				_mm256_extractf128_ps(r2, 1), _mm256_extractf128_ps(r3, 1), out + 4, offset);
+		}
+#else
+		typedef __m128 type;
+		static constexpr int width = 4;
+		static type load(const float *p) { return _mm_loadu_ps(p); }
+		static type set1(float a) { return _mm_set1_ps(a); }
+		static type add(type a, type b) { return _mm_add_ps(a, b); }
+		static type mul(type a, type b) { return _mm_mul_ps(a, b); }
+		static type div(type a, type b) { return _mm_div_ps(a, b); }
+		static type sqrt(type a) { return _mm_sqrt_ps(a); }
+
+		static void scatter4(type r0, type r1, type r2, type r3, VertexData *out, size_t offset)
+		{
+			scatter4_aux(r0, r1, r2, r3, out, offset);
+		}
+#endif
 
-	//----------------------------------------------TRTextureShadingPipeline----------------------------------------------
+	private:
+		static void scatter4_aux(__m128 r0, __m128 r1, __m128 r2, __m128 r3, VertexData *out, size_t offset)
+		{
+			_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+			_mm_storeu_ps(reinterpret_cast<float*>(reinterpret_cast<char*>(out + 0) + offset), r0);
+			_mm_storeu_ps(reinterpret_cast<float*>(reinterpret_cast<char*>(out + 1) + offset), r1);
+			_mm_storeu_ps(reinterpret_cast<float*>(reinterpret_cast<char*>(out + 2) + offset), r2);
+			_mm_storeu_ps(reinterpret_cast<float*>(reinterpret_cast<char*>(out + 3) + offset), r3);
+		}
+	};
+	constexpr int TRFloatLanes::width;
+#endif
 
-	void TRTextureShadingPipeline::fragmentShader(const VertexData &data, glm::vec4 &fragColor)
+	void TRDefaultShadingPipeline::transformVertices(const TRVertexStreams &streams, size_t begin, size_t end, VertexData *out) const
 	{
-		//Default color
-		fragColor = glm::vec4(m_ke, 1.0f);
+		size_t i = begin;
+#if defined(TR_RASTER_AVX2) || defined(TR_RASTER_SSE2)
+		typedef TRFloatLanes L;
+		constexpr int width = L::width;
+
+		//Broadcast the matrices once
+		L::type model[4][4], view_project[4][4], normal[3][3];
+		for (int c = 0; c < 4; ++c)
+		{
+			for (int r = 0; r < 4; ++r)
+			{
+				model[c][r] = L::set1(m_model_matrix[c][r]);
+				view_project[c][r] = L::set1(m_view_project_matrix[c][r]);
+			}
+		}
+		for (int c = 0; c < 3; ++c)
+		{
+			for (int r = 0; r < 3; ++r)
+				normal[c][r] = L::set1(m_inv_trans_model_matrix[c][r]);
+		}
+
+		//The color, normal and texture coordinate are written as 8 consecutive floats
+		static_assert(offsetof(VertexData, nor) == offsetof(VertexData, col) + 3 * sizeof(float)
+			&& offsetof(VertexData, tex) == offsetof(VertexData, nor) + 3 * sizeof(float), "Unexpected layout of VertexData");
+
+		for (; i + width <= end; i += width)
+		{
+			const L::type x = L::load(&streams.px[i]), y = L::load(&streams.py[i]), z = L::load(&streams.pz[i]);
+			L::type world[4], clip[4];
+			for (int r = 0; r < 4; ++r)
+			{
+				//Note: the homogeneous coordinate of the local position is one
+				world[r] = L::add(
+					L::add(L::mul(model[0][r], x), L::mul(model[1][r], y)),
+					L::add(L::mul(model[2][r], z), model[3][r]));
+			}
+			for (int r = 0; r < 4; ++r)
+			{
+				clip[r] = L::add(
+					L::add(L::mul(view_project[0][r], world[0]), L::mul(view_project[1][r], world[1])),
+					L::add(L::mul(view_project[2][r], world[2]), L::mul(view_project[3][r], world[3])));
+			}
+
+			const L::type nx = L::load(&streams.nx[i]), ny = L::load(&streams.ny[i]), nz = L::load(&streams.nz[i]);
+			L::type nor[3];
+			for (int r = 0; r < 3; ++r)
+			{
+				nor[r] = L::add(L::add(L::mul(normal[0][r], nx), L::mul(normal[1][r], ny)), L::mul(normal[2][r], nz));
+			}
+			const L::type inv_len = L::div(L::set1(1.0f), L::sqrt(
+				L::add(L::add(L::mul(nor[0], nor[0]), L::mul(nor[1], nor[1])), L::mul(nor[2], nor[2]))));
+			for (int r = 0; r < 3; ++r)
+			{
+				nor[r] = L::mul(nor[r], inv_len);
+			}
 
-		if (m_diffuse_tex_id != -1)
+			//Transposed back to the vertices
+			L::scatter4(world[0], world[1], world[2], world[3], out + i, offsetof(VertexData, pos));
+			L::scatter4(clip[0], clip[1], clip[2], clip[3], out + i, offsetof(VertexData, cpos));
+			L::scatter4(L::load(&streams.r[i]), L::load(&streams.g[i]), L::load(&streams.b[i]), nor[0],
+				out + i, offsetof(VertexData, col));
+			L::scatter4(nor[1], nor[2], L::load(&streams.u[i]), L::load(&streams.v[i]),
+				out + i, offsetof(VertexData, col) + 4 * sizeof(float));
+		}
+#endif
+		//The remaining vertices one by one
+		for (; i < end; ++i)
 		{
-			fragColor = texture2D(m_diffuse_tex_id, data.tex);
+			fetchVertex(streams, i, out[i]);
+			transformVertex(out[i]);
 		}
 	}
 
+	//----------------------------------------------TRTextureShadingPipeline----------------------------------------------
+
+	TRShadingPipeline::ptr TRTextureShadingPipeline::clone() const
+	{
+		return std::make_shared<TRTextureShadingPipeline>(*this);
+	}
+
 	//----------------------------------------------TRPhongShadingPipeline----------------------------------------------
 
-	void TRPhongShadingPipeline::fragmentShader(const VertexData &data, glm::vec4 &fragColor)
+	TRShadingPipeline::ptr TRPhongShadingPipeline::clone() const
+	{
+		return std::make_shared<TRPhongShadingPipeline>(*this);
+	}
+
+	void TRPhongShadingPipeline::lightingShader(const TRGBufferSample &sample, 
+		const std::vector<unsigned int> &point_lights, glm::vec4 &fragColor) const
 	{
 		fragColor = glm::vec4(0.0f);
 
-		//Fetch the corresponding color 
-		glm::vec3 amb_color, dif_color, spe_color, glow_color;
-		amb_color = dif_color = (m_diffuse_tex_id != -1) ? glm::vec3(texture2D(m_diffuse_tex_id, data.tex)) : m_kd;
-		spe_color = (m_specular_tex_id != -1) ? glm::vec3(texture2D(m_specular_tex_id, data.tex)) : m_ks;
-		glow_color = (m_glow_tex_id != -1) ? glm::vec3(texture2D(m_glow_tex_id, data.tex)) : m_ke;
+		const glm::vec3 &amb_color = sample.albedo;
+		const glm::vec3 &dif_color = sample.albedo;
+		const glm::vec3 &spe_color = sample.specular;
+		const glm::vec3 glow_color = glm::vec3(sample.emission);
 
 		//No lighting
-		if (!m_lighting_enable)
+		if (!sample.lighting)
 		{
 			fragColor = glm::vec4(glow_color, 1.0f);
 			return;
 		}
 
 		//Calculate the lighting
-		glm::vec3 fragPos = glm::vec3(data.pos);
-		glm::vec3 normal = glm::normalize(data.nor);
+		const glm::vec3 &fragPos = sample.pos;
+		const glm::vec3 &normal = sample.nor;
 		glm::vec3 viewDir = glm::normalize(m_viewer_pos - fragPos);
 		
 
@@ -370,9 +536,10 @@ namespace TinyRenderer
 			// ۹ǿ
 			float intensity = glm::clamp((theta - light.outcutoff) / epsilon, 0.0f, 1.0f);
 
-			for (size_t i = 0; i < m_point_lights.size(); ++i)
+			//Note: only the point lights that could reach the pixel
+			for (size_t i = 0; i < point_lights.size(); ++i)
 			{
-				const auto& light = m_point_lights[i];
+				const auto& light = m_point_lights[point_lights[i]];
 				glm::vec3 lightDir = glm::normalize(light.lightPos - fragPos);
 
 				glm::vec3 ambient, diffuse, specular;
@@ -401,10 +568,12 @@ namespace TinyRenderer
 					//float R_V_n = glm::pow(glm::max(glm::dot(viewDir, reflectDir), 0.0f), m_shininess);
 					//Blinn-Phong
 					glm::vec3 halfway_dir = glm::normalize(lightDir + viewDir);
-					float spec = glm::pow(glm::max(glm::dot(normal, halfway_dir), 0.0f), m_shininess);
+					float spec = glm::pow(glm::max(glm::dot(normal, halfway_dir), 0.0f), sample.shininess);
 					// ˥
 					float des = glm::length(light.lightPos - fragPos);
 					attenuation = 1.0f / (light.attenuation.x + light.attenuation.y * des + light.attenuation.z * des * des);
+					//Vanish at the influence radius, hence exact light culling
+					attenuation *= TRLightGrid::calcInfluenceWindow(des, getPointLightRadius(point_lights[i]));
 					// 
 					ambient = light.lightColor * amb_color;
 					//ambient= glm::vec3(0, 0, 0);
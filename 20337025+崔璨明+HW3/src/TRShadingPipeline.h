@@ -1,12 +1,26 @@
 #ifndef TRSHADERPIPELINE_H
 #define TRSHADERPIPELINE_H
 
+#include <cmath>
 #include <vector>
 #include <memory>
+#include <algorithm>
 
 #include "glm/glm.hpp"
 
+//SIMD instruction set of the rasterizer, selected at compile time
+//Note: define TR_RASTER_NO_SIMD to force the scalar fallback
+#if !defined(TR_RASTER_NO_SIMD) && defined(__AVX2__)
+#define TR_RASTER_AVX2
+#include <immintrin.h>
+#elif !defined(TR_RASTER_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define TR_RASTER_SSE2
+#include <emmintrin.h>
+#endif
+
 #include "TRTexture2D.h"
+#include "TRLightGrid.h"
+#include "TRVertexStreams.h"
 
 namespace TinyRenderer
 {
@@ -23,9 +37,14 @@ namespace TinyRenderer
 			glm::vec3 nor;  //World space normal
 			glm::vec2 tex;	//World space texture coordinate
 			glm::vec4 cpos; //Clip space position
-			glm::ivec2 spos;//Screen space position
+			glm::vec2 spos; //Screen space position (sub-pixel precision, pixel centers at x+0.5)
 			glm::mat3 TBN;  //Tangent, bitangent, normal matrix
 
+			//Screen space derivatives of the texture coordinate, shared by each 2x2 pixel quad
+			//Note: only set for the fragments, not interpolated
+			glm::vec2 dtex_dx = glm::vec2(0.0f);
+			glm::vec2 dtex_dy = glm::vec2(0.0f);
+
 			//Linear interpolation
 			static VertexData lerp(const VertexData &v0, const VertexData &v1, float frac);
 			static VertexData barycentricLerp(const VertexData &v0, const VertexData &v1, const VertexData &v2, const glm::vec3 &w);
@@ -35,6 +54,100 @@ namespace TinyRenderer
 			static void aftPrespCorrection(VertexData &v);
 		};
 
+		//Attributes interpolated for the fragments
+		enum VaryingMask
+		{
+			TR_VARYING_POSITION = 1 << 0,
+			TR_VARYING_COLOR = 1 << 1,
+			TR_VARYING_NORMAL = 1 << 2,
+			TR_VARYING_TEXCOORD = 1 << 3,
+			TR_VARYING_TEXCOORD_DERIVATIVES = 1 << 4, //Implies TR_VARYING_TEXCOORD
+			TR_VARYING_CLIP_POSITION = 1 << 5,
+			TR_VARYING_TANGENT_SPACE = 1 << 6,
+			TR_VARYING_ALL = (1 << 7) - 1
+		};
+
+		//Plane equations of the attributes of a triangle, i.e. value + d1 * w1 + d2 * w2 given the
+		//barycentric weights of a fragment, and the screen space gradients for the texture derivatives
+		//Note: set up once per triangle, on the vertices after prePerspCorrection. Only the attributes
+		//      of the varying mask are evaluated for a fragment, and perspective corrected.
+		class VaryingPlanes
+		{
+		public:
+			//Note: dw_dx and dw_dy are the screen space gradients of the barycentric weights
+			void setup(const VertexData &v0, const VertexData &v1, const VertexData &v2,
+				const glm::vec3 &dw_dx, const glm::vec3 &dw_dy, unsigned int varyings);
+
+			//The attributes of the fragment of pixel (x, y) with the barycentric weights w
+			template<unsigned int varyings>
+			void interpolate(int x, int y, const glm::vec3 &w, VertexData &point) const;
+
+		private:
+			template<typename T>
+			static void calcPlane_aux(const T &a0, const T &a1, const T &a2, T &value, T &d1, T &d2)
+			{
+				value = a0;
+				d1 = a1 - a0;
+				d2 = a2 - a0;
+			}
+
+			VertexData m_value, m_d1, m_d2;
+
+			//Screen space gradients of tex / w and 1 / w
+			glm::vec3 m_ddx, m_ddy;
+		};
+
+		//Fixed-point triangle setup of the edge-function rasterizer
+		//Note: the edge function i is the one opposite to vertex i, and is positive inside the triangle.
+		//      The values are exact 32-bit integers as long as the triangle bounding box stays below
+		//      max_extent x max_extent pixels, which is guaranteed by the (guard band) clipping.
+		class RasterSetup
+		{
+		public:
+			static constexpr int subpixel_bits = 4; //Vertices are snapped to 1/16 pixel
+			static constexpr int block_size = 8;    //Pixels are traversed in 8x8 blocks
+			static constexpr int max_extent = 2048;
+			static constexpr int max_samples = 8;
+
+			glm::ivec2 bbox_min, bbox_max;          //Pixels whose centers (or samples) lie in the bounding box
+			int step_x[3], step_y[3];               //Increments of the edge functions per pixel
+			int bias[3];                            //Top-left fill rule: 0 for top/left edges, 1 otherwise
+			int lane_step[3][block_size];           //k * step_x for the k-th pixel of a block row
+			long long origin[3];                    //Edge functions at the center of pixel bbox_min
+			float one_div_area;
+			bool swapped;                           //v1 and v2 were swapped for a positive area
+
+			//Multisampling: the edge functions at the samples are the ones at the center plus sample_step
+			int num_samples;
+			int sample_step[3][max_samples];
+			int sample_reach_min[3], sample_reach_max[3]; //Range of sample_step, 0 for a single sample
+
+			int edgeAt(int i, int x, int y) const
+			{
+				return static_cast<int>(origin[i] + 
+					static_cast<long long>(x - bbox_min.x) * step_x[i] + static_cast<long long>(y - bbox_min.y) * step_y[i]);
+			}
+		};
+
+		//Material features of the current face, the built-in pipelines are specialized on them at compile time
+		//Note: with TR_FEATURE_RUNTIME, the features are read from the settings for every fragment instead
+		enum MaterialFeature
+		{
+			TR_FEATURE_DIFFUSE_MAP = 1 << 0,
+			TR_FEATURE_SPECULAR_MAP = 1 << 1,
+			TR_FEATURE_GLOW_MAP = 1 << 2,
+			TR_FEATURE_LIGHTING = 1 << 3,
+			TR_FEATURE_COMBINATIONS = 1 << 4,
+			TR_FEATURE_RUNTIME = 1 << 4
+		};
+
+		//The features the fragment shading of the pipeline depends on, none for the user-defined ones
+		static constexpr unsigned int material_features = 0;
+
+		//The attributes read by the shaders of the pipeline for the given material features, all of them
+		//for the user-defined ones (see VaryingPlanes)
+		static constexpr unsigned int varyings(unsigned int /*features*/) { return TR_VARYING_ALL; }
+
 		virtual ~TRShadingPipeline() = default;
 
 		//Vertex shader settting
@@ -48,6 +161,18 @@ namespace TinyRenderer
 		void setLightingEnable(bool enable) { m_lighting_enable = enable; }
 
 		//Fragment shader setting
+		void setMaterial(const TRMaterial &material)
+		{
+			m_ka = material.kA;
+			m_kd = material.kD;
+			m_ks = material.kS;
+			m_ke = material.kE;
+			m_shininess = material.shininess;
+			m_diffuse_tex_id = material.diffuseMapTexId;
+			m_specular_tex_id = material.specularMapTexId;
+			m_normal_tex_id = material.normalMapTexId;
+			m_glow_tex_id = material.glowMapTexId;
+		}
 		void setAmbientCoef(const glm::vec3 &ka) { m_ka = ka; }
 		void setDiffuseCoef(const glm::vec3 &kd) { m_kd = kd; }
 		void setSpecularCoef(const glm::vec3 &ks) { m_ks = ks; }
@@ -60,48 +185,156 @@ namespace TinyRenderer
 		void setTangent(const glm::vec3 &tangent) { m_tangent = tangent; }
 		void setBitangent(const glm::vec3 &bitangent) { m_bitangent = bitangent; }
 
+		//Make a copy of the pipeline (with its current settings) for another rasterization thread
+		virtual TRShadingPipeline::ptr clone() const = 0;
+
+		//Tangent space of the current face in world space, given the vertices after the vertex shader
+		void calcTangentSpace(VertexData &v0, VertexData &v1, VertexData &v2) const;
+		void calcTangentSpace(VertexData &v0, VertexData &v1, VertexData &v2,
+			const glm::vec3 &tangent, const glm::vec3 &bitangent) const;
+
+		unsigned int getMaterialFeatures() const
+		{
+			return (m_diffuse_tex_id != -1 ? static_cast<unsigned int>(TR_FEATURE_DIFFUSE_MAP) : 0u)
+				| (m_specular_tex_id != -1 ? static_cast<unsigned int>(TR_FEATURE_SPECULAR_MAP) : 0u)
+				| (m_glow_tex_id != -1 ? static_cast<unsigned int>(TR_FEATURE_GLOW_MAP) : 0u)
+				| (m_lighting_enable ? static_cast<unsigned int>(TR_FEATURE_LIGHTING) : 0u);
+		}
+
 		//Shaders
+		//Note: the vertex shader runs once per mesh vertex, before any face material is set
 		virtual void vertexShader(VertexData &vertex) = 0;
 		virtual void fragmentShader(const VertexData &data, glm::vec4 &fragColor) = 0;
 
+		//Batched vertex shading of the mesh vertices [begin, end), the i-th one is written to out[i]
+		//Note: by default the vertex shader runs on each of them, see TRDefaultShadingPipeline::transformVertices
+		virtual void vertexShaderBatch(const TRVertexStreams &streams, size_t begin, size_t end, VertexData *out);
+
+		//Attributes of the index-th vertex of the streams, as the input of the vertex shader
+		static void fetchVertex(const TRVertexStreams &streams, size_t index, VertexData &vertex);
+
+		//Deferred shading
+		//Note: the surface shader fills a G-buffer sample with the material of a fragment, and the lighting
+		//      shader shades it once per pixel. By default the fragment shader output is kept as is.
+		virtual void surfaceShader(const VertexData &data, TRGBufferSample &sample);
+		//Note: point_lights holds the indices of the point lights to be evaluated, see getPointLightsOfPixel
+		virtual void lightingShader(const TRGBufferSample &sample, 
+			const std::vector<unsigned int> &point_lights, glm::vec4 &fragColor) const;
+
 		//Rasterization
+		//Note: only the pixels inside [scissor_min, scissor_max] are generated. Instead of storing
+		//      the rasterized points, fragment(x, y, w) is called for each of them, where w holds the
+		//      barycentric weights of v0, v1 and v2, so that the caller could do the depth test first
+		//      and only interpolate the survivors.
+		template<typename FragmentFunc>
 		static void rasterize_wire(
 			const VertexData &v0,
 			const VertexData &v1,
 			const VertexData &v2,
-			const unsigned int &screen_width,
-			const unsigned int &screene_height, 
-			std::vector<VertexData> &rasterized_points);
+			const glm::ivec2 &scissor_min,
+			const glm::ivec2 &scissor_max,
+			FragmentFunc &&fragment);
+		template<typename FragmentFunc>
+		static void rasterize_fill_edge_function(
+			const VertexData &v0,
+			const VertexData &v1,
+			const VertexData &v2,
+			const glm::ivec2 &scissor_min,
+			const glm::ivec2 &scissor_max,
+			FragmentFunc &&fragment);
+
+		//Note: block_visible(block_min, block_max, w, dw_dx, dw_dy) is called for each 8x8 block touching
+		//      the triangle before its pixels are tested, where w holds the barycentric weights at block_min
+		//      and dw_dx/dw_dy the increments per pixel. The block is skipped if it returns false.
+		template<typename FragmentFunc, typename BlockFunc>
 		static void rasterize_fill_edge_function(
 			const VertexData &v0,
 			const VertexData &v1,
 			const VertexData &v2,
-			const unsigned int &screen_width,
-			const unsigned int &screene_height,
-			std::vector<VertexData> &rasterized_points);
+			const glm::ivec2 &scissor_min,
+			const glm::ivec2 &scissor_max,
+			FragmentFunc &&fragment,
+			BlockFunc &&block_visible);
+
+		//Multisampling: the coverage is evaluated at the samples of getSamplePositions(num_samples), and
+		//fragment(x, y, w, coverage) is called once for each pixel with any sample covered, where w holds
+		//the barycentric weights at the pixel center and bit s of coverage stands for the s-th sample.
+		template<typename FragmentFunc, typename BlockFunc>
+		static void rasterize_fill_multisample(
+			const VertexData &v0,
+			const VertexData &v1,
+			const VertexData &v2,
+			const glm::ivec2 &scissor_min,
+			const glm::ivec2 &scissor_max,
+			int num_samples,
+			FragmentFunc &&fragment,
+			BlockFunc &&block_visible);
+
+		//Return false if the triangle covers no pixel center (no sample with several samples per pixel)
+		static bool setupTriangle(const glm::vec2 &s0, const glm::vec2 &s1, const glm::vec2 &s2, RasterSetup &setup,
+			int num_samples = 1);
+
+		//Conservative test for the rectangle [rect_min, rect_max] of pixels being outside the triangle
+		static bool isRectOutsideTriangle(const RasterSetup &setup, const glm::ivec2 &rect_min, const glm::ivec2 &rect_max);
+
+		//Sample positions of 1, 4 or 8 samples per pixel in 1/16 pixel from the pixel center, the standard
+		//patterns of Direct3D. Any other count falls back to the next supported one.
+		static int getSupportedSampleCount(int num_samples);
+		static const glm::ivec2 *getSamplePositions(int num_samples);
 
 		//Textures and lights
 		static int upload_texture_2D(TRTexture2D::ptr tex);
 		static TRTexture2D::ptr getTexture2D(int index);
 		static int addPointLight(glm::vec3 pos, glm::vec3 atten, glm::vec3 color);
 		static TRPointLight& getPointLight(int index);
+		static const std::vector<TRPointLight> &getPointLights() { return m_point_lights; }
 		//Task5
 		static int addSpotLight(glm::vec3 pos, glm::vec3 dir, float cutOff, float outerCutOff);
 		static TRSpotLight& getSpotLight(int index);
 
 		
 		static void setViewerPos(const glm::vec3 &viewer) { m_viewer_pos = viewer; }
+
+		//Light culling
+		//Note: without a light grid, every point light is evaluated for every pixel
+		static void setLightGrid(TRLightGrid::ptr grid) { m_light_grid = grid; }
+		static const std::vector<unsigned int> &getPointLightsOfPixel(int x, int y)
+		{
+			return (m_light_grid != nullptr) ? m_light_grid->getTileLights(x, y) : m_all_point_lights;
+		}
+		static float getPointLightRadius(unsigned int index)
+		{
+			return (m_light_grid != nullptr) ? 
+				m_light_grid->getLightRadius(index) : TRLightGrid::calcInfluenceRadius(m_point_lights[index]);
+		}
 		static glm::vec4 texture2D(const unsigned int &id, const glm::vec2 &uv);
+		static glm::vec4 texture2D(const unsigned int &id, const glm::vec2 &uv, const glm::vec2 &duv_dx, const glm::vec2 &duv_dy);
+
+		//Texture samples taken by the calling thread so far, for the profiling
+		//Note: per thread to keep the counting free of contention, the difference over a task counts its samples
+		static unsigned int getNumberOfTextureSamples() { return m_num_texture_samples; }
 
 	protected:
 
+		//Whether a feature is on for the specialization of the given features
+		//Note: a constant unless the specialization is TR_FEATURE_RUNTIME
+		template<unsigned int features>
+		bool hasFeature(unsigned int feature) const
+		{
+			return (features & TR_FEATURE_RUNTIME) ? (getMaterialFeatures() & feature) != 0 : (features & feature) != 0;
+		}
+
 		//Auxiliary function
+		static unsigned int rasterize_block_row(const RasterSetup &setup, const int e[3]);
+		template<typename FragmentFunc>
 		static void rasterize_wire_aux(
-			const VertexData &begin,
-			const VertexData &end,
-			const unsigned int &screen_width,
-			const unsigned int &screene_height,
-			std::vector<VertexData> &rasterized_points);
+			const glm::ivec2 &from,
+			const glm::ivec2 &to,
+			const glm::vec3 &w_from,
+			const glm::vec3 &w_to,
+			const glm::ivec2 &scissor_min,
+			const glm::ivec2 &scissor_max,
+			FragmentFunc &fragment);
 
 		glm::mat4 m_model_matrix = glm::mat4(1.0f);
 		glm::mat3 m_inv_trans_model_matrix = glm::mat3(1.0f);
@@ -110,9 +343,12 @@ namespace TinyRenderer
 		//Global shading setttings
 		static std::vector<TRTexture2D::ptr> m_global_texture_units;
 		static std::vector<TRPointLight> m_point_lights;
+		static std::vector<unsigned int> m_all_point_lights;
+		static TRLightGrid::ptr m_light_grid;
 		//Task5
 		static std::vector<TRSpotLight> m_spot_lights;
 		static glm::vec3 m_viewer_pos;
+		static thread_local unsigned int m_num_texture_samples;
 
 		//Material setting
 		glm::vec3 m_ka = glm::vec3(0.0f);
@@ -131,17 +367,53 @@ namespace TinyRenderer
 		glm::vec3 m_bitangent;
 	};
 
+	//Note: the built-in pipelines implement their shaders as inline templates on the material features,
+	//      which the rasterizer instantiates for each combination (see TRShaderBinding). The virtual
+	//      shaders are the TR_FEATURE_RUNTIME instances of them.
 	class TRDefaultShadingPipeline : public TRShadingPipeline
 	{
 	public:
 
 		typedef std::shared_ptr<TRDefaultShadingPipeline> ptr;
 
+		static constexpr unsigned int material_features = 0;
+		static constexpr unsigned int varyings(unsigned int /*features*/) { return TR_VARYING_TEXCOORD; }
+
 		virtual ~TRDefaultShadingPipeline() = default;
 
-		virtual void vertexShader(VertexData &vertex) override;
-		virtual void fragmentShader(const VertexData &data, glm::vec4 &fragColor) override;
+		virtual TRShadingPipeline::ptr clone() const override;
 
+		virtual void vertexShader(VertexData &vertex) override { transformVertex(vertex); }
+		virtual void fragmentShader(const VertexData &data, glm::vec4 &fragColor) override
+		{
+			shadeFragment<TR_FEATURE_RUNTIME>(data, fragColor);
+		}
+
+		//Shared by all the built-in pipelines
+		void transformVertex(VertexData &vertex) const
+		{
+			//Local space -> World space -> Camera space -> Project space
+			vertex.pos = m_model_matrix * glm::vec4(vertex.pos.x, vertex.pos.y, vertex.pos.z, 1.0f);
+			vertex.nor = glm::normalize(m_inv_trans_model_matrix * vertex.nor);
+			vertex.cpos = m_view_project_matrix * vertex.pos;
+		}
+
+		//transformVertex on the vertices [begin, end) of the streams, a SIMD lane per vertex
+		//Note: the products are summed in the order of glm, hence the same results as transformVertex
+		void transformVertices(const TRVertexStreams &streams, size_t begin, size_t end, VertexData *out) const;
+
+		template<unsigned int features>
+		void shadeFragment(const VertexData &data, glm::vec4 &fragColor) const
+		{
+			//Just return the color.
+			fragColor = glm::vec4(data.tex, 0.0, 1.0f);
+		}
+		template<unsigned int features>
+		void shadeSurface(const VertexData &data, TRGBufferSample &sample) const
+		{
+			shadeFragment<features>(data, sample.emission);
+			sample.lighting = false;
+		}
 	};
 
 	class TRTextureShadingPipeline final : public TRDefaultShadingPipeline
@@ -150,9 +422,39 @@ namespace TinyRenderer
 
 		typedef std::shared_ptr<TRTextureShadingPipeline> ptr;
 
+		static constexpr unsigned int material_features = TR_FEATURE_DIFFUSE_MAP;
+		static constexpr unsigned int varyings(unsigned int features)
+		{
+			return (features & (TR_FEATURE_DIFFUSE_MAP | TR_FEATURE_RUNTIME)) != 0 ?
+				static_cast<unsigned int>(TR_VARYING_TEXCOORD_DERIVATIVES) : 0u;
+		}
+
 		virtual ~TRTextureShadingPipeline() = default;
 
-		virtual void fragmentShader(const VertexData &data, glm::vec4 &fragColor) override;
+		virtual TRShadingPipeline::ptr clone() const override;
+
+		virtual void fragmentShader(const VertexData &data, glm::vec4 &fragColor) override
+		{
+			shadeFragment<TR_FEATURE_RUNTIME>(data, fragColor);
+		}
+
+		template<unsigned int features>
+		void shadeFragment(const VertexData &data, glm::vec4 &fragColor) const
+		{
+			//Default color
+			fragColor = glm::vec4(m_ke, 1.0f);
+
+			if (hasFeature<features>(TR_FEATURE_DIFFUSE_MAP))
+			{
+				fragColor = texture2D(m_diffuse_tex_id, data.tex, data.dtex_dx, data.dtex_dy);
+			}
+		}
+		template<unsigned int features>
+		void shadeSurface(const VertexData &data, TRGBufferSample &sample) const
+		{
+			shadeFragment<features>(data, sample.emission);
+			sample.lighting = false;
+		}
 	};
 
 	class TRPhongShadingPipeline final : public TRDefaultShadingPipeline
@@ -160,13 +462,512 @@ namespace TinyRenderer
 	public:
 		typedef std::shared_ptr<TRPhongShadingPipeline> ptr;
 
+		static constexpr unsigned int material_features =
+			TR_FEATURE_DIFFUSE_MAP | TR_FEATURE_SPECULAR_MAP | TR_FEATURE_GLOW_MAP | TR_FEATURE_LIGHTING;
+		static constexpr unsigned int varyings(unsigned int features)
+		{
+			return TR_VARYING_POSITION | TR_VARYING_NORMAL 
+				| ((features & (TR_FEATURE_DIFFUSE_MAP | TR_FEATURE_SPECULAR_MAP | TR_FEATURE_GLOW_MAP | TR_FEATURE_RUNTIME)) != 0 ?
+					static_cast<unsigned int>(TR_VARYING_TEXCOORD_DERIVATIVES) : 0u);
+		}
+
 		virtual ~TRPhongShadingPipeline() = default;
 
-		virtual void fragmentShader(const VertexData &data, glm::vec4 &fragColor) override;
+		virtual TRShadingPipeline::ptr clone() const override;
+
+		virtual void fragmentShader(const VertexData &data, glm::vec4 &fragColor) override
+		{
+			shadeFragment<TR_FEATURE_RUNTIME>(data, fragColor);
+		}
+
+		virtual void surfaceShader(const VertexData &data, TRGBufferSample &sample) override
+		{
+			shadeSurface<TR_FEATURE_RUNTIME>(data, sample);
+		}
+		virtual void lightingShader(const TRGBufferSample &sample, 
+			const std::vector<unsigned int> &point_lights, glm::vec4 &fragColor) const override;
+
+		template<unsigned int features>
+		void shadeFragment(const VertexData &data, glm::vec4 &fragColor) const
+		{
+			//Forward shading is the deferred one without storing the surface
+			//Note: the qualified call is bound statically
+			TRGBufferSample sample;
+			shadeSurface<features>(data, sample);
+			TRPhongShadingPipeline::lightingShader(sample, getPointLightsOfPixel(
+				static_cast<int>(data.spos.x), static_cast<int>(data.spos.y)), fragColor);
+		}
+		template<unsigned int features>
+		void shadeSurface(const VertexData &data, TRGBufferSample &sample) const
+		{
+			//Fetch the corresponding color 
+			glm::vec3 glow_color;
+			sample.albedo = hasFeature<features>(TR_FEATURE_DIFFUSE_MAP) ? 
+				glm::vec3(texture2D(m_diffuse_tex_id, data.tex, data.dtex_dx, data.dtex_dy)) : m_kd;
+			sample.specular = hasFeature<features>(TR_FEATURE_SPECULAR_MAP) ? 
+				glm::vec3(texture2D(m_specular_tex_id, data.tex, data.dtex_dx, data.dtex_dy)) : m_ks;
+			glow_color = hasFeature<features>(TR_FEATURE_GLOW_MAP) ? 
+				glm::vec3(texture2D(m_glow_tex_id, data.tex, data.dtex_dx, data.dtex_dy)) : m_ke;
+			sample.emission = glm::vec4(glow_color, 1.0f);
+
+			sample.pos = glm::vec3(data.pos);
+			sample.nor = glm::normalize(data.nor);
+			sample.shininess = m_shininess;
+			sample.lighting = hasFeature<features>(TR_FEATURE_LIGHTING);
+		}
 
 	private:
 		void fetchFragmentColor(glm::vec3 &amb, glm::vec3 &diff, glm::vec3 &spec, const glm::vec2 &uv) const;
 	};
+
+	//Shaders of a built-in pipeline bound at compile time, for the material features of a face
+	//Note: features must be a subset of Pipeline::material_features
+	template<typename Pipeline, unsigned int features>
+	class TRShaderBinding final
+	{
+	public:
+		static constexpr unsigned int varyings = Pipeline::varyings(features);
+
+		static void fragment(TRShadingPipeline *shader, const TRShadingPipeline::VertexData &data, glm::vec4 &fragColor)
+		{
+			static_cast<const Pipeline*>(shader)->template shadeFragment<features>(data, fragColor);
+		}
+		static void surface(TRShadingPipeline *shader, const TRShadingPipeline::VertexData &data, TRGBufferSample &sample)
+		{
+			static_cast<const Pipeline*>(shader)->template shadeSurface<features>(data, sample);
+		}
+	};
+
+	//The user-defined pipelines are called through the virtual shaders
+	template<unsigned int features>
+	class TRShaderBinding<TRShadingPipeline, features> final
+	{
+	public:
+		static constexpr unsigned int varyings = TRShadingPipeline::TR_VARYING_ALL;
+
+		static void fragment(TRShadingPipeline *shader, const TRShadingPipeline::VertexData &data, glm::vec4 &fragColor)
+		{
+			shader->fragmentShader(data, fragColor);
+		}
+		static void surface(TRShadingPipeline *shader, const TRShadingPipeline::VertexData &data, TRGBufferSample &sample)
+		{
+			shader->surfaceShader(data, sample);
+		}
+	};
+
+	template<typename Pipeline, unsigned int features>
+	constexpr unsigned int TRShaderBinding<Pipeline, features>::varyings;
+	template<unsigned int features>
+	constexpr unsigned int TRShaderBinding<TRShadingPipeline, features>::varyings;
+
+	//----------------------------------------------Interpolation----------------------------------------------
+
+	template<unsigned int varyings>
+	inline void TRShadingPipeline::VaryingPlanes::interpolate(int x, int y, const glm::vec3 &w, VertexData &point) const
+	{
+		//Perspective correction: the planes of the world space attributes are the ones of the attributes
+		//divided by w, pos.w holds 1/w
+		constexpr unsigned int perspective = TR_VARYING_POSITION | TR_VARYING_COLOR | TR_VARYING_NORMAL
+			| TR_VARYING_TEXCOORD | TR_VARYING_TEXCOORD_DERIVATIVES;
+		float one_div_w = 1.0f, persp_w = 1.0f;
+		if (varyings & perspective)
+		{
+			one_div_w = m_value.pos.w + m_d1.pos.w * w.y + m_d2.pos.w * w.z;
+			persp_w = 1.0f / one_div_w;
+		}
+
+		if (varyings & TR_VARYING_POSITION)
+		{
+			glm::vec3 pos = glm::vec3(m_value.pos) + glm::vec3(m_d1.pos) * w.y + glm::vec3(m_d2.pos) * w.z;
+			point.pos = glm::vec4(pos * persp_w, one_div_w);
+		}
+		if (varyings & TR_VARYING_COLOR)
+		{
+			point.col = (m_value.col + m_d1.col * w.y + m_d2.col * w.z) * persp_w;
+		}
+		if (varyings & TR_VARYING_NORMAL)
+		{
+			point.nor = (m_value.nor + m_d1.nor * w.y + m_d2.nor * w.z) * persp_w;
+		}
+		glm::vec2 tex_div_w;
+		if (varyings & (TR_VARYING_TEXCOORD | TR_VARYING_TEXCOORD_DERIVATIVES))
+		{
+			tex_div_w = m_value.tex + m_d1.tex * w.y + m_d2.tex * w.z;
+			point.tex = tex_div_w * persp_w;
+		}
+		if (varyings & TR_VARYING_CLIP_POSITION)
+		{
+			point.cpos = m_value.cpos + m_d1.cpos * w.y + m_d2.cpos * w.z;
+		}
+		if (varyings & TR_VARYING_TANGENT_SPACE)
+		{
+			point.TBN = m_value.TBN;
+		}
+
+		//Texture coordinate derivatives by finite differences in the 2x2 quad of the pixel
+		//Note: like the helper pixels of a GPU, the planes are extrapolated out of the triangle
+		if (varyings & TR_VARYING_TEXCOORD_DERIVATIVES)
+		{
+			const glm::vec3 plane00 = glm::vec3(tex_div_w, one_div_w)
+				- static_cast<float>(x & 1) * m_ddx - static_cast<float>(y & 1) * m_ddy;
+			const glm::vec3 plane10 = plane00 + m_ddx, plane01 = plane00 + m_ddy;
+			const glm::vec2 tex00 = glm::vec2(plane00) / plane00.z;
+			point.dtex_dx = glm::vec2(plane10) / plane10.z - tex00;
+			point.dtex_dy = glm::vec2(plane01) / plane01.z - tex00;
+		}
+	}
+
+	//----------------------------------------------Rasterization----------------------------------------------
+
+	template<typename FragmentFunc>
+	void TRShadingPipeline::rasterize_wire(
+		const VertexData &v0,
+		const VertexData &v1,
+		const VertexData &v2,
+		const glm::ivec2 &scissor_min,
+		const glm::ivec2 &scissor_max,
+		FragmentFunc &&fragment)
+	{
+		//Draw each line step by step
+		const glm::ivec2 p0(glm::floor(v0.spos)), p1(glm::floor(v1.spos)), p2(glm::floor(v2.spos));
+		const glm::vec3 w0(1.0f, 0.0f, 0.0f), w1(0.0f, 1.0f, 0.0f), w2(0.0f, 0.0f, 1.0f);
+		rasterize_wire_aux(p0, p1, w0, w1, scissor_min, scissor_max, fragment);
+		rasterize_wire_aux(p1, p2, w1, w2, scissor_min, scissor_max, fragment);
+		rasterize_wire_aux(p0, p2, w0, w2, scissor_min, scissor_max, fragment);
+	}
+
+	inline unsigned int TRShadingPipeline::rasterize_block_row(const RasterSetup &setup, const int e[3])
+	{
+		//Coverage mask of 8 consecutive pixels, e holds the edge functions of the first one
+#if defined(TR_RASTER_AVX2)
+		__m256i inside = _mm256_set1_epi32(-1);
+		for (int i = 0; i < 3; ++i)
+		{
+			__m256i lane = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(setup.lane_step[i]));
+			__m256i edge = _mm256_add_epi32(_mm256_set1_epi32(e[i]), lane);
+			inside = _mm256_and_si256(inside, _mm256_cmpgt_epi32(edge, _mm256_set1_epi32(setup.bias[i] - 1)));
+		}
+		return static_cast<unsigned int>(_mm256_movemask_ps(_mm256_castsi256_ps(inside)));
+#elif defined(TR_RASTER_SSE2)
+		__m128i inside_lo = _mm_set1_epi32(-1);
+		__m128i inside_hi = _mm_set1_epi32(-1);
+		for (int i = 0; i < 3; ++i)
+		{
+			__m128i base = _mm_set1_epi32(e[i]);
+			__m128i threshold = _mm_set1_epi32(setup.bias[i] - 1);
+			__m128i lane_lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(setup.lane_step[i]));
+			__m128i lane_hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(setup.lane_step[i] + 4));
+			inside_lo = _mm_and_si128(inside_lo, _mm_cmpgt_epi32(_mm_add_epi32(base, lane_lo), threshold));
+			inside_hi = _mm_and_si128(inside_hi, _mm_cmpgt_epi32(_mm_add_epi32(base, lane_hi), threshold));
+		}
+		return static_cast<unsigned int>(_mm_movemask_ps(_mm_castsi128_ps(inside_lo)))
+			| (static_cast<unsigned int>(_mm_movemask_ps(_mm_castsi128_ps(inside_hi))) << 4);
+#else
+		unsigned int mask = 0;
+		for (int k = 0; k < RasterSetup::block_size; ++k)
+		{
+			if (e[0] + setup.lane_step[0][k] >= setup.bias[0] &&
+				e[1] + setup.lane_step[1][k] >= setup.bias[1] &&
+				e[2] + setup.lane_step[2][k] >= setup.bias[2])
+			{
+				mask |= (1u << k);
+			}
+		}
+		return mask;
+#endif
+	}
+
+	template<typename FragmentFunc>
+	void TRShadingPipeline::rasterize_fill_edge_function(
+		const VertexData &v0,
+		const VertexData &v1,
+		const VertexData &v2,
+		const glm::ivec2 &scissor_min,
+		const glm::ivec2 &scissor_max,
+		FragmentFunc &&fragment)
+	{
+		auto all_visible = [](const glm::ivec2 &, const glm::ivec2 &, const glm::vec3 &, const glm::vec3 &, const glm::vec3 &)
+		{
+			return true;
+		};
+		rasterize_fill_edge_function(v0, v1, v2, scissor_min, scissor_max, fragment, all_visible);
+	}
+
+	template<typename FragmentFunc, typename BlockFunc>
+	void TRShadingPipeline::rasterize_fill_edge_function(
+		const VertexData &v0,
+		const VertexData &v1,
+		const VertexData &v2,
+		const glm::ivec2 &scissor_min,
+		const glm::ivec2 &scissor_max,
+		FragmentFunc &&fragment,
+		BlockFunc &&block_visible)
+	{
+		//Edge-equations rasterization algorithm
+		//Refs: Fabian Giesen, Optimizing the basic rasterizer, 2013.
+		//      https://fgiesen.wordpress.com/2013/02/10/optimizing-the-basic-rasterizer/
+		RasterSetup setup;
+		if (!setupTriangle(v0.spos, v1.spos, v2.spos, setup))
+			return;
+
+		//Note: the bounding box is clamped to the scissor rectangle (the whole screen or a tile)
+		const glm::ivec2 bounding_min = glm::max(setup.bbox_min, scissor_min);
+		const glm::ivec2 bounding_max = glm::min(setup.bbox_max, scissor_max);
+		if (bounding_min.x > bounding_max.x || bounding_min.y > bounding_max.y)
+			return;
+
+		const int block = RasterSetup::block_size;
+
+		//Barycentric weights in the order of v0, v1, v2 from the edge functions
+		auto weights = [&](float e0, float e1, float e2) -> glm::vec3
+		{
+			return setup.swapped ?
+				glm::vec3(e0, e2, e1) * setup.one_div_area : 
+				glm::vec3(e0, e1, e2) * setup.one_div_area;
+		};
+		const glm::vec3 dw_dx = weights(setup.step_x[0], setup.step_x[1], setup.step_x[2]);
+		const glm::vec3 dw_dy = weights(setup.step_y[0], setup.step_y[1], setup.step_y[2]);
+
+		//Hierarchical traversal: classify each 8x8 block with the edge functions at its corners
+		//as outside, fully inside or partially covered, then only test the pixels of the last ones
+		//Note: the blocks are aligned to multiples of 8 pixels (the tiles of the hierarchical z-buffer)
+		const int start_x = (bounding_min.x / block) * block;
+		const int start_y = (bounding_min.y / block) * block;
+		for (int by = start_y; by <= bounding_max.y; by += block)
+		{
+			const int y0 = std::max(by, bounding_min.y);
+			const int y1 = std::min(by + block - 1, bounding_max.y);
+			for (int bx = start_x; bx <= bounding_max.x; bx += block)
+			{
+				const int x0 = std::max(bx, bounding_min.x);
+				const int x1 = std::min(bx + block - 1, bounding_max.x);
+
+				int e[3];
+				bool outside = false, inside = true;
+				for (int i = 0; i < 3; ++i)
+				{
+					e[i] = setup.edgeAt(i, x0, y0);
+					int cx = (x1 - x0) * setup.step_x[i], cy = (y1 - y0) * setup.step_y[i];
+					int e_max = e[i] + std::max(cx, 0) + std::max(cy, 0);
+					int e_min = e[i] + std::min(cx, 0) + std::min(cy, 0);
+					outside = outside || (e_max < setup.bias[i]);
+					inside = inside && (e_min >= setup.bias[i]);
+				}
+				if (outside)
+					continue;
+
+				//Block level test of the caller, e.g. the hierarchical depth test
+				if (!block_visible(glm::ivec2(x0, y0), glm::ivec2(x1, y1), weights(e[0], e[1], e[2]), dw_dx, dw_dy))
+					continue;
+
+				const unsigned int columns = (1u << (x1 - x0 + 1)) - 1;
+				for (int y = y0; y <= y1; ++y)
+				{
+					//Coverage mask of the row
+					unsigned int mask = inside ? columns : (rasterize_block_row(setup, e) & columns);
+					for (int k = 0; mask != 0; ++k, mask >>= 1)
+					{
+						if (mask & 1u)
+						{
+							fragment(x0 + k, y, weights(
+								e[0] + setup.lane_step[0][k],
+								e[1] + setup.lane_step[1][k],
+								e[2] + setup.lane_step[2][k]));
+						}
+					}
+					e[0] += setup.step_y[0]; e[1] += setup.step_y[1]; e[2] += setup.step_y[2];
+				}
+			}
+		}
+	}
+
+	template<typename FragmentFunc, typename BlockFunc>
+	void TRShadingPipeline::rasterize_fill_multisample(
+		const VertexData &v0,
+		const VertexData &v1,
+		const VertexData &v2,
+		const glm::ivec2 &scissor_min,
+		const glm::ivec2 &scissor_max,
+		int num_samples,
+		FragmentFunc &&fragment,
+		BlockFunc &&block_visible)
+	{
+		//Same traversal as rasterize_fill_edge_function, with the coverage of each sample instead of the center
+		RasterSetup setup;
+		if (!setupTriangle(v0.spos, v1.spos, v2.spos, setup, num_samples))
+			return;
+		num_samples = setup.num_samples;
+
+		const glm::ivec2 bounding_min = glm::max(setup.bbox_min, scissor_min);
+		const glm::ivec2 bounding_max = glm::min(setup.bbox_max, scissor_max);
+		if (bounding_min.x > bounding_max.x || bounding_min.y > bounding_max.y)
+			return;
+
+		const int block = RasterSetup::block_size;
+		const unsigned int all_samples = (1u << num_samples) - 1;
+
+		auto weights = [&](float e0, float e1, float e2) -> glm::vec3
+		{
+			return setup.swapped ?
+				glm::vec3(e0, e2, e1) * setup.one_div_area : 
+				glm::vec3(e0, e1, e2) * setup.one_div_area;
+		};
+		const glm::vec3 dw_dx = weights(setup.step_x[0], setup.step_x[1], setup.step_x[2]);
+		const glm::vec3 dw_dy = weights(setup.step_y[0], setup.step_y[1], setup.step_y[2]);
+
+		const int start_x = (bounding_min.x / block) * block;
+		const int start_y = (bounding_min.y / block) * block;
+		for (int by = start_y; by <= bounding_max.y; by += block)
+		{
+			const int y0 = std::max(by, bounding_min.y);
+			const int y1 = std::min(by + block - 1, bounding_max.y);
+			for (int bx = start_x; bx <= bounding_max.x; bx += block)
+			{
+				const int x0 = std::max(bx, bounding_min.x);
+				const int x1 = std::min(bx + block - 1, bounding_max.x);
+
+				//Note: a block is classified by the samples farthest from the centers
+				int e[3];
+				bool outside = false, inside = true;
+				for (int i = 0; i < 3; ++i)
+				{
+					e[i] = setup.edgeAt(i, x0, y0);
+					int cx = (x1 - x0) * setup.step_x[i], cy = (y1 - y0) * setup.step_y[i];
+					int e_max = e[i] + std::max(cx, 0) + std::max(cy, 0) + setup.sample_reach_max[i];
+					int e_min = e[i] + std::min(cx, 0) + std::min(cy, 0) + setup.sample_reach_min[i];
+					outside = outside || (e_max < setup.bias[i]);
+					inside = inside && (e_min >= setup.bias[i]);
+				}
+				if (outside)
+					continue;
+
+				if (!block_visible(glm::ivec2(x0, y0), glm::ivec2(x1, y1), weights(e[0], e[1], e[2]), dw_dx, dw_dy))
+					continue;
+
+				const unsigned int columns = (1u << (x1 - x0 + 1)) - 1;
+				for (int y = y0; y <= y1; ++y)
+				{
+					//Coverage masks of the row, one per sample
+					unsigned int sample_masks[RasterSetup::max_samples];
+					unsigned int mask = columns;
+					if (!inside)
+					{
+						mask = 0;
+						for (int s = 0; s < num_samples; ++s)
+						{
+							const int e_sample[3] = { 
+								e[0] + setup.sample_step[0][s],
+								e[1] + setup.sample_step[1][s],
+								e[2] + setup.sample_step[2][s] };
+							sample_masks[s] = rasterize_block_row(setup, e_sample) & columns;
+							mask |= sample_masks[s];
+						}
+					}
+					for (int k = 0; mask != 0; ++k, mask >>= 1)
+					{
+						if (mask & 1u)
+						{
+							unsigned int coverage = all_samples;
+							if (!inside)
+							{
+								coverage = 0;
+								for (int s = 0; s < num_samples; ++s)
+								{
+									coverage |= ((sample_masks[s] >> k) & 1u) << s;
+								}
+							}
+							fragment(x0 + k, y, weights(
+								e[0] + setup.lane_step[0][k],
+								e[1] + setup.lane_step[1][k],
+								e[2] + setup.lane_step[2][k]), coverage);
+						}
+					}
+					e[0] += setup.step_y[0]; e[1] += setup.step_y[1]; e[2] += setup.step_y[2];
+				}
+			}
+		}
+	}
+
+	template<typename FragmentFunc>
+	void TRShadingPipeline::rasterize_wire_aux(
+		const glm::ivec2 &from,
+		const glm::ivec2 &to,
+		const glm::vec3 &w_from,
+		const glm::vec3 &w_to,
+		const glm::ivec2 &scissor_min,
+		const glm::ivec2 &scissor_max,
+		FragmentFunc &fragment)
+	{
+		//Bresenham line rasterization
+
+		int dx = to.x - from.x;
+		int dy = to.y - from.y;
+		int stepX = 1, stepY = 1;
+
+		// judge the sign
+		if (dx < 0)
+		{
+			stepX = -1;
+			dx = -dx;
+		}
+		if (dy < 0)
+		{
+			stepY = -1;
+			dy = -dy;
+		}
+
+		int d2x = 2 * dx, d2y = 2 * dy;
+		int d2y_minus_d2x = d2y - d2x;
+		int sx = from.x;
+		int sy = from.y;
+
+		// slope < 1.
+		if (dy <= dx)
+		{
+			int flag = d2y - dx;
+			for (int i = 0; i <= dx; ++i)
+			{
+				float frac = (dx == 0) ? 0.0f : static_cast<float>(i) / dx;
+				if (sx >= scissor_min.x && sx <= scissor_max.x && sy >= scissor_min.y && sy <= scissor_max.y)
+				{
+					fragment(sx, sy, (1.0f - frac) * w_from + frac * w_to);
+				}
+				sx += stepX;
+				if (flag <= 0)
+				{
+					flag += d2y;
+				}
+				else
+				{
+					sy += stepY;
+					flag += d2y_minus_d2x;
+				}
+			}
+		}
+		// slope > 1.
+		else
+		{
+			int flag = d2x - dy;
+			for (int i = 0; i <= dy; ++i)
+			{
+				float frac = static_cast<float>(i) / dy;
+				if (sx >= scissor_min.x && sx <= scissor_max.x && sy >= scissor_min.y && sy <= scissor_max.y)
+				{
+					fragment(sx, sy, (1.0f - frac) * w_from + frac * w_to);
+				}
+				sy += stepY;
+				if (flag <= 0)
+				{
+					flag += d2x;
+				}
+				else
+				{
+					sx += stepX;
+					flag -= d2y_minus_d2x;
+				}
+			}
+		}
+	}
 }
 
 #endif
\ No newline at end of file
@@ -15,8 +15,10 @@ namespace TinyRenderer
 	//Texture filtering mode
 	enum TRTextureFilterMode
 	{
-		TR_NEAREST,
-		TR_LINEAR
+		TR_NEAREST,     //Nearest texel of the base level
+		TR_LINEAR,      //Bilinear filtering of the base level
+		TR_TRILINEAR,   //Bilinear filtering of the two nearest mipmap levels, blended by the level of detail
+		TR_ANISOTROPIC  //Several trilinear samples along the major axis of the pixel footprint
 	};
 
 	//Polygon mode
@@ -52,6 +54,67 @@ namespace TinyRenderer
 		TR_LIGHTING_ENABLE
 	};
 
+	//Rasterization mode
+	enum TRRasterMode
+	{
+		TR_RASTER_IMMEDIATE,  //Rasterize each triangle right after its vertices are processed
+		TR_RASTER_TILE_BINNED //Bin triangles into screen tiles and rasterize the tiles in parallel
+	};
+
+	//Shading mode
+	enum TRShadingMode
+	{
+		TR_SHADING_FORWARD,   //Shade each fragment passing the depth test
+		TR_SHADING_DEFERRED   //Write the surfaces into the G-buffer, then shade each pixel once
+	};
+
+	//Storage of the depth buffer
+	enum TRDepthFormat
+	{
+		TR_DEPTH_32F,         //32-bit float
+		TR_DEPTH_24,          //24-bit unsigned normalized, in the low bits of 32-bit words
+		TR_DEPTH_16,          //16-bit unsigned normalized, half the bandwidth of the others
+		TR_DEPTH_32F_REVERSED //32-bit float of a reversed projection, i.e. near at 1 and far at 0, cleared to 0 and
+		                      //greater for the nearer. Most of the float precision goes to the far distances.
+	};
+
+	//A pixel of the G-buffer
+	class TRGBufferSample
+	{
+	public:
+		glm::vec3 pos;        //World space position
+		glm::vec3 nor;        //World space normal (normalized)
+		glm::vec3 albedo;     //Ambient & diffuse color
+		glm::vec3 specular;   //Specular color
+		glm::vec4 emission;   //Glow color, or the final color of the fragments without lighting
+		float shininess = 0.0f;
+		bool lighting = false;
+		bool covered = false; //False for the pixels without any fragment
+	};
+
+	//Surface material, the texture ids are the units uploaded to the shading pipeline (-1 for none)
+	class TRMaterial
+	{
+	public:
+		glm::vec3 kA = glm::vec3(0.0f);//Ambient coefficient
+		glm::vec3 kD = glm::vec3(1.0f);//Diffuse coefficient
+		glm::vec3 kS = glm::vec3(0.0f);//Specular coefficient
+		glm::vec3 kE = glm::vec3(0.0f);//Emission
+		float shininess = 1.0f;		   //Specular highlight exponment
+		int diffuseMapTexId = -1;
+		int specularMapTexId = -1;
+		int normalMapTexId = -1;
+		int glowMapTexId = -1;
+
+		bool operator==(const TRMaterial &other) const
+		{
+			return kA == other.kA && kD == other.kD && kS == other.kS && kE == other.kE
+				&& shininess == other.shininess
+				&& diffuseMapTexId == other.diffuseMapTexId && specularMapTexId == other.specularMapTexId
+				&& normalMapTexId == other.normalMapTexId && glowMapTexId == other.glowMapTexId;
+		}
+	};
+
 	//Point lights
 	class TRPointLight
 	{
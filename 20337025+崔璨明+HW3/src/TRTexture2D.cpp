@@ -3,6 +3,8 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#include <cmath>
+#include <chrono>
 #include <iostream>
 
 namespace TinyRenderer
@@ -10,9 +12,10 @@ namespace TinyRenderer
 	//----------------------------------------------TRTexture2D----------------------------------------------
 
 	TRTexture2D::TRTexture2D() :
-		m_width(0), m_height(0), m_channel(0), m_pixels(nullptr),
+		m_width(0), m_height(0), m_channel(0),
 		m_warp_mode(TRTextureWarpMode::TR_REPEAT),
-		m_filtering_mode(TRTextureFilterMode::TR_LINEAR) {}
+		m_filtering_mode(TRTextureFilterMode::TR_LINEAR),
+		m_max_anisotropy(8) {}
 
 	TRTexture2D::~TRTexture2D() { freeLoadedImage(); }
 
@@ -32,82 +35,130 @@ namespace TinyRenderer
 
 		//Load image from given file using stb_image.h
 		//Refs: https://github.com/nothings/stb
+		//Note: the texels are always expanded to RGBA8, m_channel keeps the number of channels in the file
+		unsigned char *pixels = nullptr;
 		{
 			stbi_set_flip_vertically_on_load(true);
-			m_pixels = stbi_load(filepath.c_str(), &m_width, &m_height, &m_channel, 0);
+			pixels = stbi_load(filepath.c_str(), &m_width, &m_height, &m_channel, 4);
 		}
 
-		if (m_pixels == nullptr)
+		if (pixels == nullptr)
 		{
 			std::cerr << "Failed to load image from " << filepath << std::endl;
 			exit(1);
 		}
 
+		m_levels.resize(1);
+		MipLevel &base = m_levels[0];
+		base.resize(m_width, m_height);
+		for (int y = 0; y < m_height; ++y)
+		{
+			for (int x = 0; x < m_width; ++x)
+			{
+				const unsigned char *p = pixels + (y * m_width + x) * 4;
+				base.texels[base.index(x, y)] = p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<unsigned int>(p[3]) << 24);
+			}
+		}
+		stbi_image_free(pixels);
+
+		generateMipmaps();
+
 		return true;
 	}
 
-	void TRTexture2D::readPixel(int u, int v, unsigned char &r, unsigned char &g, unsigned char &b, unsigned char &a) const
+	void TRTexture2D::MipLevel::resize(int w, int h)
 	{
-		//Handling out of range situation
-		{
-			if (u < 0 || u >= m_width)
-			{
-				switch (m_warp_mode)
-				{
-				case TRTextureWarpMode::TR_REPEAT:
-					u = u > 0 ? (u % m_width) : (m_width - 1 + u % m_width);
-					break;
-				case TRTextureWarpMode::TR_CLAMP_TO_EDGE:
-					u = (u < 0) ? 0 : m_width - 1;
-					break;
-				default:
-					u = (u < 0) ? 0 : m_width - 1;
-					break;
-				}
-			}
+		width = w;
+		height = h;
+		mask_x = ((w & (w - 1)) == 0) ? w - 1 : -1;
+		mask_y = ((h & (h - 1)) == 0) ? h - 1 : -1;
+		blocks_x = (w + m_block_mask) >> m_block_bits;
+		int blocks_y = (h + m_block_mask) >> m_block_bits;
+		texels.assign(blocks_x * blocks_y << (2 * m_block_bits), 0u);
+	}
 
-			if (v < 0 || v >= m_height)
+	void TRTexture2D::generateMipmaps()
+	{
+		//Each level is the 2x2 box filtered version of the previous one, down to 1x1
+		//Note: for odd sizes the last row/column of texels is covered by a 3-tap box instead, so that every
+		//      texel of the previous level contributes
+		while (m_levels.back().width > 1 || m_levels.back().height > 1)
+		{
+			const MipLevel &src = m_levels.back();
+			MipLevel dst;
+			dst.resize(std::max(src.width / 2, 1), std::max(src.height / 2, 1));
+			for (int y = 0; y < dst.height; ++y)
 			{
-				switch (m_warp_mode)
+				int num_y = (src.height == 1) ? 1 : ((src.height & 1) != 0 && y == dst.height - 1) ? 3 : 2;
+				for (int x = 0; x < dst.width; ++x)
 				{
-				case TRTextureWarpMode::TR_REPEAT:
-					v = v > 0 ? (v % m_height) : (m_height - 1 + v % m_height);
-					break;
-				case TRTextureWarpMode::TR_CLAMP_TO_EDGE:
-					v = (v < 0) ? 0 : m_height - 1;
-					break;
-				default:
-					v = (v < 0) ? 0 : m_height - 1;
-					break;
+					int num_x = (src.width == 1) ? 1 : ((src.width & 1) != 0 && x == dst.width - 1) ? 3 : 2;
+					unsigned int sum[4] = { 0, 0, 0, 0 };
+					for (int ty = 2 * y; ty < 2 * y + num_y; ++ty)
+					{
+						for (int tx = 2 * x; tx < 2 * x + num_x; ++tx)
+						{
+							unsigned int t = readPixel(src, tx, ty);
+							for (int c = 0; c < 4; ++c)
+							{
+								sum[c] += (t >> (8 * c)) & 0xff;
+							}
+						}
+					}
+					const unsigned int num_taps = num_x * num_y;
+					unsigned int texel = 0;
+					for (int c = 0; c < 4; ++c)
+					{
+						texel |= ((sum[c] + num_taps / 2) / num_taps) << (8 * c);
+					}
+					dst.texels[dst.index(x, y)] = texel;
 				}
 			}
+			m_levels.push_back(std::move(dst));
 		}
-
-		int index = (v * m_height + u) * m_channel;
-		r = m_pixels[index + 0];
-		g = m_pixels[index + 1];
-		b = m_pixels[index + 2];
-		a = (m_channel >= 4) ? m_pixels[index + 3] : a;
-
-		return;
 	}
 
-	void TRTexture2D::freeLoadedImage()
+	int TRTexture2D::wrapCoord(int c, int size, int mask) const
 	{
-		if (m_pixels != nullptr)
+		//Handling out of range situation
+		if (static_cast<unsigned int>(c) < static_cast<unsigned int>(size))
+			return c;
+
+		switch (m_warp_mode)
 		{
-			stbi_image_free(m_pixels);
+		case TRTextureWarpMode::TR_REPEAT:
+			//Note: the mask also wraps negative values in two's complement
+			return (mask >= 0) ? (c & mask) : (c % size + size) % size;
+		case TRTextureWarpMode::TR_CLAMP_TO_EDGE:
+		default:
+			return (c < 0) ? 0 : size - 1;
 		}
+	}
 
-		m_pixels = nullptr;
+	glm::vec4 TRTexture2D::unpackTexel(unsigned int texel)
+	{
+		return glm::vec4(texel & 0xff, (texel >> 8) & 0xff, (texel >> 16) & 0xff, texel >> 24);
+	}
+
+	void TRTexture2D::freeLoadedImage()
+	{
+		m_levels.clear();
 		m_width = m_height = m_channel = 0;
 	}
 
 	glm::vec4 TRTexture2D::sample(const glm::vec2 &uv) const
+	{
+		return sample(uv, glm::vec2(0.0f), glm::vec2(0.0f));
+	}
+
+	glm::vec4 TRTexture2D::sample(const glm::vec2 &uv, const glm::vec2 &duv_dx, const glm::vec2 &duv_dy) const
 	{
 		//Perform sampling procedure
 		//Note: return texel that ranges from 0.0f to 1.0f instead of [0,255]
 		glm::vec4 texel(1.0f);
+		if (m_levels.empty())
+			return texel;
+
 		switch (m_filtering_mode)
 		{
 		case TRTextureFilterMode::TR_NEAREST:
@@ -116,6 +167,13 @@ namespace TinyRenderer
 		case TRTextureFilterMode::TR_LINEAR:
 			texel = TRTexture2DSampler::textureSampling_bilinear(*this, uv);
 			break;
+		case TRTextureFilterMode::TR_TRILINEAR:
+			texel = TRTexture2DSampler::textureSampling_trilinear(*this, uv,
+				TRTexture2DSampler::calcLevelOfDetail(*this, duv_dx, duv_dy));
+			break;
+		case TRTextureFilterMode::TR_ANISOTROPIC:
+			texel = TRTexture2DSampler::textureSampling_anisotropic(*this, uv, duv_dx, duv_dy);
+			break;
 		default:
 			break;
 		}
@@ -125,60 +183,158 @@ namespace TinyRenderer
 
 	//----------------------------------------------TRTexture2DSampler----------------------------------------------
 
-	glm::vec4 TRTexture2DSampler::textureSampling_nearest(const TRTexture2D &texture, glm::vec2 uv)
+	glm::vec4 TRTexture2DSampler::textureSampling_nearest(const TRTexture2D &texture, glm::vec2 uv, int level)
 	{
-		unsigned char r = 255, g = 255, b = 255, a = 255;
+		unsigned int texel = 0xffffffff;
 
 		//Task1: Implement nearest sampling algorithm for texture sampling
 		// Note: You should use texture.readPixel() to read the pixel, and for instance, 
-		//       use texture.readPixel(25,35,r,g,b,a) to read the pixel in (25, 35).
+		//       use texture.readPixel(mip,25,35) to read the pixel in (25, 35).
 		//       But before that, you need to map uv from [0,1]*[0,1] to [0,width-1]*[0,height-1].
 		{
-			float x = uv.x * texture.m_width;
-			float y = uv.y * texture.m_height;
-			//ķڽ
-			texture.readPixel((int)std::floorf(x + 0.5), (int)std::floorf(y + 0.5), r, g, b, a);
+			//Note: the texel (i, j) covers [i, i+1]*[j, j+1] in texel space
+			const auto &mip = texture.m_levels[level];
+			int x = texture.wrapCoord(static_cast<int>(std::floor(uv.x * mip.width)), mip.width, mip.mask_x);
+			int y = texture.wrapCoord(static_cast<int>(std::floor(uv.y * mip.height)), mip.height, mip.mask_y);
+			texel = texture.readPixel(mip, x, y);
 		}
 
 		constexpr float denom = 1.0f / 255.0f;
-		return glm::vec4(r, g, b, a) * denom;
+		return TRTexture2D::unpackTexel(texel) * denom;
 	}
 
-	glm::vec4 TRTexture2DSampler::textureSampling_bilinear(const TRTexture2D &texture, glm::vec2 uv)
+	glm::vec4 TRTexture2DSampler::textureSampling_bilinear(const TRTexture2D &texture, glm::vec2 uv, int level)
 	{
-		//Note: Delete this line when you try to implement Task 4. 
-		//return textureSampling_nearest(texture, uv);
+		//Task4: Implement bilinear sampling algorithm for texture sampling
+		// Note: You should use texture.readPixel() to read the pixel, and for instance, 
+		//       use texture.readPixel(mip,25,35) to read the pixel in (25, 35).
+
+		//Note: the texel centers lie at (i+0.5, j+0.5) in texel space
+		const auto &mip = texture.m_levels[level];
+		float x = uv.x * mip.width - 0.5f;
+		float y = uv.y * mip.height - 0.5f;
+		int ix = static_cast<int>(std::floor(x));
+		int iy = static_cast<int>(std::floor(y));
+		float fx = x - ix;
+		float fy = y - iy;
+		int x1 = texture.wrapCoord(ix, mip.width, mip.mask_x);
+		int y1 = texture.wrapCoord(iy, mip.height, mip.mask_y);
+		int x2 = texture.wrapCoord(ix + 1, mip.width, mip.mask_x);
+		int y2 = texture.wrapCoord(iy + 1, mip.height, mip.mask_y);
+
+		glm::vec4 q11 = TRTexture2D::unpackTexel(texture.readPixel(mip, x1, y1));
+		glm::vec4 q12 = TRTexture2D::unpackTexel(texture.readPixel(mip, x1, y2));
+		glm::vec4 q21 = TRTexture2D::unpackTexel(texture.readPixel(mip, x2, y1));
+		glm::vec4 q22 = TRTexture2D::unpackTexel(texture.readPixel(mip, x2, y2));
 
+		constexpr float denom = 1.0f / 255.0f;
+		glm::vec4 re
+			= ((1.0f - fx) * (1.0f - fy) * q11
+			+ fx * (1.0f - fy) * q21
+			+ (1.0f - fx) * fy * q12
+			+ fx * fy * q22);
+		return re * denom;
+	}
 
-		unsigned char r = 255, g = 255, b = 255, a = 255;
+	glm::vec4 TRTexture2DSampler::textureSampling_trilinear(const TRTexture2D &texture, glm::vec2 uv, float lod)
+	{
+		//Magnification
+		if (lod <= 0.0f)
+			return textureSampling_bilinear(texture, uv, 0);
+
+		int max_level = texture.getNumLevels() - 1;
+		if (lod >= max_level)
+			return textureSampling_bilinear(texture, uv, max_level);
+
+		//Blend the two nearest levels
+		int level = static_cast<int>(lod);
+		float frac = lod - level;
+		return glm::mix(
+			textureSampling_bilinear(texture, uv, level),
+			textureSampling_bilinear(texture, uv, level + 1), frac);
+	}
 
-		float x = uv.x * texture.m_width;
-		float y = uv.y * texture.m_height;
-		int x1 = (int)std::floorf(x);
-		int x2 = (int)std::floorf(x + 1);
-		int y1 = (int)std::floorf(y);
-		int y2 = (int)std::floorf(y + 1);
+	glm::vec4 TRTexture2DSampler::textureSampling_anisotropic(const TRTexture2D &texture, glm::vec2 uv, glm::vec2 duv_dx, glm::vec2 duv_dy)
+	{
+		//Footprint of the pixel in texel space
+		//Refs: EXT_texture_filter_anisotropic
+		glm::vec2 size(texture.m_width, texture.m_height);
+		float len_x = glm::length(duv_dx * size);
+		float len_y = glm::length(duv_dy * size);
+		float major = std::max(len_x, len_y);
+		float minor = std::min(len_x, len_y);
+		//Note: written so that NaN derivatives fall back to trilinear filtering
+		if (!(major > 1.0f) || !(minor > 0.0f))
+			return textureSampling_trilinear(texture, uv, calcLevelOfDetail(texture, duv_dx, duv_dy));
+
+		//Several trilinear probes along the major axis, each with the footprint shrinked accordingly
+		int num_probes = static_cast<int>(std::min(std::ceil(major / minor), static_cast<float>(texture.m_max_anisotropy)));
+		float lod = std::log2(major / num_probes);
+		glm::vec2 axis = (len_x > len_y) ? duv_dx : duv_dy;
+		glm::vec4 texel(0.0f);
+		for (int i = 0; i < num_probes; ++i)
+		{
+			float t = (i + 0.5f) / num_probes - 0.5f;
+			texel += textureSampling_trilinear(texture, uv + t * axis, lod);
+		}
+		return texel / static_cast<float>(num_probes);
+	}
 
-		texture.readPixel(x1, y1, r, g, b, a);
-		texture.readPixel(x1, y2, r, g, b, a);
-		texture.readPixel(x2, y1, r, g, b, a);
-		texture.readPixel(x2, y2, r, g, b, a);
+	float TRTexture2DSampler::calcLevelOfDetail(const TRTexture2D &texture, const glm::vec2 &duv_dx, const glm::vec2 &duv_dy)
+	{
+		//Refs: OpenGL 4.6 specification, 8.14.1 Scale Factor and Level of Detail
+		glm::vec2 size(texture.m_width, texture.m_height);
+		glm::vec2 dx = duv_dx * size, dy = duv_dy * size;
+		float rho2 = std::max(glm::dot(dx, dx), glm::dot(dy, dy));
+		if (!(rho2 > 0.0f))
+			return 0.0f;
+		return 0.5f * std::log2(rho2);
+	}
 
-		glm::vec4 q11 = glm::vec4(r, g, b, a);
-		glm::vec4 q12 = glm::vec4(r, g, b, a);
-		glm::vec4 q21 = glm::vec4(r, g, b, a);
-		glm::vec4 q22 = glm::vec4(r, g, b, a);
+	void TRTexture2DSampler::benchmark(TRTexture2D &texture, int num_samples, float footprint)
+	{
+		const TRTextureFilterMode modes[] = { TR_NEAREST, TR_LINEAR, TR_TRILINEAR, TR_ANISOTROPIC };
+		const char *names[] = { "nearest", "bilinear", "trilinear", "anisotropic" };
+		const TRTextureFilterMode original = texture.m_filtering_mode;
+
+		//Access patterns: random uv, and a scanline walk over a plane rotated by 90 degrees in
+		//texture space, which steps along v inside a row of pixels (the worst case of row major texels)
+		const char *patterns[] = { "random", "rotated scan" };
+		const int scan_width = 512;
+		glm::vec2 duv_dx(0.0f, 2.0f * footprint / texture.m_height);
+		glm::vec2 duv_dy(footprint / texture.m_width, 0.0f);
+		for (int p = 0; p < 2; ++p)
+		{
+			for (int m = 0; m < 4; ++m)
+			{
+				texture.setFilteringMode(modes[m]);
 
-		constexpr float denom = 1.0f / 255.0f;
-		glm::vec4 re
-			= ((x2 - x) * (y2 - y) * q11
-			+ (x - x1) * (y2 - y) * q21
-			+ (x2 - x) * (y - y1) * q12
-			+ (x - x1) * (y - y1) * q22);
-		return re * denom;
+				//Pseudo random uv, the checksum keeps the samples from being optimized out
+				unsigned int seed = 12345u;
+				glm::vec4 checksum(0.0f);
+				auto beg = std::chrono::steady_clock::now();
+				for (int i = 0; i < num_samples; ++i)
+				{
+					glm::vec2 uv;
+					if (p == 0)
+					{
+						seed = seed * 1664525u + 1013904223u;
+						uv = glm::vec2((seed >> 16) / 65536.0f, (seed & 0xffff) / 65536.0f);
+					}
+					else
+					{
+						int x = i % scan_width, y = i / scan_width;
+						uv = (x + 0.5f) * duv_dx + (y + 0.5f) * duv_dy;
+					}
+					checksum += texture.sample(uv, duv_dx, duv_dy);
+				}
+				auto end = std::chrono::steady_clock::now();
+				double seconds = std::chrono::duration<double>(end - beg).count();
+				std::cout << patterns[p] << ", " << names[m] << ": " << (num_samples / seconds) / 1e6 << " M samples/s"
+					<< " (checksum " << checksum.x + checksum.y + checksum.z + checksum.w << ")" << std::endl;
+			}
+		}
 
-		//Task4: Implement bilinear sampling algorithm for texture sampling
-		// Note: You should use texture.readPixel() to read the pixel, and for instance, 
-		//       use texture.readPixel(25,35,r,g,b,a) to read the pixel in (25, 35).
+		texture.setFilteringMode(original);
 	}
 }
\ No newline at end of file
@@ -2,7 +2,9 @@
 #define TRTEXTURE_2D_H
 
 #include <string>
+#include <vector>
 #include <memory>
+#include <algorithm>
 
 #include "glm/glm.hpp"
 
@@ -21,30 +23,60 @@ namespace TinyRenderer
 		//Sampling options setting
 		void setWarpingMode(TRTextureWarpMode mode);
 		void setFilteringMode(TRTextureFilterMode mode);
+		void setMaxAnisotropy(int num) { m_max_anisotropy = std::max(num, 1); }
 
 		int getWidth() const { return m_width; }
 		int getHeight() const { return m_height; }
 		int getChannel() const { return m_channel; }
+		int getNumLevels() const { return static_cast<int>(m_levels.size()); }
 
 		bool loadTextureFromFile(
 			const std::string &filepath,
 			TRTextureWarpMode warpMode = TRTextureWarpMode::TR_REPEAT,
-			TRTextureFilterMode filterMode = TRTextureFilterMode::TR_LINEAR);
+			TRTextureFilterMode filterMode = TRTextureFilterMode::TR_TRILINEAR);
 
 		//Sampling according to the given uv coordinate
+		//Note: without the screen space derivatives of uv, the base level is always used
 		glm::vec4 sample(const glm::vec2 &uv) const;
+		glm::vec4 sample(const glm::vec2 &uv, const glm::vec2 &duv_dx, const glm::vec2 &duv_dy) const;
 
 	private:
+		//A level of the mipmap chain
+		//Note: texels are packed RGBA8 (r in the lowest byte) and swizzled in 8x8 blocks of 256 bytes,
+		//      so that the neighbours in both u and v are close in memory
+		struct MipLevel
+		{
+			int width, height;
+			int mask_x, mask_y;               // size - 1 for power-of-two sizes, otherwise -1
+			int blocks_x;                     // Number of blocks in a row
+			std::vector<unsigned int> texels; // Blocks in row major, texels in row major inside a block
+
+			void resize(int w, int h);
+			int index(int u, int v) const
+			{
+				return ((((v >> m_block_bits) * blocks_x + (u >> m_block_bits)) << (2 * m_block_bits))
+					| ((v & m_block_mask) << m_block_bits) | (u & m_block_mask));
+			}
+		};
+		static constexpr int m_block_bits = 3;
+		static constexpr int m_block_mask = (1 << m_block_bits) - 1;
+
 		//Auxiliary functions
-		void readPixel(int u, int v, unsigned char &r, unsigned char &g, unsigned char &b, unsigned char &a) const;
+		//Note: readPixel takes coordinates already wrapped by wrapCoord
+		int wrapCoord(int c, int size, int mask) const;
+		unsigned int readPixel(const MipLevel &mip, int u, int v) const { return mip.texels[mip.index(u, v)]; }
+		static glm::vec4 unpackTexel(unsigned int texel);
+		void generateMipmaps();
 		void freeLoadedImage();
 
 	private:
+
 		int m_width, m_height, m_channel;
-		unsigned char *m_pixels;
+		std::vector<MipLevel> m_levels;
 
 		TRTextureWarpMode m_warp_mode;
 		TRTextureFilterMode m_filtering_mode;
+		int m_max_anisotropy;
 
 		friend class TRTexture2DSampler;
 	};
@@ -54,8 +86,17 @@ namespace TinyRenderer
 	public:
 
 		//Sampling algorithm
-		static glm::vec4 textureSampling_nearest(const TRTexture2D &texture, glm::vec2 uv);
-		static glm::vec4 textureSampling_bilinear(const TRTexture2D &texture, glm::vec2 uv);
+		static glm::vec4 textureSampling_nearest(const TRTexture2D &texture, glm::vec2 uv, int level = 0);
+		static glm::vec4 textureSampling_bilinear(const TRTexture2D &texture, glm::vec2 uv, int level = 0);
+		static glm::vec4 textureSampling_trilinear(const TRTexture2D &texture, glm::vec2 uv, float lod);
+		static glm::vec4 textureSampling_anisotropic(const TRTexture2D &texture, glm::vec2 uv, glm::vec2 duv_dx, glm::vec2 duv_dy);
+
+		//Level of detail from the screen space derivatives of uv
+		static float calcLevelOfDetail(const TRTexture2D &texture, const glm::vec2 &duv_dx, const glm::vec2 &duv_dy);
+
+		//Microbenchmark: print the samples per second of each filtering mode
+		//Note: the pixel footprint covers footprint texels, stretched twice along the screen x axis
+		static void benchmark(TRTexture2D &texture, int num_samples, float footprint = 1.0f);
 	};
 }
 
@@ -0,0 +1,96 @@
+#include "TRThreadPool.h"
+
+namespace TinyRenderer
+{
+	TRThreadPool::TRThreadPool(int num_threads)
+		: m_next_task(0)
+	{
+		for (int i = 1; i < num_threads; ++i)
+		{
+			m_workers.push_back(std::thread(&TRThreadPool::workerLoop, this, i));
+		}
+	}
+
+	TRThreadPool::~TRThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_start_cond.notify_all();
+		for (auto &worker : m_workers)
+		{
+			worker.join();
+		}
+	}
+
+	void TRThreadPool::parallelFor(int count, const std::function<void(int, int)> &task)
+	{
+		if (count <= 0)
+			return;
+
+		//Single thread: no synchronization needed
+		if (m_workers.empty())
+		{
+			for (int i = 0; i < count; ++i)
+			{
+				task(i, 0);
+			}
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_task = &task;
+			m_task_count = count;
+			m_next_task = 0;
+			m_num_running = static_cast<int>(m_workers.size());
+			++m_generation;
+		}
+		m_start_cond.notify_all();
+
+		//The calling thread works as thread 0
+		runTasks(0);
+
+		//Wait for the workers
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_finish_cond.wait(lock, [this]() { return m_num_running == 0; });
+			m_task = nullptr;
+			m_task_count = 0;
+		}
+	}
+
+	void TRThreadPool::workerLoop(int thread_id)
+	{
+		unsigned int generation = 0;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_start_cond.wait(lock, [&]() { return m_stop || m_generation != generation; });
+				if (m_stop)
+					return;
+				generation = m_generation;
+			}
+
+			runTasks(thread_id);
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				--m_num_running;
+			}
+			m_finish_cond.notify_one();
+		}
+	}
+
+	void TRThreadPool::runTasks(int thread_id)
+	{
+		//Tasks are fetched dynamically for load balancing
+		int index;
+		while ((index = m_next_task.fetch_add(1)) < m_task_count)
+		{
+			(*m_task)(index, thread_id);
+		}
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef TRTHREADPOOL_H
+#define TRTHREADPOOL_H
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+namespace TinyRenderer
+{
+	class TRThreadPool final
+	{
+	public:
+		typedef std::shared_ptr<TRThreadPool> ptr;
+
+		//Note: the calling thread always takes part in the work, so num_threads = 1 spawns no worker
+		TRThreadPool(int num_threads);
+		~TRThreadPool();
+
+		TRThreadPool(const TRThreadPool&) = delete;
+		TRThreadPool& operator=(const TRThreadPool&) = delete;
+
+		int getThreadNum() const { return static_cast<int>(m_workers.size()) + 1; }
+
+		//Run task(index, thread_id) for every index in [0, count) and block until all of them finish.
+		//thread_id lies in [0, getThreadNum()) and could be used to address per-thread resources.
+		void parallelFor(int count, const std::function<void(int, int)> &task);
+
+	private:
+		void workerLoop(int thread_id);
+		void runTasks(int thread_id);
+
+	private:
+		std::vector<std::thread> m_workers;
+
+		std::mutex m_mutex;
+		std::condition_variable m_start_cond;
+		std::condition_variable m_finish_cond;
+
+		//Current job
+		const std::function<void(int, int)> *m_task = nullptr;
+		int m_task_count = 0;
+		std::atomic<int> m_next_task;
+		int m_num_running = 0;
+		unsigned int m_generation = 0;
+		bool m_stop = false;
+	};
+}
+
+#endif
@@ -36,7 +36,7 @@ namespace TinyRenderer
 		return vMat;
 	}
 
-	glm::mat4 TRUtils::calcPerspProjectMatrix(float fovy, float aspect, float near, float far)
+	glm::mat4 TRUtils::calcPerspProjectMatrix(float fovy, float aspect, float near, float far, bool reversed)
 	{
 		//Setup perspective matrix (camera space -> homogeneous space)
 		glm::mat4 pMat = glm::mat4(1.0f);
@@ -49,6 +49,13 @@ namespace TinyRenderer
 		pMat[2][0] = 0.0f;						  pMat[2][1] = 0.0f;			    pMat[2][2] = -(far + near) / f_n;	pMat[2][3] = -1.0f;
 		pMat[3][0] = 0.0f;						  pMat[3][1] = 0.0f;				pMat[3][2] = -2.0f*near*far / f_n;	pMat[3][3] = 0.0f;
 
+		//Reversed: z/w goes from 1 at the near plane down to 0 at the far plane
+		if (reversed)
+		{
+			pMat[2][2] = near / f_n;
+			pMat[3][2] = near*far / f_n;
+		}
+
 		return pMat;
 	}
 
@@ -62,4 +69,19 @@ namespace TinyRenderer
 		pMat[3][0] = 0.0f;                  pMat[3][1] = 0.0f;                  pMat[3][2] = -(far + near) / (far - near); pMat[3][3] = 1.0f;
 		return pMat;
 	}
+
+	void TRUtils::calcFrustumPlanes(const glm::mat4 &project, bool reversed, glm::vec4 planes[6])
+	{
+		const glm::vec4 row0(project[0][0], project[1][0], project[2][0], project[3][0]);
+		const glm::vec4 row1(project[0][1], project[1][1], project[2][1], project[3][1]);
+		const glm::vec4 row2(project[0][2], project[1][2], project[2][2], project[3][2]);
+		const glm::vec4 row3(project[0][3], project[1][3], project[2][3], project[3][3]);
+		planes[0] = row3 + row0;
+		planes[1] = row3 - row0;
+		planes[2] = row3 + row1;
+		planes[3] = row3 - row1;
+		//Note: -w <= z <= w, or 0 <= z <= w for the reversed projection
+		planes[4] = reversed ? row3 - row2 : row3 + row2;
+		planes[5] = reversed ? row2 : row3 - row2;
+	}
 }
\ No newline at end of file
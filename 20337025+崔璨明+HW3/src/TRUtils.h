@@ -12,9 +12,15 @@ namespace TinyRenderer
 		//Transformation functions
 		static glm::mat4 calcViewPortMatrix(int width, int height);
 		static glm::mat4 calcViewMatrix(glm::vec3 camera, glm::vec3 target, glm::vec3 worldUp);
-		static glm::mat4 calcPerspProjectMatrix(float fovy, float aspect, float near, float far);
+		//Note: the reversed projection maps near to 1 and far to 0 instead of -1 and 1, for TR_DEPTH_32F_REVERSED
+		static glm::mat4 calcPerspProjectMatrix(float fovy, float aspect, float near, float far, bool reversed = false);
 		static glm::mat4 calcOrthoProjectMatrix(float left, float right, float bottom, float top, float near, float far);
 
+		//Frustum planes (left, right, bottom, top, near, far) extracted from the rows of a projection matrix,
+		//the inside of each plane being positive
+		//Refs: Gribb & Hartmann, Fast Extraction of Viewing Frustum Planes from the World-View-Projection Matrix
+		static void calcFrustumPlanes(const glm::mat4 &project, bool reversed, glm::vec4 planes[6]);
+
 	};
 }
 
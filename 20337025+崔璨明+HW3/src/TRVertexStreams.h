@@ -0,0 +1,83 @@
+#ifndef TRVERTEXSTREAMS_H
+#define TRVERTEXSTREAMS_H
+
+#include <new>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+
+namespace TinyRenderer
+{
+	//Allocator of the memory aligned to alignment bytes (a power of two)
+	//Note: the address returned by malloc is stored right before the aligned block
+	template<typename T, size_t alignment>
+	class TRAlignedAllocator
+	{
+	public:
+		typedef T value_type;
+
+		template<typename U>
+		struct rebind { typedef TRAlignedAllocator<U, alignment> other; };
+
+		TRAlignedAllocator() = default;
+		template<typename U>
+		TRAlignedAllocator(const TRAlignedAllocator<U, alignment>&) {}
+
+		T *allocate(size_t n)
+		{
+			void *raw = std::malloc(n * sizeof(T) + alignment + sizeof(void*));
+			if (raw == nullptr)
+				throw std::bad_alloc();
+			std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(raw) + sizeof(void*);
+			addr = (addr + alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1);
+			reinterpret_cast<void**>(addr)[-1] = raw;
+			return reinterpret_cast<T*>(addr);
+		}
+		void deallocate(T *ptr, size_t)
+		{
+			if (ptr != nullptr)
+				std::free(reinterpret_cast<void**>(ptr)[-1]);
+		}
+
+		template<typename U>
+		bool operator==(const TRAlignedAllocator<U, alignment>&) const { return true; }
+		template<typename U>
+		bool operator!=(const TRAlignedAllocator<U, alignment>&) const { return false; }
+	};
+
+	//Structure-of-arrays copy of the mesh vertices for the batched vertex shading
+	//Note: indexed like the mesh vertices, each attribute component is a separate stream
+	class TRVertexStreams final
+	{
+	public:
+		static constexpr size_t alignment = 32;
+		typedef std::vector<float, TRAlignedAllocator<float, alignment>> Stream;
+
+		Stream px, py, pz; // Local space position
+		Stream r, g, b;    // Color
+		Stream nx, ny, nz; // Local space normal
+		Stream u, v;       // Texture coordinate
+
+		size_t size() const { return px.size(); }
+
+		void resize(size_t count)
+		{
+			Stream *streams[] = { &px, &py, &pz, &r, &g, &b, &nx, &ny, &nz, &u, &v };
+			for (auto stream : streams)
+			{
+				stream->resize(count);
+			}
+		}
+
+		void clear()
+		{
+			Stream *streams[] = { &px, &py, &pz, &r, &g, &b, &nx, &ny, &nz, &u, &v };
+			for (auto stream : streams)
+			{
+				Stream().swap(*stream);
+			}
+		}
+	};
+}
+
+#endif
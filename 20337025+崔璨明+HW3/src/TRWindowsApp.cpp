@@ -40,15 +40,35 @@ namespace TinyRenderer
 			return false;
 		}
 
-		//Get window surface
-		m_screen_surface = SDL_GetWindowSurface(m_window_handle);
+		//Create the screen texture
+		//Note: ARGB8888 is the native texture format of most renderers, so uploading it needs no conversion
+		m_renderer_handle = SDL_CreateRenderer(m_window_handle, -1, 0);
+		if (m_renderer_handle == nullptr)
+		{
+			std::cerr << "Renderer could not be created! SDL_Error: " << SDL_GetError() << std::endl;
+			return false;
+		}
+		m_screen_texture = SDL_CreateTexture(m_renderer_handle, SDL_PIXELFORMAT_ARGB8888,
+			SDL_TEXTUREACCESS_STREAMING, m_screen_width, m_screen_height);
+		if (m_screen_texture == nullptr)
+		{
+			std::cerr << "Screen texture could not be created! SDL_Error: " << SDL_GetError() << std::endl;
+			return false;
+		}
+		m_screen_format = SDL_AllocFormat(SDL_PIXELFORMAT_ARGB8888);
 
 		return true;
 	}
 
 	TRWindowsApp::~TRWindowsApp()
 	{
-		//Destroy window
+		//Destroy the screen texture and window
+		SDL_FreeFormat(m_screen_format);
+		SDL_DestroyTexture(m_screen_texture);
+		SDL_DestroyRenderer(m_renderer_handle);
+		m_screen_format = nullptr;
+		m_screen_texture = nullptr;
+		m_renderer_handle = nullptr;
 		SDL_DestroyWindow(m_window_handle);
 		m_window_handle = nullptr;
 
@@ -116,30 +136,61 @@ namespace TinyRenderer
 		}
 	}
 
+	bool TRWindowsApp::getScreenPixelFormat(TRPixelFormat &format) const
+	{
+		const SDL_PixelFormat *surface_format = m_screen_format;
+		if (surface_format->BytesPerPixel != 4 || surface_format->Rloss != 0 || surface_format->Gloss != 0 || surface_format->Bloss != 0)
+			return false;
+		format.redShift = surface_format->Rshift;
+		format.greenShift = surface_format->Gshift;
+		format.blueShift = surface_format->Bshift;
+
+		//Note: the alpha of a surface without alpha channel goes to the unused byte
+		format.alphaShift = (surface_format->Amask != 0) ? 
+			surface_format->Ashift : (0 + 8 + 16 + 24) - format.redShift - format.greenShift - format.blueShift;
+		return true;
+	}
+
 	double TRWindowsApp::updateScreenSurface(
-		unsigned char *pixels,
+		const unsigned char *pixels,
 		int width,
 		int height,
 		int channel,
 		unsigned int num_cliped_faces,
-		unsigned int num_culled_faces)
+		unsigned int num_culled_faces,
+		unsigned int num_culled_meshes,
+		unsigned int num_culled_chunks,
+		unsigned int num_shaded_vertices,
+		const TRPixelFormat &format)
 	{
-		//Update pixels
-		SDL_LockSurface(m_screen_surface);
+		//Update pixels, the upload being the only copy when they're in the format of the texture
+		TRPixelFormat screen_format;
+		const bool is_screen_format = channel == 4 && getScreenPixelFormat(screen_format);
+		if (is_screen_format && format == screen_format)
 		{
-			Uint32* destPixels = (Uint32*)m_screen_surface->pixels;
-			for (int i = 0; i < width * height; ++i)
+			SDL_UpdateTexture(m_screen_texture, nullptr, pixels, width * channel);
+		}
+		else
+		{
+			void *texture_pixels;
+			int texture_pitch;
+			if (SDL_LockTexture(m_screen_texture, nullptr, &texture_pixels, &texture_pitch) == 0)
 			{
-				Uint32 color = SDL_MapRGB(
-					m_screen_surface->format, 
-					static_cast<uint8_t>(pixels[i * channel + 0]),
-					static_cast<uint8_t>(pixels[i * channel + 1]),
-					static_cast<uint8_t>(pixels[i * channel + 2]));
-				destPixels[i] = color;
+				if (is_screen_format)
+				{
+					TRFrameBuffer::convertPixels(pixels, width * channel, format,
+						static_cast<unsigned char*>(texture_pixels), texture_pitch, screen_format, width, height);
+				}
+				else
+				{
+					SDL_ConvertPixels(width, height, channel == 4 ? SDL_PIXELFORMAT_RGBA32 : SDL_PIXELFORMAT_RGB24, pixels, width * channel,
+						m_screen_format->format, texture_pixels, texture_pitch);
+				}
+				SDL_UnlockTexture(m_screen_texture);
 			}
 		}
-		SDL_UnlockSurface(m_screen_surface);
-		SDL_UpdateWindowSurface(m_window_handle);
+		SDL_RenderCopy(m_renderer_handle, m_screen_texture, nullptr, nullptr);
+		SDL_RenderPresent(m_renderer_handle);
 
 		m_delta_time = m_timer.getTicks() - m_last_time_point;
 		m_last_time_point = m_timer.getTicks();
@@ -158,6 +209,9 @@ namespace TinyRenderer
 				ss << " FPS:" << std::setiosflags(std::ios::left) << std::setw(3) << m_fps;
 				ss << "#ClipedFaces:" << std::setiosflags(std::ios::left) << std::setw(5) << num_cliped_faces;
 				ss << "#CulledFaces:" << std::setiosflags(std::ios::left) << std::setw(5) << num_culled_faces;
+				ss << "#CulledMeshes:" << std::setiosflags(std::ios::left) << std::setw(3) << num_culled_meshes;
+				ss << "#CulledChunks:" << std::setiosflags(std::ios::left) << std::setw(5) << num_culled_chunks;
+				ss << "#ShadedVertices:" << std::setiosflags(std::ios::left) << std::setw(6) << num_shaded_vertices;
 				SDL_SetWindowTitle(m_window_handle, (m_window_title + ss.str()).c_str());
 			}
 		}
@@ -3,6 +3,8 @@
 
 #include "SDL2/SDL.h"
 
+#include "TRFrameBuffer.h"
+
 #include <string>
 #include <sstream>
 #include <memory>
@@ -68,14 +70,23 @@ namespace TinyRenderer
 		int getMouseWheelDelta() const { return m_wheel_delta; }
 		bool getIsMouseLeftButtonPressed() const { return m_mouse_left_button_pressed; }
 
-		//Copy the rendered image to screen for displaying
+		//Upload the rendered image to the screen texture for displaying
+		//Note: 32-bit pixels in the format of the screen are uploaded as they are, the others are converted
+		//      in one pass while uploaded. The format only applies to 32-bit pixels.
 		double updateScreenSurface(
-			unsigned char *pixels,
+			const unsigned char *pixels,
 			int width, 
 			int height, 
 			int channel,
 			unsigned int num_cliped_faces,
-			unsigned int num_culled_faces);
+			unsigned int num_culled_faces,
+			unsigned int num_culled_meshes,
+			unsigned int num_culled_chunks,
+			unsigned int num_shaded_vertices,
+			const TRPixelFormat &format = TRPixelFormat::rgba8());
+
+		//Format of the screen texture, false if it is not made of 32-bit pixels with 8-bit channels
+		bool getScreenPixelFormat(TRPixelFormat &format) const;
 
 		static TRWindowsApp::ptr getInstance();
 		static TRWindowsApp::ptr getInstance(int width, int height, const std::string title = "winApp");
@@ -111,7 +122,9 @@ namespace TinyRenderer
 
 		//Window handler
 		SDL_Window* m_window_handle = nullptr;
-		SDL_Surface* m_screen_surface = nullptr;
+		SDL_Renderer* m_renderer_handle = nullptr;
+		SDL_Texture* m_screen_texture = nullptr;     // Streaming texture the frames are uploaded to
+		SDL_PixelFormat* m_screen_format = nullptr;
 
 		//Singleton pattern
 		static TRWindowsApp::ptr m_instance;
@@ -25,9 +25,14 @@ THE SOFTWARE.*/
 
 #include "TRWindowsApp.h"
 #include "TRRenderer.h"
+#include "TRRenderThread.h"
+#include "TRAssetLoader.h"
+#include "TRBenchmark.h"
 #include "TRUtils.h"
 
+#include <string>
 #include <iostream>
+#include <thread>
 
 using namespace TinyRenderer;
 
@@ -36,6 +41,32 @@ int main(int argc, char* args[])
 	constexpr int width =  666;
 	constexpr int height = 500;
 
+	//Texture sampling microbenchmark: CGAssignment3 --bench-texture <image>
+	if (argc > 2 && std::string(args[1]) == "--bench-texture")
+	{
+		TRTexture2D texture;
+		texture.loadTextureFromFile(args[2]);
+		TRTexture2DSampler::benchmark(texture, 1 << 22);
+		return 0;
+	}
+
+	//Offscreen rendering of a scripted camera path without any window, see TRBenchmark::parseArguments
+	//e.g. CGAssignment3 --headless --frames 120 --report report.json --golden golden
+	if (argc > 1 && std::string(args[1]) == "--headless")
+	{
+		TRBenchmark::Options options;
+		if (!TRBenchmark::parseArguments(argc - 2, args + 2, options))
+			return -1;
+		return TRBenchmark::run(options);
+	}
+
+	//Stage profiling: CGAssignment3 --profile <prefix>, written to <prefix>_trace.json and <prefix>_frames.csv on exit
+	std::string profilePrefix;
+	if (argc > 2 && std::string(args[1]) == "--profile")
+	{
+		profilePrefix = args[2];
+	}
+
 	TRWindowsApp::ptr winApp = TRWindowsApp::getInstance(width, height, "CGAssignment3: Lighting & Texturing 20337025");
 
 	if (winApp == nullptr)
@@ -45,6 +76,13 @@ int main(int argc, char* args[])
 
 	TRRenderer::ptr renderer = std::make_shared<TRRenderer>(width, height);
 
+	//Tile-binned rasterization on all the cores
+	renderer->setRasterMode(TRRasterMode::TR_RASTER_TILE_BINNED);
+	renderer->setThreadNum(std::max(1u, std::thread::hardware_concurrency()));
+
+	//Deferred shading: the lights are evaluated once per pixel instead of once per fragment
+	renderer->setShadingMode(TRShadingMode::TR_SHADING_DEFERRED);
+
 	//camera
 	glm::vec3 cameraPos = glm::vec3(0.8f, 0.0f, 3.7f);
 	glm::vec3 lookAtTarget = glm::vec3(0.0f);
@@ -52,12 +90,13 @@ int main(int argc, char* args[])
 	renderer->setViewMatrix(TRUtils::calcViewMatrix(cameraPos, lookAtTarget, glm::vec3(0.0, 1.0, 0.0f)));
 	renderer->setProjectMatrix(TRUtils::calcPerspProjectMatrix(45.0f, static_cast<float>(width) / height, 0.001f, 10.0f), 0.001f, 10.0f);
 
-	//Load the rendering data
-	TRDrawableMesh::ptr diabloMesh = std::make_shared<TRDrawableMesh>("model/diablo3_pose/diablo3_pose.obj");
-	TRDrawableMesh::ptr houseMesh = std::make_shared<TRDrawableMesh>("model/floor.obj");
-	TRDrawableMesh::ptr redLightMesh = std::make_shared<TRDrawableMesh>("model/light_red.obj");
-	TRDrawableMesh::ptr greenLightMesh = std::make_shared<TRDrawableMesh>("model/light_green.obj");
-	TRDrawableMesh::ptr blueLightMesh = std::make_shared<TRDrawableMesh>("model/light_blue.obj");
+	//Load the rendering data in the background, the meshes show up as soon as they are loaded
+	TRAssetLoader::ptr assetLoader = std::make_shared<TRAssetLoader>(std::max(1u, std::thread::hardware_concurrency()));
+	TRDrawableMesh::ptr diabloMesh = assetLoader->loadMesh("model/diablo3_pose/diablo3_pose.obj");
+	TRDrawableMesh::ptr houseMesh = assetLoader->loadMesh("model/floor.obj");
+	TRDrawableMesh::ptr redLightMesh = assetLoader->loadMesh("model/light_red.obj");
+	TRDrawableMesh::ptr greenLightMesh = assetLoader->loadMesh("model/light_green.obj");
+	TRDrawableMesh::ptr blueLightMesh = assetLoader->loadMesh("model/light_blue.obj");
 	renderer->addDrawableMesh({ houseMesh, diabloMesh, redLightMesh, greenLightMesh, blueLightMesh });
 	redLightMesh->setLightingMode(TRLightingMode::TR_LIGHTING_DISABLE);
 	greenLightMesh->setLightingMode(TRLightingMode::TR_LIGHTING_DISABLE);
@@ -80,9 +119,6 @@ int main(int argc, char* args[])
 	int redLightIndex = renderer->addPointLight(redLightPos, glm::vec3(1.0, 0.7, 1.8), glm::vec3(1.9f, 0.0f, 0.0f));
 	int greenLightIndex = renderer->addPointLight(greenLightPos, glm::vec3(1.0, 0.7, 1.8), glm::vec3(0.0f, 1.9f, 0.0f));
 	int blueLightIndex = renderer->addPointLight(blueLightPos, glm::vec3(1.0, 0.7, 1.8), glm::vec3(0.0f, 0.0f, 1.9f));
-	auto &redLight = renderer->getPointLight(redLightIndex);
-	auto &greenLight = renderer->getPointLight(greenLightIndex);
-	auto &blueLight = renderer->getPointLight(blueLightIndex);
 
 	//Task5
 	renderer->addSpotLight(cameraPos, glm::vec3(-0.03f, -0.05f, -0.97f), glm::cos(glm::radians(12.5f)), glm::cos(glm::radians(17.5f)));
@@ -102,47 +138,64 @@ int main(int argc, char* args[])
 	renderer->setModelMatrix(model_mat);
 
 	//Rendering loop
+	//Note: the frames are rendered on a thread of their own, up to two frames ahead of the one presented.
+	//      The ring is rendered in the format of the screen texture, so that presenting is a plain upload.
+	TRPixelFormat screenFormat;
+	if (!winApp->getScreenPixelFormat(screenFormat))
+		screenFormat = TRPixelFormat::rgba8();
+	renderer->setViewerPos(cameraPos);
+	TRRenderThread::ptr renderThread = std::make_shared<TRRenderThread>(renderer, width, height, screenFormat);
 	while (!winApp->shouldWindowClose())
 	{
 		//Process event
 		winApp->processEvent();
 
-		//Clear frame buffer (both color buffer and depth buffer)
-		renderer->clearColor(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
-
-		//Draw call
-		renderer->setViewerPos(cameraPos);
-		renderer->renderAllDrawableMeshes();
+		//Streaming assets
+		renderThread->submit(TRRenderThread::Command::streamAssets(assetLoader.get()));
 
-		//Display to screen
-		double deltaTime = winApp->updateScreenSurface(
-			renderer->commitRenderedColorBuffer(),
-			width, 
-			height,
-			4,
-			renderer->getNumberOfClipFaces(),
-			renderer->getNumberOfCullFaces());
+		//Display to screen, while the next frames are rendered
+		double deltaTime;
+		{
+			TRProfiler::Ticks presentBegin = TRProfiler::now();
+			const TRRenderThread::Frame &frame = renderThread->acquireFrame();
+			deltaTime = winApp->updateScreenSurface(
+				frame.pixels.data(),
+				width, 
+				height,
+				4,
+				frame.numClipedFaces,
+				frame.numCulledFaces,
+				frame.numCulledMeshes,
+				frame.numCulledChunks,
+				frame.numShadedVertices,
+				screenFormat);
+			renderThread->releaseFrame(TRProfiler::now() - presentBegin);
+		}
 
 		//Model transformation
 		{
 			redLightModelMat = glm::rotate(glm::mat4(1.0f), (float)deltaTime * 0.0008f, glm::vec3(0, 1, 0));
 			redLightPos = glm::vec3(redLightModelMat * glm::vec4(redLightPos, 1.0f));
-			redLightMesh->setModelMatrix(glm::translate(glm::mat4(1.0f), redLightPos));
-			redLight.lightPos = redLightPos;
 
 			greenLightModelMat = glm::rotate(glm::mat4(1.0f), (float)deltaTime * 0.0008f, glm::vec3(1, 1, 1));
 			greenLightPos = glm::vec3(greenLightModelMat * glm::vec4(greenLightPos, 1.0f));
-			greenLightMesh->setModelMatrix(glm::translate(glm::mat4(1.0f), greenLightPos));
-			greenLight.lightPos = greenLightPos;
 
 			blueLightModelMat = glm::rotate(glm::mat4(1.0f), (float)deltaTime * 0.0008f, glm::vec3(-1, 1, 1));
 			blueLightPos = glm::vec3(blueLightModelMat * glm::vec4(blueLightPos, 1.0f));
-			blueLightMesh->setModelMatrix(glm::translate(glm::mat4(1.0f), blueLightPos));
-			blueLight.lightPos = blueLightPos;
+
+			//Note: the lights and the meshes are only touched by the render thread
+			renderThread->submit(TRRenderThread::Command::pointLight(redLightIndex, redLightPos));
+			renderThread->submit(TRRenderThread::Command::pointLight(greenLightIndex, greenLightPos));
+			renderThread->submit(TRRenderThread::Command::pointLight(blueLightIndex, blueLightPos));
+			renderThread->submit(TRRenderThread::Command::modelMatrix(redLightMesh.get(), glm::translate(glm::mat4(1.0f), redLightPos)));
+			renderThread->submit(TRRenderThread::Command::modelMatrix(greenLightMesh.get(), glm::translate(glm::mat4(1.0f), greenLightPos)));
+			renderThread->submit(TRRenderThread::Command::modelMatrix(blueLightMesh.get(), glm::translate(glm::mat4(1.0f), blueLightPos)));
 		}
 
 		//Camera operation
 		{
+			bool cameraMoved = false;
+
 			//Camera rotation
 			if (winApp->getIsMouseLeftButtonPressed())
 			{
@@ -155,7 +208,7 @@ int main(int argc, char* args[])
 					cameraRotMat = glm::rotate(glm::mat4(1.0f), -deltaY * 0.001f, glm::vec3(1, 0, 0));
 
 				cameraPos = glm::vec3(cameraRotMat * glm::vec4(cameraPos, 1.0f));
-				renderer->setViewMatrix(TRUtils::calcViewMatrix(cameraPos, lookAtTarget, glm::vec3(0.0, 1.0, 0.0f)));
+				cameraMoved = true;
 			}
 
 			//Camera zoom in and zoom out
@@ -167,12 +220,28 @@ int main(int argc, char* args[])
 				if (glm::length(newPos - lookAtTarget) > 1.0f)
 				{
 					cameraPos = newPos;
-					renderer->setViewMatrix(TRUtils::calcViewMatrix(cameraPos, lookAtTarget, glm::vec3(0.0, 1.0, 0.0f)));
+					cameraMoved = true;
 				}
 			}
+
+			if (cameraMoved)
+			{
+				glm::mat4 viewMat = TRUtils::calcViewMatrix(cameraPos, lookAtTarget, glm::vec3(0.0, 1.0, 0.0f));
+				renderThread->submit(TRRenderThread::Command::view(viewMat, cameraPos));
+			}
 		}
 	}
 
+	//The frames in flight are finished before the renderer is released
+	renderThread = nullptr;
+
+	if (!profilePrefix.empty())
+	{
+		TRProfiler::ptr profiler = renderer->getProfiler();
+		profiler->exportChromeTrace(profilePrefix + "_trace.json");
+		profiler->exportFrameTimeCSV(profilePrefix + "_frames.csv");
+	}
+
 	renderer->unloadDrawableMesh();
 
 	return 0;